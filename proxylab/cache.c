@@ -1,63 +1,374 @@
 /*
  * 实现cache，缓存从服务器接收到的内容
- * 考虑到读者-写者问题，cache总采用第一类解决方法，即读者优先
+ * cache按URL的哈希值分为若干个独立加锁的分片，分片内用哈希表查找，淘汰顺序由可替换的策略维护（见policy.c），
+ * 查找、命中后的更新与淘汰都是O(1)，不同分片上的操作互不阻塞；
+ * 查找不加锁：写者在锁内以原子的指针写入挂入或摘除block，读者在纪元临界区内遍历桶链（见epoch.c），
+ * lru命中后要调整的队列顺序先记入访问缓冲，等下一次插入或淘汰时在锁内补做；
+ * 被摘除的block等可能看到它的读者都离开后才回收，命中的延迟不随核数与写入的频率增长；
+ * block带引用计数，命中时不拷贝，被淘汰的block等最后一个读者发送完毕后才释放；
+ * block存放在slab分配器管理的内存中，容量按实际占用的字节数计算，小对象可以紧密排列
+ * 回源时响应边转发边直接写入slab中的block，完整后才挂入哈希表，不需要中间缓冲区与最后的拷贝
+ * 启用磁盘层时，被淘汰的block降级到磁盘，超过MAX_OBJECT_SIZE的对象直接写入磁盘
+ * 快照恢复的block内容直接指向映射的快照文件，第一次被访问时才读入（见snapshot.c）
+ * 每个block带有由响应报头得出的新鲜期，过期的block由调用者向服务器重新验证，304时延长新鲜期继续使用
+ * 多进程模式下分片、哈希表与slab都位于共享内存中（见shm.c），各工作进程看到同一个cache，
+ * 工作进程崩溃时它持有的引用与正在填充的block无法归还，这部分空间不再回收
  * 
 */
 
 #include "cache.h"
+#include "epoch.h"
+#include "http.h"
+#include "shm.h"
+#include "util.h"
 
-static cache_block CB[MAX_BLOCK_NUM];
-static sem_t w;
-static sem_t mutex;
-static int readcnt;
-static unsigned int now_LRU;
+static cache_shard *shards;
+static unsigned int nshards;
+static unsigned int shard_shift; /* 哈希值右移shard_shift位得到分片号 */
+static const cache_policy *policy; /* 淘汰策略 */
+static int admission; /* 启用TinyLFU接纳 */
+static FILE *trace; /* 访问记录 */
+static unsigned int stripes; /* 已分配的访问缓冲条号 */
+static __thread int stripe = -1; /* 本线程使用的访问缓冲条号 */
+
+static cache_shard* shard_of(unsigned int hash)
+{
+    return &shards[nshards == 1 ? 0 : hash >> shard_shift];
+}
+
+/* 
+ * bucket_find 在分片中查找URL，不加锁时也可调用（须在纪元临界区内）
+ * 桶链指针用acquire读取，读到的block内容已完整
+ */
+static cache_block* bucket_find(cache_shard* sp, unsigned int hash, char* url)
+{
+    cache_block *cb = __atomic_load_n(&sp->buckets[hash & (sp->nbuckets - 1)], __ATOMIC_ACQUIRE);
+    for(; cb; cb = __atomic_load_n(&cb->hnext, __ATOMIC_ACQUIRE)){
+        if(cb->hash == hash && strcmp(cb->url, url) == 0)
+            break;
+    }
+    return cb;
+}
+
+/* 
+ * shard_remove 从哈希表和淘汰队列中摘除block并更新计数，不释放内存；调用者持有锁
+ * 摘除的block的hnext保持不变，正停在它上面的读者仍能继续遍历
+ */
+static void shard_remove(cache_shard* sp, cache_block* cb)
+{
+    cache_block **pp = &sp->buckets[cb->hash & (sp->nbuckets - 1)];
+    while(*pp != cb)
+        pp = &(*pp)->hnext;
+    __atomic_store_n(pp, cb->hnext, __ATOMIC_RELEASE);
+    policy->remove(sp, cb);
+    sp->count--;
+    sp->bytes -= cb->alloc;
+}
+
+/* 
+ * cache_set_policy 选择淘汰策略与是否启用TinyLFU接纳
+ */
+int cache_set_policy(char* name, int admit)
+{
+    const cache_policy *p = policy_find(name);
+
+    if(p == NULL)
+        return -1;
+    policy = p;
+    admission = admit;
+    return 0;
+}
+
+/* 
+ * cache_trace 打开访问记录：每次查找记一行URL，每次发布记一行URL与大小
+ */
+int cache_trace(char* path)
+{
+    if((trace = fopen(path, "a")) == NULL)
+        return -1;
+    setvbuf(trace, NULL, _IOLBF, 0); /* 每行一次写入，进程被杀死时记录仍完整 */
+    return 0;
+}
 
 /* 
  * init_cache 初始化全局变量和锁 
+ * 分片数取不超过要求的2的幂，并保证每个分片至少能容纳4个最大对象
+ */
+void init_cache(size_t cache_size, int want_shards)
+{
+    if(cache_size == 0)
+        cache_size = MAX_CACHE_SIZE;
+    if(want_shards <= 0)
+        want_shards = CACHE_SHARDS;
+
+    nshards = 1;
+    shard_shift = 32;
+    while((int)nshards * 2 <= want_shards && cache_size / (nshards * 2) >= 4 * MAX_OBJECT_SIZE){
+        nshards *= 2;
+        shard_shift--;
+    }
+
+    if(policy == NULL)
+        policy = policy_find("lru");
+    slab_init(cache_size);
+    epoch_init();
+    shards = (cache_shard*)shm_calloc(nshards, sizeof(cache_shard));
+    for(unsigned int i = 0; i < nshards; i++){
+        cache_shard *sp = &shards[i];
+        shm_mutex_init(&sp->lock);
+        sp->capacity = cache_size / nshards;
+        /* 读者不加锁，桶数组不能扩容，按容量一次分配 */
+        for(sp->nbuckets = SHARD_BUCKETS; sp->nbuckets < sp->capacity / SHARD_OBJECT_ESTIMATE; sp->nbuckets *= 2)
+            ;
+        sp->buckets = (cache_block**)shm_calloc(sp->nbuckets, sizeof(cache_block*));
+        sp->lru.next = sp->lru.prev = &sp->lru;
+        sp->small.next = sp->small.prev = &sp->small;
+        policy->init(sp);
+        if(admission)
+            sketch_init(&sp->sketch, sp->capacity / 1024);
+    }
+}
+
+/* 
+ * hit_record 把命中记入本线程那一条访问缓冲，不加锁；记录持有block的一个引用，
+ * 补做之前block即使被淘汰也不会回收；槽中还没来得及补做的旧记录直接丢弃
+ * 各线程分散在不同的条上，热点URL的命中不会都争用同一个计数器
  */
-void init_cache()
+static void hit_record(cache_shard* sp, cache_block* cb)
 {
-    sem_init(&w,0,1);
-    sem_init(&mutex,0,1);
-    readcnt = 0;
-    now_LRU = 1;
+    hit_stripe *hs;
+    cache_block *old;
+
+    if(stripe < 0)
+        stripe = __atomic_fetch_add(&stripes, 1, __ATOMIC_RELAXED) % HIT_STRIPES;
+    hs = &sp->hits[stripe];
+    __atomic_add_fetch(&cb->refcnt, 1, __ATOMIC_RELAXED); /* 调用者持有引用，计数不会是0 */
+    old = __atomic_exchange_n(&hs->slot[__atomic_fetch_add(&hs->pos, 1, __ATOMIC_RELAXED) % HIT_SLOTS],
+        cb, __ATOMIC_ACQ_REL);
+    if(old)
+        release_cache(old);
 }
 
 /* 
- * search_cache 在cache中凭URL寻找是否有已经缓存过的block，若是则直接返回给客户端
+ * hit_drain 在锁内补做访问缓冲中记下的命中，释放记录持有的引用；调用者持有锁
+ * 已被摘除的block由策略自己跳过
  */
-int search_cache(char* url, int fd)
+static void hit_drain(cache_shard* sp)
 {
-    P(&mutex);
-    readcnt++;
-    if(readcnt == 1)
-        P(&w);
-    V(&mutex);
+    cache_block *cb;
 
-    char *block = NULL;
-    int eq_i = -1;
-    size_t eq_size = 0;
-    for(int i = 0; i < MAX_BLOCK_NUM; i++){
-        if(strcmp(url,CB[i].url)==0){
-            block = (char*)Malloc(CB[i].size);
-            memcpy(block, CB[i].block, CB[i].size);
-            eq_i = i;
-            eq_size = CB[i].size;
+    if(!policy->hit_locked)
+        return;
+    for(int i = 0; i < HIT_STRIPES; i++)
+        for(int j = 0; j < HIT_SLOTS; j++)
+            if((cb = __atomic_exchange_n(&sp->hits[i].slot[j], NULL, __ATOMIC_ACQ_REL)) != NULL){
+                policy->hit(sp, cb);
+                release_cache(cb);
+            }
+}
+
+/* 
+ * lookup_cache 在cache中凭URL寻找是否有已经缓存过的block，若是则增加其引用并返回
+ * 调用者直接从block中发送内容，用完后调用release_cache；未命中时返回NULL
+ * 不加锁：引用计数已降为0的block正在被回收，视为未命中；
+ * lru策略命中后要在锁内调整队列，这里只记入访问缓冲（见hit_record）
+ */
+cache_block* lookup_cache(char* url)
+{
+    unsigned int hash = hash_url(url);
+    cache_shard *sp = shard_of(hash);
+    cache_block *cb;
+
+    if(trace)
+        fprintf(trace, "%s\n", url);
+    if(admission)
+        sketch_add(&sp->sketch, hash);
+    epoch_enter();
+    if((cb = bucket_find(sp, hash, url)) != NULL){
+        int ref = __atomic_load_n(&cb->refcnt, __ATOMIC_RELAXED);
+        do{
+            if(ref == 0){
+                cb = NULL;
+                break;
+            }
+        }while(!__atomic_compare_exchange_n(&cb->refcnt, &ref, ref + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    }
+    epoch_exit();
+    if(cb == NULL)
+        return NULL;
+    if(!policy->hit_locked)
+        policy->hit(sp, cb);
+    else
+        hit_record(sp, cb);
+    return cb;
+}
+
+/* 
+ * release_cache 释放一个引用，block已被淘汰且没有其他读者时回收内存
+ * 无锁的查找可能仍停在这个block上，回收推迟到这些查找结束之后
+ */
+void release_cache(cache_block* cb)
+{
+    if(__atomic_sub_fetch(&cb->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        epoch_retire(cb, slab_free);
+}
+
+/* 
+ * cache_fresh block是否仍在新鲜期内
+ * 快照恢复的block在第一次查找时才由报头计算新鲜期，恢复时不必读入内容
+ */
+int cache_fresh(cache_block* cb)
+{
+    time_t now = time(NULL), exp = __atomic_load_n(&cb->expires, __ATOMIC_RELAXED);
+
+    if(exp == 0){
+        exp = resp_fresh_until(cb->block, cb->size, now);
+        __atomic_store_n(&cb->expires, exp, __ATOMIC_RELAXED);
+    }
+    return exp > now;
+}
+
+void cache_refresh(cache_block* cb, time_t expires)
+{
+    __atomic_store_n(&cb->expires, expires, __ATOMIC_RELAXED);
+}
+
+/* 
+ * demote 把被淘汰的block降级到磁盘层（未启用时忽略）并释放cache持有的引用，在锁外调用
+ */
+static void demote(cache_block* cb)
+{
+    disk_store(cb->url, cb->block, cb->size);
+    release_cache(cb);
+}
+
+/* 
+ * shard_alloc 从slab中分配need字节；空间不足时按淘汰策略逐个淘汰本分片的block，
+ * 直到分配成功或分片已空（剩下的空间被其他分片、正在填充或仍在发送的block占用）
+ * 每次只在锁内摘下一个block，降级写入磁盘在锁外进行
+ */
+static cache_block* shard_alloc(cache_shard* sp, size_t need)
+{
+    cache_block *cb, *old;
+
+    while((cb = (cache_block*)slab_alloc(need)) == NULL){
+        shm_lock(&sp->lock);
+        hit_drain(sp);
+        if((old = policy->victim(sp)) != NULL)
+            shard_remove(sp, old);
+        pthread_mutex_unlock(&sp->lock);
+        if(old == NULL)
             break;
+        demote(old);
+    }
+    return cb;
+}
+
+/* 
+ * block_begin 为url分配一个正在填充的block，容量按hint预留
+ * 填充期间block不在哈希表中，其他线程看不到；内容不清零，写到哪里算到哪里
+ */
+static cache_block* block_begin(char* url, size_t hint)
+{
+    unsigned int hash = hash_url(url);
+    size_t urllen = strlen(url) + 1;
+    size_t need = sizeof(cache_block) + urllen + (hint ? hint : MAXLINE);
+    cache_block *cb;
+
+    if(hint > MAX_OBJECT_SIZE || (cb = shard_alloc(shard_of(hash), need)) == NULL)
+        return NULL;
+    memcpy(cb->url, url, urllen);
+    cb->hash = hash;
+    cb->refcnt = 1; /* 发布后即为cache持有的引用 */
+    cb->size = 0;
+    cb->alloc = slab_round(need);
+    cb->expires = 0;
+    cb->block = cb->url + urllen;
+    return cb;
+}
+
+/* 
+ * block_append 把一段内容追加到block末尾，返回block（扩容时地址会变）
+ * 只有事先不知道长度的响应才需要扩容；超过MAX_OBJECT_SIZE时放弃并返回NULL
+ */
+static cache_block* block_append(cache_block* cb, const char* buf, size_t n, size_t hint)
+{
+    size_t head = cb->block - (char*)cb;
+    size_t cap = cb->alloc - head, want;
+    cache_block *nb;
+
+    if(cb->size + n > MAX_OBJECT_SIZE || hint > MAX_OBJECT_SIZE){
+        slab_free(cb);
+        return NULL;
+    }
+    if(cb->size + n > cap){
+        want = hint >= cb->size + n ? hint : cap + cap / 2;
+        if(want < cb->size + n)
+            want = cb->size + n;
+        if(want > MAX_OBJECT_SIZE)
+            want = MAX_OBJECT_SIZE;
+        if((nb = shard_alloc(shard_of(cb->hash), head + want)) == NULL){
+            slab_free(cb);
+            return NULL;
         }
+        memcpy(nb, cb, head + cb->size);
+        nb->alloc = slab_round(head + want);
+        nb->block = (char*)nb + head;
+        slab_free(cb);
+        cb = nb;
     }
+    memcpy(cb->block + cb->size, buf, n);/* 可能是二进制文件，需用memcpy */
+    cb->size += n;
+    return cb;
+}
 
-    P(&mutex);
-    if(eq_i >= 0) 
-        CB[eq_i].LRU_tag = now_LRU++;/* 在锁的保护中，更新block的LRUtag */
-    readcnt--;
-    if(readcnt == 0)
-        V(&w);
-    V(&mutex);
+/* 
+ * block_commit 填充完成，把block原子地发布到cache中
+ * 内容写完后才以release写入挂入桶链，无锁的读者要么看不到它，要么看到完整的内容；
+ * 同一URL已有的block被替换，按淘汰策略淘汰直到放得下，被淘汰的block降级到磁盘层；
+ * 启用TinyLFU接纳时，新对象的估计访问次数不超过第一个将被淘汰的对象就不接纳
+ */
+static void block_commit(cache_block* cb)
+{
+    cache_shard *sp = shard_of(cb->hash);
+    cache_block *old, **pp, *replaced = NULL, *victims = NULL;
 
-    Rio_writen(fd, block, eq_size);/* 发送回所请求的内容 */
-    Free(block);
-    return eq_i >= 0;   
+    if(trace)
+        fprintf(trace, "%s %zu\n", cb->url, cb->size);
+    if(cb->alloc > sp->capacity){
+        slab_free(cb);
+        return;
+    }
+    shm_lock(&sp->lock);
+    hit_drain(sp); /* 先按最近的命中调整顺序，再选淘汰的block */
+    if((replaced = bucket_find(sp, cb->hash, cb->url)) != NULL) /* 已被其他线程插入，替换之 */
+        shard_remove(sp, replaced);
+    else if(admission && sp->bytes + cb->alloc > sp->capacity && (old = policy->victim(sp)) != NULL
+        && sketch_estimate(&sp->sketch, cb->hash) <= sketch_estimate(&sp->sketch, old->hash)){
+        pthread_mutex_unlock(&sp->lock);
+        demote(cb);
+        return;
+    }
+    while(sp->bytes + cb->alloc > sp->capacity && (old = policy->victim(sp)) != NULL){ /* 淘汰直到放得下 */
+        shard_remove(sp, old);
+        old->next = victims; /* 读者可能仍在经过hnext，借用已摘除的队列指针串起来 */
+        victims = old;
+    }
+    policy->insert(sp, cb); /* 先初始化策略的字段再发布 */
+    pp = &sp->buckets[cb->hash & (sp->nbuckets - 1)];
+    cb->hnext = *pp;
+    __atomic_store_n(pp, cb, __ATOMIC_RELEASE);
+    sp->count++;
+    sp->bytes += cb->alloc;
+    pthread_mutex_unlock(&sp->lock);
+
+    if(replaced)
+        release_cache(replaced);
+    while(victims){
+        old = victims;
+        victims = old->next;
+        demote(old);
+    }
 }
 
 /* 
@@ -65,25 +376,161 @@ int search_cache(char* url, int fd)
  */
 void insert_cache(char* url, char* block, size_t size)
 {
-    P(&w);
-    unsigned int min_tag = 0xffffffff;
-    int min_i, ti = -1;
-    for(int i = 0; i < MAX_BLOCK_NUM; i++){
-        if(CB[i].LRU_tag == 0){ /* 如果有空闲block，直接插入 */
-            ti = i;
-            break;
+    cache_block *cb = block_begin(url, size);
+
+    if(cb && (cb = block_append(cb, block, size, size)) != NULL){
+        cb->expires = resp_fresh_until(cb->block, cb->size, time(NULL));
+        block_commit(cb);
+    }
+}
+
+/* 
+ * lookup_disk 内存未命中时查找磁盘层，命中的小对象同时提升回内存
+ * 新鲜期由保存的报头计算，过期的对象视为未命中，由回源得到的新内容取代
+ * 调用者从磁盘层发送内容，用完后调用disk_release
+ */
+int lookup_disk(char* url, disk_hit* hit)
+{
+    time_t now = time(NULL);
+
+    if(!disk_lookup(url, hit))
+        return 0;
+    if(resp_fresh_until(disk_data(hit), hit->size, now) <= now){
+        disk_release(hit);
+        return 0;
+    }
+    if(hit->size <= MAX_OBJECT_SIZE)
+        insert_cache(url, disk_data(hit), hit->size);
+    return 1;
+}
+
+/* 
+ * cache_walk 按淘汰的先后对cache中的每个block调用fn：先是主队列从表尾到表头，再是S3-FIFO的小队列
+ * 锁内只取得各block的引用，fn在锁外调用，慢的fn不会阻塞其他线程
+ */
+void cache_walk(void (*fn)(cache_block* cb, void* arg), void* arg)
+{
+    cache_block **v, *cb;
+    unsigned int n;
+
+    for(unsigned int i = 0; i < nshards; i++){
+        cache_shard *sp = &shards[i];
+        shm_lock(&sp->lock);
+        hit_drain(sp);
+        v = (cache_block**)Malloc((sp->count + 1) * sizeof(cache_block*));
+        n = 0;
+        for(cb = sp->lru.prev; cb != &sp->lru; cb = cb->prev)
+            v[n++] = cb;
+        for(cb = sp->small.prev; cb != &sp->small; cb = cb->prev)
+            v[n++] = cb;
+        for(unsigned int j = 0; j < n; j++)
+            __atomic_add_fetch(&v[j]->refcnt, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&sp->lock);
+
+        for(unsigned int j = 0; j < n; j++){
+            fn(v[j], arg);
+            release_cache(v[j]);
         }
-        else if(CB[i].LRU_tag < min_tag){ /* 找到LRUtag最小的block */
-            min_tag = CB[i].LRU_tag;
-            min_i = i;
+        Free(v);
+    }
+}
+
+/* 
+ * cache_adopt 插入内容位于外部内存中的对象：slab中只分配结构体与URL，block指向外部的内容
+ * 内容的字节同样计入容量，淘汰与降级和其他block相同；放不下时返回-1
+ */
+int cache_adopt(char* url, char* data, size_t size)
+{
+    unsigned int hash = hash_url(url);
+    size_t urllen = strlen(url) + 1;
+    size_t need = sizeof(cache_block) + urllen;
+    cache_block *cb;
+
+    if(size > MAX_OBJECT_SIZE || (cb = shard_alloc(shard_of(hash), need)) == NULL)
+        return -1;
+    memcpy(cb->url, url, urllen);
+    cb->hash = hash;
+    cb->refcnt = 1;
+    cb->size = size;
+    cb->alloc = slab_round(need) + size;
+    cb->expires = 0; /* 第一次查找时才计算，不读入内容 */
+    cb->block = data;
+    block_commit(cb);
+    return 0;
+}
+
+/* 
+ * fill_cache_begin 开始填充url：预计不超过MAX_OBJECT_SIZE时写入内存，更大且长度已知时写入磁盘层
+ */
+int fill_cache_begin(cache_fill* f, char* url, size_t hint)
+{
+    f->cb = NULL;
+    f->on_disk = 0;
+    if(hint > MAX_OBJECT_SIZE){
+        if(disk_fill_begin(&f->disk, url, hint) < 0)
+            return -1;
+        f->on_disk = 1;
+        return 0;
+    }
+    return (f->cb = block_begin(url, hint)) != NULL ? 0 : -1;
+}
+
+/* 
+ * fill_cache_append 把转发中的一段响应追加到正在填充的对象末尾
+ * 写入内存的响应在得知长度超过MAX_OBJECT_SIZE后转到磁盘层；失败时已放弃填充，返回-1
+ */
+int fill_cache_append(cache_fill* f, const char* buf, size_t n, size_t hint)
+{
+    cache_block *cb = f->cb;
+
+    if(!f->on_disk && hint > MAX_OBJECT_SIZE){
+        if(disk_fill_begin(&f->disk, cb->url, hint) < 0){
+            slab_free(cb);
+            return -1;
         }
+        disk_fill_append(&f->disk, cb->block, cb->size);
+        slab_free(cb);
+        f->cb = NULL;
+        f->on_disk = 1;
     }
-    if(ti == -1) ti = min_i;
+    if(f->on_disk){
+        if(disk_fill_append(&f->disk, buf, n) < 0){
+            disk_fill_abort(&f->disk);
+            return -1;
+        }
+        return 0;
+    }
+    return (f->cb = block_append(cb, buf, n, hint)) != NULL ? 0 : -1;
+}
+
+/* 
+ * fill_cache_abort 放弃正在填充的对象
+ */
+void fill_cache_abort(cache_fill* f)
+{
+    if(f->on_disk)
+        disk_fill_abort(&f->disk);
+    else
+        slab_free(f->cb);
+}
+
+/* 
+ * fill_cache_commit 填充完成，发布到所在的层中
+ */
+void fill_cache_commit(cache_fill* f)
+{
+    if(f->on_disk)
+        disk_fill_commit(&f->disk);
+    else{
+        f->cb->expires = resp_fresh_until(f->cb->block, f->cb->size, time(NULL));
+        block_commit(f->cb);
+    }
+}
 
-    CB[ti].LRU_tag = now_LRU++;
-    CB[ti].size = size;
-    strcpy(CB[ti].url,url);
-    memcpy(CB[ti].block,block,size);/* 可能是二进制文件，需用memcpy */
-    V(&w);
-    return;
-}
\ No newline at end of file
+/* 
+ * cache_reap 工作进程死在读临界区中时，它的读者记录会一直阻止纪元前进，被摘除的block都无法回收
+ */
+void cache_reap(pid_t pid)
+{
+    epoch_reap(pid);
+}
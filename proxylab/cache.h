@@ -2,30 +2,108 @@
 #define __CACHE_H__
 
 #include "csapp.h"
+#include "slab.h"
+#include "disk.h"
+#include "policy.h"
 
 /* 此处定义cache相关的常量 */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
-#define MAX_BLOCK_NUM 10
+#define CACHE_SHARDS 16 /* 分片数的上限，实际分片数保证每片至少能容纳若干个最大对象 */
+#define SHARD_BUCKETS 64 /* 每个分片哈希表的最少桶数 */
+#define SHARD_OBJECT_ESTIMATE 512 /* 按平均每个对象占用的字节数估计桶数，哈希表不扩容 */
+#define HIT_STRIPES 8 /* 每个分片的访问缓冲条数，各线程固定使用其中一条 */
+#define HIT_SLOTS 16 /* 每条访问缓冲的槽数 */
 
 /* 客户端、服务器的描述符对 */
 typedef struct {
     int clientfd, serverfd;
 }fd_pair;
 
-/* cache block的结构 */
-typedef struct{
-    size_t size; /* block的大小 */
-    unsigned int LRU_tag; /* LRU策略需要的标记 */
-    char url[MAXLINE]; /* 标识block的URL */
-    char block[MAX_OBJECT_SIZE]; /* 有效内容载荷 */
+/* 
+ * cache block的结构，同时挂在分片的哈希桶链和淘汰策略的队列上
+ * 填充期间只属于回源者，发布（插入）后内容不再改变；refcnt为引用计数，cache本身持有一个引用，
+ * 每个正在发送该block的读者持有一个引用，最后一个引用释放后，等无锁的查找都离开时才回收内存
+ * 结构体、URL与内容载荷依次存放在同一个slab chunk中
+ */
+typedef struct cache_block{
+    struct cache_block *hnext; /* 哈希桶链中的下一个block */
+    struct cache_block *prev, *next; /* 淘汰队列，表头最新，表尾最先被淘汰 */
+    unsigned int hash; /* URL的哈希值 */
+    int refcnt; /* 引用计数 */
+    unsigned char freq; /* CLOCK的访问位，S3-FIFO的访问计数；命中时不加锁，原子地修改 */
+    unsigned char queue; /* S3-FIFO中所在的队列 */
+    size_t size; /* block的大小，填充期间为已写入的字节数 */
+    size_t alloc; /* 在slab中实际占用的字节数，计入cache容量 */
+    time_t expires; /* 新鲜期截止的时刻，0表示尚未计算；重新验证后原子地延长 */
+    char *block; /* 有效内容载荷，紧跟在url之后 */
+    char url[]; /* 标识block的URL */
 }cache_block;
 
-/* 初始化全局变量和锁 */
-void init_cache();
-/* 在cache中凭URL寻找是否已经缓存过，若是则直接返回 */
-int search_cache(char* url, int fd);
+/* 
+ * 访问缓冲的一条：需要在锁内处理命中的策略（lru），命中时只把block记在这里并持有它的一个引用，
+ * 到插入或淘汰时在锁内补做；写满一圈后覆盖旧的记录，被覆盖的命中不再调整顺序
+ */
+typedef struct{
+    unsigned int pos; /* 下一个写入的槽，原子地递增 */
+    struct cache_block *slot[HIT_SLOTS];
+}hit_stripe;
+
+/* cache分片，各分片独立加锁 */
+typedef struct cache_shard{
+    pthread_mutex_t lock; /* 保护写者对本分片哈希表与淘汰队列的修改，查找不加锁 */
+    cache_block **buckets; /* 哈希桶 */
+    unsigned int nbuckets; /* 桶数，总是2的幂 */
+    unsigned int count; /* block个数 */
+    size_t bytes; /* 已占用的slab字节数 */
+    size_t capacity; /* 本分片的字节上限 */
+    cache_block lru; /* 淘汰队列的哨兵：LRU链表、CLOCK环或S3-FIFO的主队列 */
+    cache_block small; /* S3-FIFO小队列的哨兵 */
+    size_t small_bytes; /* 小队列占用的字节数 */
+    ghost_fifo ghost; /* S3-FIFO的幽灵队列 */
+    freq_sketch sketch; /* TinyLFU接纳用的频率草图 */
+    hit_stripe hits[HIT_STRIPES]; /* 尚未处理的命中 */
+}cache_shard;
+
+/* 选择淘汰策略（默认lru）与是否启用TinyLFU接纳，须在init_cache之前调用；策略不存在时返回-1 */
+int cache_set_policy(char* name, int admission);
+/* 把每次查找与发布记录到path中，供cachesim回放比较各策略；失败返回-1 */
+int cache_trace(char* path);
+/* 初始化全局变量和锁，参数为0时使用默认的总容量与分片数 */
+void init_cache(size_t cache_size, int nshards);
+/* 在cache中凭URL寻找是否已经缓存过，若是则返回增加了引用的block */
+cache_block* lookup_cache(char* url);
+/* 释放lookup_cache取得的引用 */
+void release_cache(cache_block* cb);
+/* block是否仍在新鲜期内；过期的block须先向服务器重新验证才能使用 */
+int cache_fresh(cache_block* cb);
+/* 重新验证得知内容没有变化，把新鲜期延长到expires */
+void cache_refresh(cache_block* cb, time_t expires);
 /* 将新内容插入cache */
 void insert_cache(char* url, char* block, size_t size);
+/* 内存未命中时查找磁盘层，命中新鲜的对象时返回1并持有所在段的引用 */
+int lookup_disk(char* url, disk_hit* hit);
+/* 按淘汰的先后（最先被淘汰的在前）对cache中的每个block调用fn，调用期间持有block的引用 */
+void cache_walk(void (*fn)(cache_block* cb, void* arg), void* arg);
+/* 插入内容位于外部内存（如映射的快照文件）中的对象，不拷贝内容；外部内存须一直有效 */
+int cache_adopt(char* url, char* data, size_t size);
+/* 多进程模式下工作进程pid已经退出，收回它在cache中留下的读者记录 */
+void cache_reap(pid_t pid);
+
+/* 正在填充的对象：预计不超过MAX_OBJECT_SIZE时是内存中的block，否则是磁盘层中预留的记录 */
+typedef struct{
+    cache_block *cb;
+    disk_fill disk;
+    int on_disk;
+}cache_fill;
+
+/* 
+ * 边转发边填充：回源时直接把响应写入cache所有的空间，完整后原子地发布
+ * hint为预计的总字节数（未知时为0）；放不下或空间不足时放弃填充，返回-1
+ */
+int fill_cache_begin(cache_fill* f, char* url, size_t hint);
+int fill_cache_append(cache_fill* f, const char* buf, size_t n, size_t hint);
+void fill_cache_commit(cache_fill* f);
+void fill_cache_abort(cache_fill* f);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,146 @@
+/*
+ * cachesim
+ *
+ * 在proxy -T记录的访问上回放各淘汰策略与接纳组合，比较命中率；
+ * 记录中只有URL的行是一次查找，"URL 大小"的行是一次发布，回放前先收集每个URL的大小，
+ * 回放时未命中且大小已知的对象按原样插入，与代理中回源后发布的效果相同；
+ * 回放使用真实的cache实现，每种组合在单独的子进程中运行
+ *
+ * 用法：cachesim [-C cache_size] [-S shards] trace_file
+ */
+
+#include <stdio.h>
+#include "csapp.h"
+#include "cache.h"
+#include "util.h"
+
+#define SIM_BUCKETS 65536
+
+typedef struct sim_obj {
+    struct sim_obj* next;
+    size_t size; /* 0表示从未发布（不可缓存或太大） */
+    char url[];
+} sim_obj;
+
+typedef struct {
+    sim_obj** reqs; /* 按顺序的查找 */
+    size_t nreqs, cap;
+} sim_trace;
+
+static sim_obj* buckets[SIM_BUCKETS];
+static char body[MAX_OBJECT_SIZE];
+
+/*
+ * intern 取得url对应的对象，不存在时新建
+ */
+static sim_obj* intern(char* url)
+{
+    unsigned int h = hash_url(url);
+    sim_obj* o;
+
+    for (o = buckets[h % SIM_BUCKETS]; o; o = o->next)
+        if (!strcmp(o->url, url))
+            return o;
+    o = (sim_obj*)Malloc(sizeof(sim_obj) + strlen(url) + 1);
+    strcpy(o->url, url);
+    o->size = 0;
+    o->next = buckets[h % SIM_BUCKETS];
+    buckets[h % SIM_BUCKETS] = o;
+    return o;
+}
+
+/*
+ * load_trace 读入访问记录
+ */
+static void load_trace(char* path, sim_trace* t)
+{
+    char line[MAXLINE], *sp;
+    FILE* fp;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        unix_error(path);
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0')
+            continue;
+        /* 块与变体的键中有空格（见range.c、gzip.c），大小总在最后一个空格之后 */
+        sp = strrchr(line, ' ');
+        if (sp && sp[1] && strspn(sp + 1, "0123456789") == strlen(sp + 1)) {
+            *sp = '\0';
+            intern(line)->size = strtoul(sp + 1, NULL, 10);
+            continue;
+        }
+        if (t->nreqs == t->cap) {
+            t->cap = t->cap ? t->cap * 2 : 1024;
+            t->reqs = (sim_obj**)Realloc(t->reqs, t->cap * sizeof(sim_obj*));
+        }
+        t->reqs[t->nreqs++] = intern(line);
+    }
+    fclose(fp);
+}
+
+/*
+ * replay 在子进程中用一种组合回放全部查找并输出命中率
+ */
+static void replay(sim_trace* t, char* policy, int admission, size_t cache_size, int shards)
+{
+    size_t hits = 0, bytes = 0, hit_bytes = 0;
+    cache_block* cb;
+    sim_obj* o;
+
+    cache_set_policy(policy, admission);
+    init_cache(cache_size, shards);
+    for (size_t i = 0; i < t->nreqs; i++) {
+        o = t->reqs[i];
+        bytes += o->size;
+        if ((cb = lookup_cache(o->url)) != NULL) {
+            hits++;
+            hit_bytes += o->size;
+            release_cache(cb);
+        }
+        else if (o->size > 0)
+            insert_cache(o->url, body, o->size);
+    }
+    printf("%-8s %-8s %10zu %9.2f%% %9.2f%%\n", policy, admission ? "tinylfu" : "-", t->nreqs,
+        t->nreqs ? 100.0 * hits / t->nreqs : 0.0, bytes ? 100.0 * hit_bytes / bytes : 0.0);
+}
+
+int main(int argc, char** argv)
+{
+    static char* policies[] = { "lru", "clock", "s3fifo" };
+    sim_trace t = { NULL, 0, 0 };
+    size_t cache_size = 0;
+    int shards = 0, opt;
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "C:S:")) != -1) {
+        switch (opt) {
+        case 'C': /* cache的总字节数，可带K/M/G后缀 */
+            cache_size = parse_size(optarg);
+            break;
+        case 'S': /* cache分片数的上限 */
+            shards = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1) {
+usage:
+        fprintf(stderr, "usage: %s [-C cache_size] [-S shards] <trace_file>\n", argv[0]);
+        exit(1);
+    }
+
+    load_trace(argv[optind], &t);
+    printf("%-8s %-8s %10s %10s %10s\n", "policy", "admit", "requests", "hit", "byte hit");
+    fflush(stdout);
+    for (int admission = 0; admission <= 1; admission++)
+        for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+            if ((pid = Fork()) == 0) {
+                replay(&t, policies[i], admission, cache_size, shards);
+                exit(0);
+            }
+            Waitpid(pid, NULL, 0);
+        }
+    return 0;
+}
@@ -0,0 +1,379 @@
+/*
+ * cache的磁盘层
+ * 一个按段划分、只追加写入的文件，整体映射到内存中；对象依次追加在当前段的末尾，
+ * 当前段写满后启用下一段，最旧的一段被整体回收（其中的对象从索引中删除），不需要碎片整理；
+ * 内存中的索引按URL记录每个对象的位置，命中时用sendfile从页缓存直接发送；
+ * 每条记录带有记录头，重启时扫描各段即可重建索引
+ */
+
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include "disk.h"
+#include "log.h"
+#include "util.h"
+
+#define REC_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+static char *map; /* 整个段文件的映射 */
+static int dfd = -1;
+static int nsegs;
+static disk_seg *segs;
+static int cur; /* 当前写入的段 */
+static size_t pos; /* 当前段中下一条记录的偏移 */
+static uint64_t seq; /* 最近启用的段的序号 */
+static disk_obj **buckets;
+static int nobjs;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; /* 保护索引、段状态与写入位置 */
+
+static off_t seg_base(int i)
+{
+    return (off_t)i * DISK_SEGMENT_SIZE;
+}
+
+/*
+ * mark_end 在段中p处写入结束标记，重启时扫描到此为止
+ */
+static void mark_end(int i, size_t p)
+{
+    if(p + sizeof(disk_rec) <= DISK_SEGMENT_SIZE)
+        ((disk_rec*)(map + seg_base(i) + p))->magic = 0;
+}
+
+/*
+ * index_find 在索引中查找URL，pprev非空时返回指向该对象的桶链指针
+ */
+static disk_obj* index_find(unsigned int hash, char* url, disk_obj*** pprev)
+{
+    disk_obj **pp = &buckets[hash % DISK_BUCKETS];
+
+    for(; *pp; pp = &(*pp)->hnext)
+        if((*pp)->hash == hash && strcmp((*pp)->url, url) == 0)
+            break;
+    if(pprev)
+        *pprev = pp;
+    return *pp;
+}
+
+/*
+ * index_remove 从索引和所在段的链表中删除对象
+ */
+static void index_remove(disk_obj* o)
+{
+    disk_obj **pp;
+
+    index_find(o->hash, o->url, &pp);
+    *pp = o->hnext;
+    o->prev->next = o->next;
+    o->next->prev = o->prev;
+    nobjs--;
+    Free(o);
+}
+
+/*
+ * index_insert 把段seg中的对象加入索引，替换同一URL的旧对象
+ */
+static void index_insert(char* url, int seg, off_t off, size_t size)
+{
+    unsigned int hash = hash_url(url);
+    disk_obj *o, **pp;
+
+    if((o = index_find(hash, url, NULL)) != NULL)
+        index_remove(o);
+    o = (disk_obj*)Malloc(sizeof(disk_obj) + strlen(url) + 1);
+    strcpy(o->url, url);
+    o->hash = hash;
+    o->seg = seg;
+    o->off = off;
+    o->size = size;
+    pp = &buckets[hash % DISK_BUCKETS];
+    o->hnext = *pp;
+    *pp = o;
+    o->next = segs[seg].objs.next;
+    o->prev = &segs[seg].objs;
+    o->next->prev = o;
+    segs[seg].objs.next = o;
+    nobjs++;
+}
+
+/*
+ * reclaim 回收段i（删除其中的全部对象）并把它作为当前段
+ */
+static void reclaim(int i)
+{
+    disk_seghdr *hdr = (disk_seghdr*)(map + seg_base(i));
+
+    while(segs[i].objs.next != &segs[i].objs)
+        index_remove(segs[i].objs.next);
+    hdr->magic = DISK_SEG_MAGIC;
+    hdr->seq = segs[i].seq = ++seq;
+    cur = i;
+    pos = REC_ALIGN(sizeof(disk_seghdr));
+    mark_end(i, pos);
+}
+
+/*
+ * reserve 在当前段末尾预留need字节，当前段放不下时回收最旧的段；调用者持有lock
+ * 最旧的段仍有请求在读取或写入时放弃，不等待
+ */
+static int reserve(size_t need, int* seg, off_t* rec)
+{
+    int next;
+
+    if(need > DISK_SEGMENT_SIZE - REC_ALIGN(sizeof(disk_seghdr)))
+        return -1;
+    if(pos + need > DISK_SEGMENT_SIZE){
+        next = (cur + 1) % nsegs;
+        if(segs[next].pins > 0)
+            return -1;
+        reclaim(next);
+    }
+    *seg = cur;
+    *rec = seg_base(cur) + pos;
+    pos += need;
+    mark_end(cur, pos);
+    segs[cur].pins++;
+    return 0;
+}
+
+/*
+ * scan_seg 扫描段i中的记录并加入索引，返回最后一条记录之后的偏移
+ */
+static size_t scan_seg(int i)
+{
+    size_t p = REC_ALIGN(sizeof(disk_seghdr)), len;
+    disk_rec *r;
+    char *url;
+
+    while(p + sizeof(disk_rec) <= DISK_SEGMENT_SIZE){
+        r = (disk_rec*)(map + seg_base(i) + p);
+        if(r->magic != DISK_REC_LIVE && r->magic != DISK_REC_BUSY && r->magic != DISK_REC_DEAD)
+            break;
+        len = REC_ALIGN(sizeof(disk_rec) + r->urllen + r->size);
+        if(r->urllen == 0 || r->size > DISK_MAX_OBJECT || len > DISK_SEGMENT_SIZE - p)
+            break;
+        url = (char*)(r + 1);
+        if(r->magic == DISK_REC_LIVE && url[r->urllen - 1] == '\0')
+            index_insert(url, i, seg_base(i) + p + sizeof(disk_rec) + r->urllen, r->size);
+        p += len;
+    }
+    return p;
+}
+
+static int cmp_seq(const void* a, const void* b)
+{
+    uint64_t x = segs[*(const int*)a].seq, y = segs[*(const int*)b].seq;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * disk_init 打开段文件并重建索引：按序号从旧到新扫描各段，新的记录覆盖旧的
+ */
+int disk_init(char* path, size_t capacity)
+{
+    disk_seghdr *hdr;
+    int *order, n = 0;
+    size_t end = 0;
+
+    if((nsegs = capacity / DISK_SEGMENT_SIZE) < 2){
+        fprintf(stderr, "disk cache needs at least %lu bytes\n", 2 * DISK_SEGMENT_SIZE);
+        return -1;
+    }
+    if((dfd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 || ftruncate(dfd, seg_base(nsegs)) < 0){
+        perror(path);
+        return -1;
+    }
+    if((map = mmap(NULL, seg_base(nsegs), PROT_READ | PROT_WRITE, MAP_SHARED, dfd, 0)) == MAP_FAILED){
+        perror("mmap");
+        return -1;
+    }
+    segs = (disk_seg*)Calloc(nsegs, sizeof(disk_seg));
+    buckets = (disk_obj**)Calloc(DISK_BUCKETS, sizeof(disk_obj*));
+    order = (int*)Calloc(nsegs, sizeof(int));
+    for(int i = 0; i < nsegs; i++){
+        segs[i].objs.next = segs[i].objs.prev = &segs[i].objs;
+        hdr = (disk_seghdr*)(map + seg_base(i));
+        if(hdr->magic == DISK_SEG_MAGIC && hdr->seq > 0){
+            segs[i].seq = hdr->seq;
+            order[n++] = i;
+        }
+    }
+    qsort(order, n, sizeof(int), cmp_seq);
+    for(int k = 0; k < n; k++)
+        end = scan_seg(order[k]);
+    if(n == 0)
+        reclaim(0);
+    else{
+        cur = order[n - 1];
+        pos = end;
+        seq = segs[cur].seq;
+    }
+    Free(order);
+    LOG(LV_INFO, "Disk cache %s: %d segments, %d objects", path, nsegs, nobjs);
+    return 0;
+}
+
+int disk_enabled(void)
+{
+    return map != NULL;
+}
+
+/*
+ * disk_lookup 查找url，命中时增加所在段的引用，段在发送完之前不会被回收
+ */
+int disk_lookup(char* url, disk_hit* hit)
+{
+    disk_obj *o;
+
+    if(!map)
+        return 0;
+    pthread_mutex_lock(&lock);
+    if((o = index_find(hash_url(url), url, NULL)) != NULL){
+        segs[o->seg].pins++;
+        hit->seg = o->seg;
+        hit->off = o->off;
+        hit->size = o->size;
+    }
+    pthread_mutex_unlock(&lock);
+    return o != NULL;
+}
+
+void disk_release(disk_hit* hit)
+{
+    pthread_mutex_lock(&lock);
+    segs[hit->seg].pins--;
+    pthread_mutex_unlock(&lock);
+}
+
+char* disk_data(disk_hit* hit)
+{
+    return map + hit->off;
+}
+
+/*
+ * disk_send 用sendfile把命中的对象发给客户端，内容从页缓存直接进入socket
+ */
+int disk_send(int fd, disk_hit* hit)
+{
+    off_t off = hit->off;
+    size_t left = hit->size;
+    ssize_t n;
+
+    while(left > 0){
+        if((n = sendfile(fd, dfd, &off, left)) < 0){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        left -= n;
+    }
+    return 0;
+}
+
+/*
+ * disk_send_some 向非阻塞的fd发送，直到发完或对方阻塞
+ */
+int disk_send_some(int fd, off_t* off, size_t* left)
+{
+    ssize_t n;
+
+    while(*left > 0){
+        if((n = sendfile(fd, dfd, off, *left)) < 0){
+            if(errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        *left -= n;
+    }
+    return 0;
+}
+
+/*
+ * disk_fill_begin 为对象预留一条记录，记录头标记为正在写入
+ */
+int disk_fill_begin(disk_fill* df, char* url, size_t size)
+{
+    size_t urllen = strlen(url) + 1;
+    disk_rec *r;
+    int rc;
+
+    if(!map || size > DISK_MAX_OBJECT)
+        return -1;
+    pthread_mutex_lock(&lock);
+    rc = reserve(REC_ALIGN(sizeof(disk_rec) + urllen + size), &df->seg, &df->rec);
+    pthread_mutex_unlock(&lock);
+    if(rc < 0)
+        return -1;
+    r = (disk_rec*)(map + df->rec);
+    r->magic = DISK_REC_BUSY;
+    r->urllen = urllen;
+    r->size = size;
+    memcpy(r + 1, url, urllen);
+    df->size = size;
+    df->written = 0;
+    return 0;
+}
+
+/*
+ * disk_fill_append 把内容写入预留的空间，段被引用着，不需要加锁
+ */
+int disk_fill_append(disk_fill* df, const char* buf, size_t n)
+{
+    disk_rec *r = (disk_rec*)(map + df->rec);
+
+    if(df->written + n > df->size)
+        return -1;
+    memcpy((char*)(r + 1) + r->urllen + df->written, buf, n);
+    df->written += n;
+    return 0;
+}
+
+/*
+ * disk_fill_commit 内容写满后标记为有效并加入索引，写入不完整时放弃
+ */
+void disk_fill_commit(disk_fill* df)
+{
+    disk_rec *r = (disk_rec*)(map + df->rec);
+
+    if(df->written != df->size){
+        disk_fill_abort(df);
+        return;
+    }
+    r->magic = DISK_REC_LIVE;
+    pthread_mutex_lock(&lock);
+    index_insert((char*)(r + 1), df->seg, df->rec + sizeof(disk_rec) + r->urllen, df->size);
+    segs[df->seg].pins--;
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * disk_fill_abort 放弃写入，记录成为空洞，随段一起被回收
+ */
+void disk_fill_abort(disk_fill* df)
+{
+    ((disk_rec*)(map + df->rec))->magic = DISK_REC_DEAD;
+    pthread_mutex_lock(&lock);
+    segs[df->seg].pins--;
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * disk_store 把内存中淘汰的对象写入磁盘层
+ * 对象可能正是从磁盘提升上去的，内容相同时不再写一份
+ */
+void disk_store(char* url, char* data, size_t size)
+{
+    disk_fill df;
+    disk_obj *o;
+    int same;
+
+    if(!map || size > DISK_MAX_OBJECT)
+        return;
+    pthread_mutex_lock(&lock);
+    o = index_find(hash_url(url), url, NULL);
+    same = o && o->size == size && memcmp(map + o->off, data, size) == 0;
+    pthread_mutex_unlock(&lock);
+    if(same || disk_fill_begin(&df, url, size) < 0)
+        return;
+    disk_fill_append(&df, data, size);
+    disk_fill_commit(&df);
+}
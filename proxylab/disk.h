@@ -0,0 +1,88 @@
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+/* 此处定义磁盘层相关的常量 */
+#define DISK_SIZE (1UL << 30) /* 默认的磁盘层容量 */
+#define DISK_SEGMENT_SIZE (64UL << 20) /* 段的大小，空间按段整体回收 */
+#define DISK_MAX_OBJECT (DISK_SEGMENT_SIZE / 4) /* 磁盘层能缓存的最大对象 */
+#define DISK_BUCKETS (1 << 16)
+
+#define DISK_SEG_MAGIC 0x5345474dU /* 段头 */
+#define DISK_REC_LIVE 0x4c495645U  /* 有效的对象 */
+#define DISK_REC_BUSY 0x42555359U  /* 正在写入，重启时跳过 */
+#define DISK_REC_DEAD 0x44454144U  /* 放弃写入的空洞 */
+
+/* 段头，位于每段的开头 */
+typedef struct{
+    uint32_t magic;
+    uint32_t pad;
+    uint64_t seq; /* 段被启用的顺序，重启时据此判断新旧 */
+}disk_seghdr;
+
+/* 记录头，其后依次是URL（含结尾的'\0'）与内容，整条记录按8字节对齐 */
+typedef struct{
+    uint32_t magic;
+    uint32_t urllen;
+    uint64_t size;
+}disk_rec;
+
+/* 索引中的一个对象 */
+typedef struct disk_obj{
+    struct disk_obj *hnext; /* 哈希桶链 */
+    struct disk_obj *prev, *next; /* 所在段的对象链表，段被回收时据此删除 */
+    unsigned int hash;
+    int seg;
+    off_t off; /* 内容在文件中的偏移 */
+    size_t size;
+    char url[];
+}disk_obj;
+
+/* 段的状态 */
+typedef struct{
+    uint64_t seq;
+    int pins; /* 正在读取或写入本段的请求数，不为0时不能回收 */
+    disk_obj objs; /* 对象链表的哨兵 */
+}disk_seg;
+
+/* 命中的对象，持有所在段的引用 */
+typedef struct{
+    int seg;
+    off_t off;
+    size_t size;
+}disk_hit;
+
+/* 正在写入的对象，已在段中预留空间 */
+typedef struct{
+    int seg;
+    off_t rec; /* 记录头在文件中的偏移 */
+    size_t size, written;
+}disk_fill;
+
+/* 打开（或新建）path处的段文件并重建索引，失败时返回-1，此后磁盘层不启用 */
+int disk_init(char* path, size_t capacity);
+/* 磁盘层是否启用 */
+int disk_enabled(void);
+/* 查找url，命中时返回1并增加所在段的引用 */
+int disk_lookup(char* url, disk_hit* hit);
+/* 释放disk_lookup取得的引用 */
+void disk_release(disk_hit* hit);
+/* 命中对象的内容（映射在内存中） */
+char* disk_data(disk_hit* hit);
+/* 用sendfile把命中的对象发给客户端，失败返回-1 */
+int disk_send(int fd, disk_hit* hit);
+/* 非阻塞地继续发送，*off与*left随之推进；对方阻塞时返回0，出错返回-1 */
+int disk_send_some(int fd, off_t* off, size_t* left);
+/* 为size字节的对象预留空间，失败返回-1 */
+int disk_fill_begin(disk_fill* df, char* url, size_t size);
+/* 追加内容，超过预留的大小时返回-1 */
+int disk_fill_append(disk_fill* df, const char* buf, size_t n);
+/* 写满后发布到索引中 */
+void disk_fill_commit(disk_fill* df);
+void disk_fill_abort(disk_fill* df);
+/* 把内存中淘汰的对象降级写入磁盘，已有相同内容时不再写 */
+void disk_store(char* url, char* data, size_t size);
+
+#endif
@@ -0,0 +1,263 @@
+/*
+ * 进程内的DNS缓存
+ * 按(host, port)缓存getaddrinfo的结果，成功的结果存活ttl秒，失败的结果存活DNS_NEG_TTL秒；
+ * 解析由后台线程完成：常用的主机在结果过期前就被刷新，过期后在刷新完成前继续使用旧的地址，
+ * 热门的服务器因此从不等待解析器；事件驱动路径通过eventfd得知解析完成，不会阻塞事件循环
+ */
+
+#include <stdint.h>
+#include "dns.h"
+#include "uring.h"
+#include "timer.h"
+#include "stats.h"
+
+static dns_entry *buckets[DNS_BUCKETS];
+static dns_entry *qhead, *qtail; /* 等待解析的项 */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; /* 保护以上全部与各项的字段 */
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER; /* 解析队列非空 */
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER; /* 有解析完成 */
+static int ttl = DNS_TTL;
+
+/*
+ * find_entry 找到(host, port)对应的项，create非0时不存在则新建
+ * 新建时顺便回收同一桶中已经过期且无人使用的项，表的大小随活跃的主机数而不是见过的主机数增长
+ */
+static dns_entry* find_entry(char* host, char* port, int create)
+{
+    unsigned int h = 5381;
+    dns_entry **pp, *e;
+    time_t now = time(NULL);
+
+    for(char *p = host; *p; p++)
+        h = h * 33 + (unsigned char)*p;
+    for(char *p = port; *p; p++)
+        h = h * 33 + (unsigned char)*p;
+    for(pp = &buckets[h % DNS_BUCKETS]; (e = *pp) != NULL; ){
+        if(strcmp(e->host, host) == 0 && strcmp(e->port, port) == 0)
+            return e;
+        if(create && !e->pending && !e->watchers && now >= e->expires && now >= e->stale){
+            *pp = e->next;
+            if(e->addrs)
+                dns_release(e->addrs);
+            Free(e->host);
+            Free(e->port);
+            Free(e);
+            continue;
+        }
+        pp = &e->next;
+    }
+    if(!create)
+        return NULL;
+    e = (dns_entry*)Calloc(1, sizeof(dns_entry));
+    e->host = (char*)Malloc(strlen(host) + 1);
+    strcpy(e->host, host);
+    e->port = (char*)Malloc(strlen(port) + 1);
+    strcpy(e->port, port);
+    e->next = buckets[h % DNS_BUCKETS];
+    buckets[h % DNS_BUCKETS] = e;
+    return e;
+}
+
+/*
+ * enqueue 把项交给后台线程解析，已在队列中时忽略
+ */
+static void enqueue(dns_entry* e)
+{
+    if(e->pending)
+        return;
+    e->pending = 1;
+    e->qnext = NULL;
+    if(qtail)
+        qtail->qnext = e;
+    else
+        qhead = e;
+    qtail = e;
+    pthread_cond_signal(&work);
+}
+
+/*
+ * lookup_locked 查询一项，调用者持有lock
+ * 需要时发起后台解析；已有可用的结果时返回1，*out为增加了引用的地址表或NULL（解析失败）
+ */
+static int lookup_locked(dns_entry* e, dns_addrs** out)
+{
+    time_t now = time(NULL);
+
+    /* 成功的结果在最后四分之一的存活期内就开始刷新，失败的结果到期后才重试 */
+    if(!e->resolved || now >= e->expires || (e->err == 0 && now >= e->expires - ttl / 4))
+        enqueue(e);
+    if(e->addrs && now < e->stale){
+        __atomic_add_fetch(&e->addrs->refcnt, 1, __ATOMIC_RELAXED);
+        *out = e->addrs;
+        return 1;
+    }
+    if(e->resolved && now < e->expires){
+        *out = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * resolver 后台解析线程
+ */
+static void* resolver(void* vargp)
+{
+    struct addrinfo hints, *ai;
+    dns_addrs *old;
+    dns_entry *e;
+    dns_watcher *w;
+    uint64_t one = 1;
+    time_t now;
+    int rc;
+
+    Pthread_detach(pthread_self());
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    while(1){
+        pthread_mutex_lock(&lock);
+        while(qhead == NULL)
+            pthread_cond_wait(&work, &lock);
+        e = qhead;
+        if((qhead = e->qnext) == NULL)
+            qtail = NULL;
+        pthread_mutex_unlock(&lock);
+
+        rc = getaddrinfo(e->host, e->port, &hints, &ai);
+
+        pthread_mutex_lock(&lock);
+        now = time(NULL);
+        old = NULL;
+        if(rc == 0){
+            old = e->addrs;
+            e->addrs = (dns_addrs*)Malloc(sizeof(dns_addrs));
+            e->addrs->refcnt = 1; /* 表项持有的引用 */
+            e->addrs->ai = ai;
+            e->expires = now + ttl;
+            e->stale = now + 2 * ttl; /* 刷新一直失败时，旧地址最多再用一个存活期 */
+        }
+        else
+            e->expires = now + DNS_NEG_TTL;
+        e->err = rc;
+        e->resolved = 1;
+        e->pending = 0;
+        pthread_cond_broadcast(&done);
+        while((w = e->watchers) != NULL){
+            e->watchers = w->next;
+            write(w->fd, &one, sizeof(one));
+            Free(w);
+        }
+        pthread_mutex_unlock(&lock);
+        if(old)
+            dns_release(old);
+    }
+    return NULL;
+}
+
+/*
+ * dns_init 设置TTL并启动后台解析线程
+ */
+void dns_init(int t)
+{
+    pthread_t tid;
+
+    if(t > 0)
+        ttl = t;
+    for(int i = 0; i < DNS_THREADS; i++)
+        Pthread_create(&tid, NULL, resolver, NULL);
+}
+
+/*
+ * dns_resolve 阻塞地取得地址表，只有没有可用结果时才等待后台线程
+ */
+dns_addrs* dns_resolve(char* host, char* port)
+{
+    dns_addrs *ap;
+    dns_entry *e;
+
+    pthread_mutex_lock(&lock);
+    e = find_entry(host, port, 1);
+    while(!lookup_locked(e, &ap))
+        pthread_cond_wait(&done, &lock);
+    pthread_mutex_unlock(&lock);
+    return ap;
+}
+
+/*
+ * dns_lookup 非阻塞地查询，没有可用结果时登记fd，解析完成后通知
+ */
+int dns_lookup(char* host, char* port, int fd, dns_addrs** out)
+{
+    dns_watcher *w;
+    dns_entry *e;
+    int rc;
+
+    pthread_mutex_lock(&lock);
+    e = find_entry(host, port, 1);
+    if((rc = lookup_locked(e, out)) == 0 && fd >= 0){
+        w = (dns_watcher*)Malloc(sizeof(dns_watcher));
+        w->fd = fd;
+        w->next = e->watchers;
+        e->watchers = w;
+    }
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+/*
+ * dns_unwatch 注销fd，解析线程之后不会再向它写入
+ */
+void dns_unwatch(char* host, char* port, int fd)
+{
+    dns_watcher **pp, *w = NULL;
+    dns_entry *e;
+
+    pthread_mutex_lock(&lock);
+    if((e = find_entry(host, port, 0)) != NULL)
+        for(pp = &e->watchers; *pp; pp = &(*pp)->next)
+            if((*pp)->fd == fd){
+                w = *pp;
+                *pp = w->next;
+                break;
+            }
+    pthread_mutex_unlock(&lock);
+    Free(w);
+}
+
+/*
+ * dns_release 释放地址表的引用，最后一个引用释放时回收
+ */
+void dns_release(dns_addrs* ap)
+{
+    if(__atomic_sub_fetch(&ap->refcnt, 1, __ATOMIC_ACQ_REL) == 0){
+        freeaddrinfo(ap->ai);
+        Free(ap);
+    }
+}
+
+/*
+ * dns_connect 依次尝试缓存中的地址，建立阻塞的连接；启用io_uring时由本线程的ring发起连接
+ * 每个地址的连接限时timeouts[TO_CONNECT]秒，超时后换下一个地址
+ */
+int dns_connect(char* host, char* port)
+{
+    dns_addrs *ap;
+    struct addrinfo *p;
+    int fd = -1;
+
+    if((ap = dns_resolve(host, port)) == NULL)
+        return -1;
+    for(p = ap->ai; p; p = p->ai_next){
+        if((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        if(uring_connect(uring_get(), fd, p->ai_addr, p->ai_addrlen, timeouts[TO_CONNECT] * 1000) == 0)
+            break;
+        if(errno == ETIMEDOUT)
+            stats_add(STAT_TIMEOUT_CONNECT, 1);
+        close(fd);
+        fd = -1;
+    }
+    dns_release(ap);
+    return fd;
+}
@@ -0,0 +1,54 @@
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+
+/* 此处定义DNS缓存相关的常量 */
+#define DNS_BUCKETS 256
+#define DNS_TTL 60     /* 默认解析结果的存活秒数（getaddrinfo不提供记录本身的TTL） */
+#define DNS_NEG_TTL 5  /* 解析失败的结果的存活秒数 */
+#define DNS_THREADS 4  /* 后台解析线程数 */
+
+/* 一次解析得到的地址表，带引用计数，刷新后旧表等最后一个使用者释放 */
+typedef struct dns_addrs{
+    int refcnt;
+    struct addrinfo *ai;
+}dns_addrs;
+
+/* 等待解析结果的事件驱动连接，通过eventfd通知 */
+typedef struct dns_watcher{
+    struct dns_watcher *next;
+    int fd;
+}dns_watcher;
+
+/* 一个(host, port)的解析结果 */
+typedef struct dns_entry{
+    struct dns_entry *next; /* 哈希桶链 */
+    struct dns_entry *qnext; /* 解析队列 */
+    char *host, *port;
+    dns_addrs *addrs; /* 最近一次成功的结果，没有时为NULL */
+    int err;          /* 最近一次解析的getaddrinfo返回值，0表示成功 */
+    int resolved;     /* 至少完成过一次解析 */
+    int pending;      /* 已在解析队列中或正在解析 */
+    time_t expires;   /* 到期后重新解析 */
+    time_t stale;     /* addrs最迟可用到的时间，刷新失败时旧地址仍可用到此时 */
+    dns_watcher *watchers;
+}dns_entry;
+
+/* 设置TTL并启动后台解析线程，ttl为0时使用默认值 */
+void dns_init(int ttl);
+/* 阻塞地取得(host, port)的地址表（增加引用），解析失败返回NULL */
+dns_addrs* dns_resolve(char* host, char* port);
+/*
+ * 非阻塞地查询：已有结果时返回1，*out为地址表（解析失败时为NULL）；
+ * 需要等待解析时返回0，fd非负时解析完成后向fd写入，之后再次调用即可取得结果
+ */
+int dns_lookup(char* host, char* port, int fd, dns_addrs** out);
+/* 不再等待解析结果，之后调用者可以关闭fd */
+void dns_unwatch(char* host, char* port, int fd);
+/* 释放地址表的引用 */
+void dns_release(dns_addrs* ap);
+/* 与open_clientfd相同，但地址取自DNS缓存；失败返回-1 */
+int dns_connect(char* host, char* port);
+
+#endif
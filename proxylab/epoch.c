@@ -0,0 +1,188 @@
+/*
+ * 基于纪元的内存回收（epoch-based reclamation）
+ * 读者不加锁，只在进入时把全局纪元记在自己的记录中；写者把对象从共享结构中摘除后交给epoch_retire，
+ * 所有正在读的线程都已看到当前纪元时全局纪元才前进，对象在纪元前进两次之后才回收，
+ * 此时摘除之前进入的读者必定都已离开，读者因此可以无锁地遍历共享结构
+ * 多进程模式下全局纪元与读者记录位于共享内存中，纪元只有在所有进程的读者都跟上后才前进；
+ * 待回收的对象仍由摘除它的进程自己保存与回收，纪元用CAS推进，不需要进程间的锁
+ */
+
+#include "epoch.h"
+#include "shm.h"
+
+static epoch_shared *sh;
+static epoch_garbage *garbage, **garbage_tail = &garbage; /* 本进程摘除的对象，按纪元递增排列 */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; /* 保护garbage */
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static __thread epoch_rec *self;
+
+/*
+ * rec_release 线程退出时交还读者记录
+ */
+static void rec_release(void* p)
+{
+    epoch_rec *r = (epoch_rec*)p;
+
+    __atomic_store_n(&r->state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+}
+
+static void key_create(void)
+{
+    pthread_key_create(&key, rec_release);
+}
+
+/*
+ * after_fork 新的工作进程中只有调用fork的线程，它继承的记录与待回收的对象都属于父进程
+ */
+static void after_fork(void)
+{
+    self = NULL;
+    garbage = NULL;
+    garbage_tail = &garbage;
+    pthread_mutex_init(&lock, NULL);
+}
+
+void epoch_init(void)
+{
+    size_t n = shm_enabled() ? EPOCH_SHM_RECS : 0;
+
+    sh = (epoch_shared*)shm_calloc(1, sizeof(epoch_shared) + n * sizeof(epoch_rec));
+    sh->global_epoch = 1;
+    if(n)
+        pthread_atfork(NULL, NULL, after_fork);
+}
+
+/*
+ * rec_new 新建一条记录：多进程模式下从预先分配的pool中取，用尽时返回NULL
+ */
+static epoch_rec* rec_new(void)
+{
+    unsigned int i;
+
+    if(!shm_enabled())
+        return (epoch_rec*)Calloc(1, sizeof(epoch_rec));
+    if((i = __atomic_fetch_add(&sh->npool, 1, __ATOMIC_RELAXED)) >= EPOCH_SHM_RECS){
+        __atomic_store_n(&sh->npool, EPOCH_SHM_RECS, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    return &sh->pool[i];
+}
+
+/*
+ * rec_get 取得本线程的读者记录，优先复用已退出线程的记录
+ * 多进程模式下记录用尽时等待其他线程退出
+ */
+static epoch_rec* rec_get(void)
+{
+    struct timespec ts = { 0, 1000000 };
+    epoch_rec *r;
+    int zero;
+
+    if(self)
+        return self;
+    pthread_once(&once, key_create);
+    while(1){
+        for(r = __atomic_load_n(&sh->recs, __ATOMIC_ACQUIRE); r; r = r->next){
+            zero = 0;
+            if(!__atomic_load_n(&r->used, __ATOMIC_RELAXED)
+                && __atomic_compare_exchange_n(&r->used, &zero, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                break;
+        }
+        if(r != NULL)
+            break;
+        if((r = rec_new()) != NULL){
+            r->used = 1;
+            r->next = __atomic_load_n(&sh->recs, __ATOMIC_RELAXED);
+            while(!__atomic_compare_exchange_n(&sh->recs, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                ;
+            break;
+        }
+        nanosleep(&ts, NULL);
+    }
+    r->pid = getpid();
+    pthread_setspecific(key, r);
+    return self = r;
+}
+
+/*
+ * epoch_enter 记下当前纪元，之后的读取不会早于这一写入被其他线程看到
+ */
+void epoch_enter(void)
+{
+    epoch_rec *r = rec_get();
+
+    __atomic_store_n(&r->state, (__atomic_load_n(&sh->global_epoch, __ATOMIC_RELAXED) << 1) | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(void)
+{
+    __atomic_store_n(&self->state, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * try_advance 所有正在读的线程都已处于当前纪元时把全局纪元加一
+ * 其他进程可能同时推进，用CAS保证纪元只从检查过的值前进一步；被抢先时同样算作已前进
+ */
+static int try_advance(void)
+{
+    unsigned long g = __atomic_load_n(&sh->global_epoch, __ATOMIC_ACQUIRE), s;
+
+    for(epoch_rec *r = __atomic_load_n(&sh->recs, __ATOMIC_ACQUIRE); r; r = r->next){
+        s = __atomic_load_n(&r->state, __ATOMIC_SEQ_CST);
+        if((s & 1) && (s >> 1) != g)
+            return 0;
+    }
+    __atomic_compare_exchange_n(&sh->global_epoch, &g, g + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/*
+ * epoch_retire 登记待回收的对象，并回收纪元已前进两次的对象
+ * 回调在锁外调用
+ */
+void epoch_retire(void* p, void (*fn)(void*))
+{
+    epoch_garbage *g = (epoch_garbage*)Malloc(sizeof(epoch_garbage)), *done, *keep;
+
+    g->p = p;
+    g->fn = fn;
+    g->next = NULL;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); /* 摘除先于读取读者的纪元 */
+    pthread_mutex_lock(&lock);
+    g->epoch = __atomic_load_n(&sh->global_epoch, __ATOMIC_ACQUIRE);
+    *garbage_tail = g;
+    garbage_tail = &g->next;
+    for(int i = 0; i < 2 && try_advance(); i++)
+        ;
+    done = garbage;
+    for(keep = garbage; keep && keep->epoch + 2 <= __atomic_load_n(&sh->global_epoch, __ATOMIC_ACQUIRE);
+        keep = keep->next)
+        ;
+    if((garbage = keep) == NULL)
+        garbage_tail = &garbage;
+    pthread_mutex_unlock(&lock);
+
+    while(done != keep){
+        g = done;
+        done = g->next;
+        g->fn(g->p);
+        Free(g);
+    }
+}
+
+/*
+ * epoch_reap 收回死亡进程的读者记录
+ * 记录上的线程都已不存在，清除正在读的标记，纪元不会因为它们停止前进
+ */
+void epoch_reap(pid_t pid)
+{
+    for(epoch_rec *r = __atomic_load_n(&sh->recs, __ATOMIC_ACQUIRE); r; r = r->next){
+        if(__atomic_load_n(&r->used, __ATOMIC_ACQUIRE) && r->pid == pid){
+            __atomic_store_n(&r->state, 0, __ATOMIC_RELEASE);
+            __atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+        }
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include "csapp.h"
+
+/* 此处定义纪元回收相关的常量 */
+#define EPOCH_SHM_RECS 4096 /* 多进程模式下预先分配的读者记录数，即所有进程同时存在的线程数的上限 */
+
+/* 每个线程的读者记录，线程退出后留给之后的线程复用 */
+typedef struct epoch_rec{
+    struct epoch_rec *next;
+    int used; /* 已被某个线程占用 */
+    pid_t pid; /* 占用者所在的进程，进程死亡后据此收回 */
+    unsigned long state; /* 进入时的全局纪元左移一位，最低位表示正在读 */
+}epoch_rec;
+
+/* 等待回收的内存 */
+typedef struct epoch_garbage{
+    struct epoch_garbage *next;
+    void *p;
+    void (*fn)(void*);
+    unsigned long epoch; /* 摘除时的全局纪元 */
+}epoch_garbage;
+
+/* 所有进程共享的部分：全局纪元与读者记录表 */
+typedef struct{
+    unsigned long global_epoch;
+    epoch_rec *recs; /* 所有读者记录，只增不减 */
+    unsigned int npool; /* 多进程模式下pool中已启用的记录数 */
+    epoch_rec pool[]; /* 多进程模式下预先分配的记录 */
+}epoch_shared;
+
+/* 建立全局纪元与读者记录表，多进程模式下位于共享内存中；在init_cache中调用 */
+void epoch_init(void);
+/* 进入读临界区，期间读到的共享对象不会被回收；不可嵌套，不可阻塞 */
+void epoch_enter(void);
+/* 离开读临界区 */
+void epoch_exit(void);
+/* p已从所有共享结构中摘除，等进入时可能看到它的读者都离开后调用fn(p) */
+void epoch_retire(void* p, void (*fn)(void*));
+/* 进程pid已经死亡，收回它占用的读者记录，它停在读临界区中时不再阻止纪元前进 */
+void epoch_reap(pid_t pid);
+
+#endif
@@ -0,0 +1,1272 @@
+/*
+ * 基于epoll的事件驱动前端
+ * 每个CPU核心运行一个事件循环，所有循环共享同一个监听描述符（EPOLLEXCLUSIVE避免惊群）；
+ * 所有描述符均为非阻塞，每个连接作为一个状态机推进：
+ *   读请求 -> 连接服务器 -> 转发请求 -> 回传响应
+ * CONNECT请求在连接建立后进入双向隧道状态，隧道数据用splice在内核中转发（见tunnel.c）。
+ * 缓存接口与多线程路径相同，命中时pin住cache block，直接从cache内存非阻塞地写回；
+ * 磁盘层命中时持有所在段的引用，用sendfile非阻塞地写回；
+ * 未命中时优先从连接池取得到服务器的空闲连接，响应按http_resp分帧，完整后连接放回连接池。
+ * 服务器地址取自DNS缓存，需要等待解析时进入ST_RESOLVE，由eventfd得知解析完成（见dns.c）。
+ * 同一URL并发的未命中只有第一个连接回源，其余连接进入ST_FOLLOW，由eventfd通知新数据到达（见flight.c）。
+ * 过期的cache block带着条件报头回源，响应报头完整后才决定转发响应还是改为发送cache中的内容。
+ * 计数器与延迟直方图记在每个循环线程自己的统计记录中（见stats.c）。
+ * 客户端保持连接时，一个事务完成后回到读请求状态，req中已收到的流水线请求按顺序继续处理。
+ * 每个循环有自己的时间轮，连接按所处的阶段挂一个定时器：等待请求、读请求头、连接服务器各从进入阶段时计时，
+ * 转发响应每次有进展都推后期限（只改deadline，定时器到期时才按新的期限重新挂上）；隧道不限时。
+ * 单个字节范围的请求进入ST_RANGE，依次发送cache中的各段，缺失的块经ST_STREAM回源后回到ST_RANGE（见range.c）。
+ * 启用压缩变体时，接受gzip的客户端优先命中变体；变体在回源的响应发布之后由后台线程压缩生成（见gzip.c）。
+ */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "event.h"
+#include "cache.h"
+#include "http.h"
+#include "tunnel.h"
+#include "upstream.h"
+#include "flight.h"
+#include "dns.h"
+#include "stats.h"
+#include "log.h"
+#include "timer.h"
+#include "range.h"
+#include "gzip.h"
+
+#define MAX_EVENTS 256
+#define PUMP_ROUNDS 16 /* 每次事件中单个方向最多转发的轮数，避免一个连接饿死其他连接 */
+
+typedef enum {
+    ST_REQUEST, /* 读取请求行与请求报头 */
+    ST_RESOLVE, /* 等待后台线程解析服务器地址，serverfd为通知用的eventfd */
+    ST_CONNECT, /* 等待非阻塞connect完成 */
+    ST_FORWARD, /* 向服务器发送请求 */
+    ST_STREAM,  /* 把服务器的响应回传给客户端，同时收集缓存内容 */
+    ST_TUNNEL,  /* CONNECT隧道，双向转发 */
+    ST_FOLLOW,  /* 加入同一URL上进行中的回源，随数据到达写回客户端 */
+    ST_REPLY,   /* 把已准备好的内容（缓存命中、错误信息）写回客户端 */
+    ST_RANGE    /* 按Range请求依次写回各段，缺失的块经ST_STREAM回源 */
+} conn_state;
+
+/* 单方向的中转缓冲区 */
+typedef struct {
+    char buf[MAXLINE]; /* 中转缓冲区 */
+    char* data;        /* 待写出的数据，指向buf或mem */
+    size_t len;        /* 待写出的字节数 */
+    char* mem;         /* 需要Free的外部内存 */
+    cache_block* pin;  /* 正在发送的cache block，写完后释放引用 */
+    disk_hit disk;     /* 内存数据之后待发送的磁盘层对象，off与size随发送推进 */
+    int on_disk;       /* disk有效，写完后释放引用 */
+    int eof;           /* 数据源已关闭 */
+    int shut;          /* 已对目标端调用shutdown */
+    size_t bytes;      /* 从数据源读到的字节数 */
+} relay_t;
+
+typedef struct conn {
+    conn_state state;
+    int clientfd, serverfd;
+    unsigned cli_events, srv_events; /* 已在epoll中注册的事件 */
+    int is_https;
+    int closed;
+    struct conn* next_dead;
+
+    char req[MAXBUF]; /* 客户端请求 */
+    size_t reqlen;
+    http_req rq;    /* 当前请求的解析状态，各部分指向req；rq.len之后是流水线中的下一个请求 */
+    int keepalive;  /* 客户端要求在本次响应之后保持连接 */
+    char url[MAXLINE];
+
+    relay_t up;   /* 客户端 -> 服务器 */
+    relay_t down; /* 服务器 -> 客户端 */
+    splice_pipe sup, sdown; /* 隧道两个方向的splice管道 */
+    int spliced;  /* 隧道使用splice；管道创建失败时退回up/down的用户空间拷贝 */
+
+    dns_addrs* addrs; /* 服务器的地址表 */
+    struct addrinfo* ai_next; /* 尚未尝试的服务器地址 */
+    char* host;   /* 服务器的主机名与端口，用于连接池 */
+    char port[NI_MAXSERV];
+    char* request; /* 发往服务器的请求，复用的连接失效时重发 */
+    size_t request_len;
+    int reused;    /* serverfd取自连接池 */
+    int slot;      /* 占用着到该服务器的一个连接名额（见upstream_acquire） */
+    http_resp resp; /* 服务器响应的分帧状态 */
+    flight* flight; /* 本连接的回源，或ST_FOLLOW时加入的回源（serverfd为其通知用的eventfd） */
+    int leader;     /* 本连接负责回源 */
+
+    cache_fill fill; /* 正在填充的对象，响应完整后发布 */
+    int filling;
+    int can_cache;
+    cache_block* stale; /* 正在重新验证的过期block，持有引用 */
+    size_t held;        /* 重新验证时down.buf中已攒下、尚未转发的响应报头字节数 */
+    range_ctx* range;   /* Range请求的状态，回源时响应交给它切块 */
+
+    uint64_t t_start;   /* 收到请求的时间，0表示不统计本事务的延迟 */
+    uint64_t t_connect; /* 开始建立服务器连接的时间 */
+
+    timer_node timer; /* 当前阶段的超时，挂在所属循环的时间轮上 */
+    int tkind;        /* 当前阶段的超时类别，-1表示不限时 */
+    uint64_t deadline; /* 当前阶段的期限，timer_now的毫秒 */
+} conn_t;
+
+typedef struct {
+    int epfd;
+    int listenfd;
+    conn_t* dead; /* 本轮事件处理完后再释放的连接 */
+    timer_wheel wheel; /* 本循环所有连接的超时 */
+    uint64_t now; /* 本轮epoll_wait返回的时间 */
+} event_loop;
+
+static int start_connect(conn_t* c);
+static int reply_error(conn_t* c, char* cause, char* errnum, char* shortmsg, char* longmsg);
+static void relay_reset(relay_t* r);
+static int connect_upstream(conn_t* c);
+static void close_server(conn_t* c);
+static int resolve_upstream(conn_t* c);
+
+
+/*
+ * set_interest 使描述符在epoll中注册的事件与want一致
+ */
+static void set_interest(event_loop* lp, int fd, conn_t* c, unsigned* cur, unsigned want)
+{
+    struct epoll_event ev;
+
+    if (fd < 0 || want == *cur)
+        return;
+    ev.events = want;
+    ev.data.ptr = c;
+    if (*cur == 0)
+        epoll_ctl(lp->epfd, EPOLL_CTL_ADD, fd, &ev);
+    else if (want == 0)
+        epoll_ctl(lp->epfd, EPOLL_CTL_DEL, fd, &ev);
+    else
+        epoll_ctl(lp->epfd, EPOLL_CTL_MOD, fd, &ev);
+    *cur = want;
+}
+
+
+/*
+ * relay_pending 是否还有待写出的数据
+ */
+static int relay_pending(relay_t* r)
+{
+    return r->len > 0 || r->on_disk;
+}
+
+
+/*
+ * update_interest 根据连接状态计算两端需要关注的事件
+ */
+static void update_interest(event_loop* lp, conn_t* c)
+{
+    unsigned cli = 0, srv = 0;
+
+    switch (c->state) {
+    case ST_REQUEST:
+        cli = EPOLLIN;
+        break;
+    case ST_RESOLVE:
+        srv = EPOLLIN;
+        break;
+    case ST_CONNECT:
+    case ST_FORWARD:
+        srv = EPOLLOUT;
+        break;
+    case ST_TUNNEL:
+        if (c->spliced) {
+            if (c->up.len || splice_want_dst(&c->sup))
+                srv |= EPOLLOUT;
+            else if (splice_want_src(&c->sup))
+                cli |= EPOLLIN;
+            if (c->down.len || splice_want_dst(&c->sdown))
+                cli |= EPOLLOUT;
+            else if (splice_want_src(&c->sdown))
+                srv |= EPOLLIN;
+            break;
+        }
+        if (c->up.len)
+            srv |= EPOLLOUT;
+        else if (!c->up.eof)
+            cli |= EPOLLIN;
+        /* fall through */
+    case ST_STREAM:
+    case ST_REPLY:
+    case ST_FOLLOW:
+    case ST_RANGE:
+        if (relay_pending(&c->down))
+            cli |= EPOLLOUT;
+        else if (!c->down.eof)
+            srv |= EPOLLIN;
+        break;
+    }
+    set_interest(lp, c->clientfd, c, &c->cli_events, cli);
+    set_interest(lp, c->serverfd, c, &c->srv_events, srv);
+}
+
+
+/*
+ * relay_set 让中转缓冲区待写出一段外部数据，own非0时写完后Free
+ */
+static void relay_set(relay_t* r, char* data, size_t len, int own)
+{
+    r->data = data;
+    r->len = len;
+    r->mem = own ? data : NULL;
+}
+
+
+/*
+ * relay_flush 尽可能把中转缓冲区的数据写到fd，出错返回-1
+ */
+static int relay_flush(int fd, relay_t* r)
+{
+    ssize_t n;
+
+    while (r->len > 0) {
+        stats_add(STAT_SYSCALLS, 1);
+        n = write(fd, r->data, r->len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        r->data += n;
+        r->len -= n;
+    }
+    if (r->mem) {
+        Free(r->mem);
+        r->mem = NULL;
+    }
+    if (r->pin) {
+        release_cache(r->pin);
+        r->pin = NULL;
+    }
+    if (r->on_disk) {
+        stats_add(STAT_SYSCALLS, 1);
+        if (disk_send_some(fd, &r->disk.off, &r->disk.size) < 0)
+            return -1;
+        if (r->disk.size > 0)
+            return 0;
+        disk_release(&r->disk);
+        r->on_disk = 0;
+    }
+    return 0;
+}
+
+
+/*
+ * stream_tap 把服务器响应直接写入正在填充的对象，放不下时放弃缓存
+ */
+static void stream_tap(conn_t* c, char* buf, size_t size)
+{
+    /* 不可缓存的响应可能是私有的，不交给合并的请求；已知过大的响应也不为它们缓冲 */
+    if (c->resp.state != RESP_HEAD && (!resp_cacheable(&c->resp) || c->resp.expected > FLIGHT_MAX))
+        flight_detach(c->flight);
+    if (c->can_cache && c->resp.state != RESP_HEAD && !resp_cacheable(&c->resp)) { /* no-store等不缓存 */
+        if (c->filling)
+            fill_cache_abort(&c->fill);
+        c->filling = c->can_cache = 0;
+    }
+    if (!c->can_cache)
+        return;
+    if (!c->filling)
+        c->filling = (fill_cache_begin(&c->fill, c->url, c->resp.expected) == 0);
+    if (c->filling)
+        c->filling = (fill_cache_append(&c->fill, buf, size, c->resp.expected) == 0);
+    c->can_cache = c->filling;
+}
+
+
+/*
+ * stream_done 服务器的响应已收完：完整的响应发布到cache并结束回源，
+ * 不必等客户端写完，合并的请求即可尽早结束；先插入cache，之后的请求不会再未命中
+ */
+static void stream_done(conn_t* c)
+{
+    if (c->resp.state != RESP_DONE && c->resp.state != RESP_UNTIL_EOF)
+        return; /* 响应不完整，由finish_transaction中止回源 */
+    int committed = c->filling;
+
+    if (c->filling)
+        fill_cache_commit(&c->fill);
+    c->filling = 0;
+    c->can_cache = 0;
+    if (c->flight) {
+        flight_finish(c->flight, 1, resp_reusable(&c->resp));
+        flight_release(c->flight);
+        c->flight = NULL;
+    }
+    if (committed)
+        gzip_store(c->url);
+}
+
+
+/*
+ * stream_revalidated 重新验证得到304：延长过期block的新鲜期，改为把它的内容发给客户端，
+ * 同时交给合并的请求；304没有响应体，服务器连接照常复用
+ */
+static void stream_revalidated(conn_t* c)
+{
+    cache_block* cb = c->stale;
+    int persistent = resp_persistent(cb->block, cb->size);
+
+    cache_refresh(cb, resp_refresh(&c->resp, cb->block, cb->size, time(NULL)));
+    gzip_refresh(cb);
+    stats_add(STAT_REVALIDATED, 1);
+    stats_add(STAT_BYTES_OUT, cb->size);
+    flight_append(c->flight, cb->block, cb->size);
+    flight_finish(c->flight, 1, persistent);
+    flight_release(c->flight);
+    c->flight = NULL;
+    if (c->keepalive)
+        c->keepalive = persistent;
+    c->stale = NULL;
+    c->down.pin = cb; /* 引用转给中转缓冲区，发送完毕后释放 */
+    relay_set(&c->down, cb->block, cb->size, 0);
+}
+
+
+/*
+ * relay_pump 从src读出数据并写到dst，直到任一端阻塞；出错返回-1
+ * tap非空时，读到的数据同时交给stream_tap收集；重新验证时先在缓冲区中攒下响应报头
+ */
+static int relay_pump(conn_t* c, int src, int dst, relay_t* r, int tap)
+{
+    ssize_t n;
+    size_t held, outlen;
+    char* out;
+    int k;
+
+    for (int round = 0; round < PUMP_ROUNDS; round++) {
+        if (relay_flush(dst, r) < 0)
+            return -1;
+        if (r->len > 0 || r->eof || src < 0)
+            break;
+        held = tap ? c->held : 0;
+        stats_add(STAT_SYSCALLS, 1);
+        n = read(src, r->buf + held, MAXLINE - held);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        if (n == 0) {
+            r->eof = 1;
+            break;
+        }
+        if (tap) {
+            /* 只转发属于本响应的字节，响应完整后不再读取 */
+            if (c->resp.total == 0)
+                stats_record(HIST_TTFB, stats_now() - c->t_start);
+            n = resp_feed(&c->resp, r->buf + held, n);
+            stats_add(STAT_BYTES_IN, n);
+            if (c->range) {
+                /* 响应按块缓存，只转发客户端需要的部分 */
+                if ((k = range_feed(c->range, &c->resp, r->buf, n, &out, &outlen)) < 0)
+                    return c->range->head_sent ? -1
+                        : reply_error(c, c->url, "502", "Bad Gateway", "Proxy could not handle the response");
+                if (k > 0)
+                    r->eof = 1;
+                stats_add(STAT_BYTES_OUT, outlen);
+                r->bytes += n;
+                relay_set(r, out, outlen, 0);
+                continue;
+            }
+            if (c->stale) {
+                /* 报头完整之前不知道是不是304；报头超出缓冲区时放弃重新验证 */
+                n += held;
+                c->held = n;
+                if (c->resp.state == RESP_HEAD && c->held < MAXLINE)
+                    continue;
+                c->held = 0;
+                if (c->resp.status == 304) {
+                    stream_revalidated(c);
+                    r->eof = 1;
+                    continue; /* 接着写出cache中的内容 */
+                }
+                release_cache(c->stale);
+                c->stale = NULL;
+            }
+            stats_add(STAT_BYTES_OUT, n);
+            stream_tap(c, r->buf, n);
+            flight_append(c->flight, r->buf, n);
+            if (c->resp.state == RESP_DONE)
+                r->eof = 1;
+        }
+        r->bytes += n;
+        relay_set(r, r->buf, n, 0);
+    }
+    if (tap && r->eof)
+        stream_done(c);
+    /* 隧道中一个方向结束后，把半关闭传递给另一端 */
+    if (c->state == ST_TUNNEL && r->eof && r->len == 0 && !r->shut) {
+        shutdown(dst, SHUT_WR);
+        r->shut = 1;
+    }
+    return 0;
+}
+
+
+/*
+ * tunnel_pump 推进CONNECT隧道，先写完中转缓冲区中的初始数据，之后用splice转发
+ */
+static int tunnel_pump(conn_t* c)
+{
+    if (!c->spliced) {
+        if (relay_pump(c, c->serverfd, c->clientfd, &c->down, 0) < 0)
+            return -1;
+        return relay_pump(c, c->clientfd, c->serverfd, &c->up, 0);
+    }
+    if (relay_flush(c->clientfd, &c->down) < 0 || relay_flush(c->serverfd, &c->up) < 0)
+        return -1;
+    if (c->down.len == 0 && splice_pump(&c->sdown, c->serverfd, c->clientfd) < 0)
+        return -1;
+    if (c->up.len == 0 && splice_pump(&c->sup, c->clientfd, c->serverfd) < 0)
+        return -1;
+    return 0;
+}
+
+
+/*
+ * reply 准备写回客户端的内容并进入ST_REPLY状态
+ */
+static int reply(conn_t* c, char* data, size_t len, int own)
+{
+    c->state = ST_REPLY;
+    relay_set(&c->down, data, len, own);
+    c->down.eof = 1;
+    return relay_flush(c->clientfd, &c->down);
+}
+
+
+/*
+ * reply_error 向客户端返回错误信息；Range请求的206报头已经发出时只能关闭连接
+ */
+static int reply_error(conn_t* c, char* cause, char* errnum, char* shortmsg, char* longmsg)
+{
+    if (c->range && c->range->head_sent)
+        return -1;
+    char* buf = (char*)Malloc(MAXBUF);
+    stats_add(STAT_ERRORS, 1);
+    c->keepalive = 0; /* 请求可能没有读完，回复错误后关闭连接 */
+    size_t len = build_clienterror(buf, MAXBUF, cause, errnum, shortmsg, longmsg);
+    return reply(c, buf, len, 1);
+}
+
+
+/*
+ * fetch_alone 回源者脱离时跟随者还没有发出任何字节，退出合并，用事先编好的请求自行回源
+ */
+static int fetch_alone(conn_t* c)
+{
+    flight_unwatch(c->flight, c->serverfd);
+    flight_release(c->flight);
+    c->flight = NULL;
+    close_server(c);
+    c->leader = 1;
+    return connect_upstream(c);
+}
+
+
+/*
+ * follow_pump 把回源者新收到的字节写回客户端，直到客户端阻塞或暂无新数据
+ */
+static int follow_pump(conn_t* c)
+{
+    uint64_t cnt;
+    size_t n;
+    int state;
+
+    stats_add(STAT_SYSCALLS, 1);
+    if (read(c->serverfd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) /* 清除通知 */
+        return -1;
+    for (int round = 0; round < PUMP_ROUNDS; round++) {
+        if (relay_flush(c->clientfd, &c->down) < 0)
+            return -1;
+        if (c->down.len > 0 || c->down.eof)
+            break;
+        if ((n = flight_read(c->flight, c->down.bytes, c->down.buf, MAXLINE, 0, &state)) == 0) {
+            if (state == FLIGHT_ABORTED)
+                return c->down.bytes ? -1
+                    : reply_error(c, c->url, "502", "Bad Gateway", "Proxy could not connect to the server");
+            if (state == FLIGHT_DETACHED)
+                return c->down.bytes ? -1 : fetch_alone(c);
+            if (state == FLIGHT_DONE) {
+                c->down.eof = 1;
+                c->keepalive = c->keepalive && c->flight->persistent;
+            }
+            break;
+        }
+        c->down.bytes += n;
+        stats_add(STAT_BYTES_OUT, n);
+        relay_set(&c->down, c->down.buf, n, 0);
+    }
+    return 0;
+}
+
+
+/*
+ * range_pump 依次写回range_next给出的各段，直到客户端阻塞；缺失的块向服务器请求，
+ * 响应在ST_STREAM中交给range_feed，回源结束后由range_fetched回到ST_RANGE
+ */
+static int range_pump(conn_t* c)
+{
+    range_ctx* rg = c->range;
+    range_src s;
+
+    while (1) {
+        if (relay_flush(c->clientfd, &c->down) < 0)
+            return -1;
+        if (relay_pending(&c->down) || c->down.eof)
+            return 0;
+        switch (range_next(rg, &s)) {
+        case RANGE_DONE:
+            stats_add(rg->fetched ? STAT_MISSES : STAT_HITS, 1);
+            c->down.eof = 1;
+            c->keepalive = c->keepalive && rg->persistent;
+            return 0;
+        case RANGE_FAIL:
+            return reply_error(c, c->url, "502", "Bad Gateway", "Proxy could not handle the response");
+        case RANGE_FETCH:
+            if (c->request == NULL)
+                c->request = (char*)Malloc(MAXBUF + MAXLINE);
+            c->request_len = build_request(c->request, MAXBUF + MAXLINE, &c->rq, rg->cond);
+            return connect_upstream(c);
+        }
+        /* 来源的引用转给中转缓冲区，发送完毕后释放 */
+        stats_add(STAT_BYTES_OUT, s.len);
+        c->down.pin = s.cb;
+        if (s.on_disk) {
+            c->down.disk = s.disk;
+            c->down.on_disk = 1;
+            relay_set(&c->down, NULL, 0, 0);
+        }
+        else
+            relay_set(&c->down, s.data, s.len, 0);
+    }
+}
+
+
+/*
+ * release_slot 服务器连接已放回连接池或关闭，归还占用的名额
+ */
+static void release_slot(conn_t* c)
+{
+    if (c->slot) {
+        upstream_release(c->host, c->port);
+        c->slot = 0;
+    }
+}
+
+
+/*
+ * close_server 关闭与服务器的连接
+ */
+static void close_server(conn_t* c)
+{
+    if (c->serverfd >= 0) {
+        close(c->serverfd);
+        c->serverfd = -1;
+        c->srv_events = 0;
+    }
+}
+
+
+/*
+ * on_connected 与服务器的连接已建立，开始转发请求或建立隧道
+ */
+static int on_connected(conn_t* c)
+{
+    if (c->addrs)
+        dns_release(c->addrs);
+    c->addrs = NULL;
+    c->ai_next = NULL;
+    if (!c->reused)
+        stats_record(HIST_CONNECT, stats_now() - c->t_connect);
+
+    if (c->is_https) {
+        /* 通知客户端连接成功，up中可能已有客户端提前发来的数据 */
+        c->state = ST_TUNNEL;
+        relay_set(&c->down, (char*)https_hdr, strlen(https_hdr), 0);
+        if (splice_open(&c->sup) == 0) {
+            if (splice_open(&c->sdown) == 0)
+                c->spliced = 1;
+            else
+                splice_close(&c->sup);
+        }
+        return tunnel_pump(c);
+    }
+
+    c->state = ST_FORWARD;
+    if (relay_flush(c->serverfd, &c->up) < 0)
+        return -1;
+    if (c->up.len > 0)
+        return 0;
+    c->state = ST_STREAM;
+    return relay_pump(c, c->serverfd, c->clientfd, &c->down, 1);
+}
+
+
+/*
+ * start_connect 依次尝试候选地址，发起非阻塞connect
+ */
+static int start_connect(conn_t* c)
+{
+    struct addrinfo* p;
+    int fd;
+
+    while ((p = c->ai_next) != NULL) {
+        c->ai_next = p->ai_next;
+        fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+        if (fd < 0)
+            continue;
+        c->serverfd = fd;
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+            return on_connected(c);
+        if (errno == EINPROGRESS) {
+            c->state = ST_CONNECT;
+            return 0;
+        }
+        close_server(c);
+    }
+    dns_release(c->addrs);
+    c->addrs = NULL;
+    return reply_error(c, c->url, "502", "Bad Gateway", "Proxy could not connect to the server");
+}
+
+
+/*
+ * handle_connect 非阻塞connect完成，失败时换下一个地址
+ */
+static int handle_connect(conn_t* c)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(c->serverfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+        close_server(c);
+        return start_connect(c);
+    }
+    return on_connected(c);
+}
+
+
+/*
+ * handle_request 请求报头已读完，查询cache或连接服务器
+ */
+static int handle_request(conn_t* c)
+{
+    http_req* rq = &c->rq;
+    cache_block* cb = NULL;
+    disk_hit* dh = &c->down.disk;
+    char cond[RESP_COND_MAX];
+    LOG(LV_INFO, "%.*s %.*s %.*s", (int)rq->method.len, rq->method.p, (int)rq->url.len, rq->url.p,
+        (int)rq->version.len, rq->version.p);
+    c->keepalive = rq->keepalive;
+    c->t_start = stats_now();
+    stats_add(STAT_REQUESTS, 1);
+    if (rq->url.len >= sizeof(c->url))
+        return reply_error(c, "", "414", "URI Too Long", "Proxy could not handle the request");
+    span_copy(c->url, sizeof(c->url), rq->url); /* URL是cache的键，需要以'\0'结尾 */
+
+    if (span_is(rq->method, "CONNECT"))
+        c->is_https = 1;
+    else if (!span_is(rq->method, "GET")) {
+        char method[MAXLINE];
+        span_copy(method, sizeof(method), rq->method);
+        return reply_error(c, method, "501", "Not Implemented",
+            "Tiny does not implement this method");
+    }
+
+    if (!c->is_https && stats_request(c->url)) {
+        /* 统计页由代理自己回答 */
+        char* page;
+        size_t len = stats_response(&page);
+        c->t_start = 0;
+        return reply(c, page, len, 1);
+    }
+    if (!c->is_https && req_header(rq, "Range") != NULL) {
+        /* 单个字节范围由代理自己拼出206，不与同一URL的普通回源合并 */
+        c->range = (range_ctx*)Malloc(sizeof(range_ctx));
+        if (range_begin(c->range, c->url, rq) == 0) {
+            c->host = (char*)Malloc(rq->host.len + 1);
+            span_copy(c->host, rq->host.len + 1, rq->host);
+            span_copy(c->port, sizeof(c->port), rq->port);
+            c->state = ST_RANGE;
+            return range_pump(c);
+        }
+        Free(c->range);
+        c->range = NULL;
+    }
+    if (!c->is_https && (cb = gzip_lookup(rq, c->url)) == NULL
+        && (cb = lookup_cache(c->url)) != NULL && !cache_fresh(cb)) {
+        /* 客户端接受gzip时优先用新鲜的压缩变体；过期的对象有验证器时带上条件报头回源，否则与未命中相同 */
+        if (build_conditional(cond, sizeof(cond), cb->block, cb->size) > 0)
+            c->stale = cb;
+        else
+            release_cache(cb);
+        cb = NULL;
+    }
+    if (cb != NULL) {
+        /* 直接从cache内存发送，发送完毕后释放引用；没有分帧的响应发送后必须关闭连接 */
+        if (c->keepalive)
+            c->keepalive = resp_persistent(cb->block, cb->size);
+        stats_add(STAT_HITS, 1);
+        stats_add(STAT_BYTES_OUT, cb->size);
+        c->down.pin = cb;
+        return reply(c, cb->block, cb->size, 0);
+    }
+    if (!c->is_https && c->stale == NULL && lookup_disk(c->url, dh)) {
+        /* 磁盘层命中，用sendfile从页缓存发送，发送完毕后释放段的引用 */
+        if (c->keepalive)
+            c->keepalive = resp_persistent(disk_data(dh), dh->size);
+        stats_add(STAT_DISK_HITS, 1);
+        stats_add(STAT_BYTES_OUT, dh->size);
+        c->down.on_disk = 1;
+        return reply(c, NULL, 0, 0);
+    }
+
+    /* 连接池与DNS缓存以主机名与端口字符串为键 */
+    c->host = (char*)Malloc(rq->host.len + 1);
+    span_copy(c->host, rq->host.len + 1, rq->host);
+    span_copy(c->port, sizeof(c->port), rq->port);
+    if (c->is_https) {
+        /* 报头之后客户端可能已经发来的数据，连接建立后转发给服务器 */
+        c->keepalive = 0;
+        size_t left = c->reqlen - rq->len;
+        memcpy(c->up.buf, c->req + rq->len, left);
+        relay_set(&c->up, c->up.buf, left, 0);
+        c->up.bytes = left;
+    }
+    else {
+        /* 同一URL已有进行中的回源时加入它，不再连接服务器；带凭据的请求的响应可能因人而异，不合并
+         * 请求先编好，回源者脱离时跟随者改为自行回源 */
+        stats_add(c->stale ? STAT_STALE : STAT_MISSES, 1);
+        c->request = (char*)Malloc(MAXBUF + MAXLINE);
+        c->request_len = build_request(c->request, MAXBUF + MAXLINE, rq, c->stale ? cond : NULL);
+        c->can_cache = req_storable(rq, c->stale ? cond : NULL);
+        c->leader = 1;
+        if (!req_credentials(rq))
+            c->flight = flight_join(c->url, &c->leader);
+        if (!c->leader) {
+            stats_add(STAT_COALESCED, 1);
+            if ((c->serverfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+                return -1;
+            flight_watch(c->flight, c->serverfd);
+            c->state = ST_FOLLOW;
+            return follow_pump(c);
+        }
+    }
+    return connect_upstream(c);
+}
+
+
+/*
+ * connect_upstream 取得到服务器的连接：GET请求先占用该服务器的连接名额，
+ * 优先复用连接池中的空闲连接，否则发起新连接；复用的连接失效后重试时沿用已占用的名额
+ */
+static int connect_upstream(conn_t* c)
+{
+    int fd;
+
+    if (!c->is_https) {
+        relay_set(&c->up, c->request, c->request_len, 0);
+        resp_init(&c->resp);
+        c->held = 0;
+        if (!c->slot) {
+            /* 事件循环不能等待名额，已满时直接回复503 */
+            if (upstream_acquire(c->host, c->port, 0) < 0)
+                return reply_error(c, c->host, "503", "Service Unavailable",
+                    "Too many connections to the server");
+            c->slot = 1;
+        }
+        if ((fd = upstream_take(c->host, c->port)) >= 0) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            c->serverfd = fd;
+            c->reused = 1;
+            return on_connected(c);
+        }
+    }
+    c->reused = 0;
+    c->t_connect = stats_now();
+    return resolve_upstream(c);
+}
+
+
+/*
+ * resolve_upstream 从DNS缓存取得服务器地址并发起连接；没有可用结果时登记eventfd，
+ * 进入ST_RESOLVE等待后台线程解析，不阻塞事件循环
+ */
+static int resolve_upstream(conn_t* c)
+{
+    int fd;
+
+    if (!dns_lookup(c->host, c->port, -1, &c->addrs)) {
+        if ((fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+            return -1;
+        if (!dns_lookup(c->host, c->port, fd, &c->addrs)) {
+            c->serverfd = fd;
+            c->state = ST_RESOLVE;
+            return 0;
+        }
+        close(fd); /* 两次查询之间已解析完成 */
+    }
+    if (c->addrs == NULL)
+        return reply_error(c, c->host, "502", "Bad Gateway", "Proxy could not resolve the server");
+    c->ai_next = c->addrs->ai;
+    return start_connect(c);
+}
+
+
+/*
+ * retry_upstream 复用的连接在收到任何响应之前失效（服务器已关闭空闲连接），换一条新连接重发请求
+ */
+static int retry_upstream(conn_t* c)
+{
+    close_server(c);
+    c->down.eof = 0;
+    c->state = ST_CONNECT;
+    return connect_upstream(c);
+}
+
+
+/*
+ * range_fetched Range请求的一次回源结束：可复用的服务器连接放回连接池，回到ST_RANGE继续发送
+ */
+static int range_fetched(event_loop* lp, conn_t* c)
+{
+    if (resp_reusable(&c->resp) && c->serverfd >= 0) {
+        set_interest(lp, c->serverfd, c, &c->srv_events, 0);
+        upstream_put(c->host, c->port, c->serverfd);
+        c->serverfd = -1;
+    }
+    close_server(c);
+    release_slot(c);
+    relay_reset(&c->down);
+    c->reused = 0;
+    c->state = ST_RANGE;
+    if (range_fetch_end(c->range, &c->resp) < 0)
+        return reply_error(c, c->url, "502", "Bad Gateway", "Proxy could not connect to the server");
+    return range_pump(c);
+}
+
+
+/*
+ * parse_request 解析req中新到达的行，请求报头完整时开始处理，否则继续等待
+ */
+static int parse_request(conn_t* c)
+{
+    switch (req_parse(&c->rq, c->req, c->reqlen)) {
+    case REQ_DONE:
+        return handle_request(c);
+    case REQ_BAD:
+        return reply_error(c, "", "400", "Bad Request", "Proxy could not parse the request");
+    }
+    if (c->reqlen == sizeof(c->req))
+        return reply_error(c, "", "400", "Bad Request", "Request header too large");
+    return 0;
+}
+
+
+/*
+ * read_request 读取客户端请求，直到读完全部报头
+ */
+static int read_request(conn_t* c)
+{
+    ssize_t n;
+    int rc;
+
+    for (;;) {
+        stats_add(STAT_SYSCALLS, 1);
+        n = read(c->clientfd, c->req + c->reqlen, sizeof(c->req) - c->reqlen);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        if (n == 0)
+            return -1;
+        c->reqlen += n;
+
+        if ((rc = parse_request(c)) < 0 || c->state != ST_REQUEST)
+            return rc;
+    }
+}
+
+
+/*
+ * conn_done 连接上的事务是否已经完成
+ */
+static int conn_done(conn_t* c)
+{
+    switch (c->state) {
+    case ST_STREAM:
+    case ST_REPLY:
+    case ST_FOLLOW:
+    case ST_RANGE:
+        return c->down.eof && !relay_pending(&c->down);
+    case ST_TUNNEL:
+        if (c->spliced)
+            return c->down.len == 0 && c->up.len == 0
+                && splice_done(&c->sdown) && splice_done(&c->sup);
+        return c->down.eof && c->down.len == 0 && c->up.eof && c->up.len == 0;
+    default:
+        return 0;
+    }
+}
+
+
+/*
+ * conn_keepalive 已完成的事务之后能否在同一连接上继续处理下一个请求
+ */
+static int conn_keepalive(conn_t* c)
+{
+    if (!c->keepalive)
+        return 0;
+    return c->state == ST_REPLY || c->state == ST_FOLLOW || c->state == ST_RANGE
+        || (c->state == ST_STREAM && resp_reusable(&c->resp));
+}
+
+
+/*
+ * finish_transaction 结束当前事务：中止未完成的回源，可复用的服务器连接放回连接池，
+ * 释放本次请求的资源
+ */
+static void finish_transaction(event_loop* lp, conn_t* c)
+{
+    if (c->t_start && !c->is_https && conn_done(c))
+        stats_record(HIST_LATENCY, stats_now() - c->t_start);
+    c->t_start = 0;
+    if (c->flight) {
+        /* 完整的回源已在stream_done中结束，此处只剩中止的回源；跟随者注销eventfd后才能关闭它 */
+        if (c->leader)
+            flight_finish(c->flight, 0, 0);
+        else
+            flight_unwatch(c->flight, c->serverfd);
+        flight_release(c->flight);
+        c->flight = NULL;
+    }
+    if (c->state == ST_STREAM && resp_reusable(&c->resp) && c->serverfd >= 0) {
+        /* 先从epoll中移除，再放回连接池 */
+        set_interest(lp, c->serverfd, c, &c->srv_events, 0);
+        upstream_put(c->host, c->port, c->serverfd);
+        c->serverfd = -1;
+    }
+    if (c->state == ST_RESOLVE) /* 注销后才能关闭eventfd */
+        dns_unwatch(c->host, c->port, c->serverfd);
+    if (c->addrs)
+        dns_release(c->addrs);
+    c->addrs = NULL;
+    close_server(c);
+    release_slot(c);
+    Free(c->request);
+    Free(c->host);
+    if (c->filling)
+        fill_cache_abort(&c->fill);
+    if (c->stale)
+        release_cache(c->stale);
+    c->stale = NULL;
+    if (c->range) {
+        range_end(c->range);
+        Free(c->range);
+        c->range = NULL;
+    }
+    c->request = c->host = NULL;
+    c->filling = 0;
+    c->can_cache = 0;
+}
+
+
+/*
+ * relay_reset 清空中转缓冲区的状态，供同一连接上的下一个事务使用
+ */
+static void relay_reset(relay_t* r)
+{
+    r->data = NULL;
+    r->len = 0;
+    r->eof = r->shut = 0;
+    r->bytes = 0;
+}
+
+
+/*
+ * next_request 客户端保持连接，回到读请求状态；req中剩余的字节是流水线中的后续请求
+ */
+static int next_request(event_loop* lp, conn_t* c)
+{
+    finish_transaction(lp, c);
+    relay_reset(&c->up);
+    relay_reset(&c->down);
+    c->reused = 0;
+
+    c->reqlen -= c->rq.len;
+    memmove(c->req, c->req + c->rq.len, c->reqlen);
+    req_init(&c->rq);
+    c->state = ST_REQUEST;
+    c->tkind = -1; /* 新的请求重新计时 */
+    return parse_request(c);
+}
+
+
+/*
+ * close_conn 关闭连接；内存在本轮事件处理完后释放
+ */
+static void close_conn(event_loop* lp, conn_t* c)
+{
+    finish_transaction(lp, c);
+    if (c->state == ST_TUNNEL) {
+        size_t up = c->up.bytes, down = c->down.bytes;
+        if (c->spliced) {
+            up += c->sup.bytes;
+            down += c->sdown.bytes;
+            splice_close(&c->sup);
+            splice_close(&c->sdown);
+        }
+        LOG(LV_INFO, "Tunnel to %s closed, %zu bytes up, %zu bytes down", c->url, up, down);
+    }
+    timer_del(&lp->wheel, &c->timer);
+    close(c->clientfd);
+    Free(c->up.mem);
+    Free(c->down.mem);
+    if (c->down.pin)
+        release_cache(c->down.pin);
+    if (c->down.on_disk)
+        disk_release(&c->down.disk);
+    c->closed = 1;
+    c->next_dead = lp->dead;
+    lp->dead = c;
+}
+
+
+/*
+ * conn_timer 按连接所处的阶段设置定时器：转发响应时每次调用都推后期限，其余阶段从进入时计时
+ */
+static void conn_timer(event_loop* lp, conn_t* c)
+{
+    int kind;
+
+    switch (c->state) {
+    case ST_REQUEST:
+        kind = c->reqlen ? TO_HEADER : TO_IDLE;
+        break;
+    case ST_RESOLVE:
+    case ST_CONNECT:
+        kind = TO_CONNECT;
+        break;
+    case ST_TUNNEL:
+        kind = -1;
+        break;
+    default:
+        kind = TO_BODY;
+    }
+    if (kind >= 0 && timeouts[kind] == 0)
+        kind = -1;
+    if (kind == c->tkind && kind != TO_BODY)
+        return;
+    if (kind < 0) {
+        timer_del(&lp->wheel, &c->timer);
+        c->tkind = -1;
+        return;
+    }
+    c->deadline = lp->now + (uint64_t)timeouts[kind] * 1000;
+    if (kind != c->tkind) /* 同一阶段中期限只会推后，到期时再按新的期限挂上 */
+        timer_add(&lp->wheel, &c->timer, c->deadline);
+    c->tkind = kind;
+}
+
+
+/*
+ * settle 一次处理之后：事务完成时继续流水线中的下一个请求，出错或不再保持时关闭连接，
+ * 否则更新关注的事件与定时器
+ */
+static void settle(event_loop* lp, conn_t* c, int rc)
+{
+    while (rc >= 0 && c->range && c->state == ST_STREAM && conn_done(c))
+        rc = range_fetched(lp, c);
+    while (rc >= 0 && conn_done(c) && conn_keepalive(c))
+        rc = next_request(lp, c);
+    if (rc < 0 || conn_done(c))
+        close_conn(lp, c);
+    else {
+        update_interest(lp, c);
+        conn_timer(lp, c);
+    }
+}
+
+
+/*
+ * handle_event 推进连接的状态机
+ */
+static void handle_event(event_loop* lp, conn_t* c)
+{
+    int rc = 0;
+
+    if (c->closed)
+        return;
+    switch (c->state) {
+    case ST_REQUEST:
+        rc = read_request(c);
+        break;
+    case ST_RESOLVE: /* 解析已完成，eventfd不再使用 */
+        close_server(c);
+        rc = resolve_upstream(c);
+        break;
+    case ST_CONNECT:
+        rc = handle_connect(c);
+        break;
+    case ST_FORWARD:
+        rc = on_connected(c);
+        break;
+    case ST_STREAM:
+    case ST_REPLY:
+        rc = relay_pump(c, c->serverfd, c->clientfd, &c->down, c->state == ST_STREAM);
+        break;
+    case ST_TUNNEL:
+        rc = tunnel_pump(c);
+        break;
+    case ST_FOLLOW:
+        rc = follow_pump(c);
+        break;
+    case ST_RANGE:
+        rc = range_pump(c);
+        break;
+    }
+    if ((c->state == ST_FORWARD || c->state == ST_STREAM) && c->resp.total == 0
+        && (rc < 0 || c->down.eof)) {
+        /* 复用的连接已被服务器关闭时重试；新建的连接也没有任何响应时回复502（Range请求由range_fetched处理） */
+        if (c->reused)
+            rc = retry_upstream(c);
+        else if (c->range == NULL) {
+            close_server(c);
+            rc = reply_error(c, c->url, "502", "Bad Gateway", "Proxy could not connect to the server");
+        }
+    }
+    settle(lp, c, rc);
+}
+
+
+/*
+ * on_timeout 连接的定时器到期：期限已被推后时重新挂上；否则按阶段处理，
+ * 连接服务器超时与连接失败一样回复502，其余阶段直接关闭连接
+ */
+static void on_timeout(timer_node* t, void* arg)
+{
+    event_loop* lp = (event_loop*)arg;
+    conn_t* c = (conn_t*)((char*)t - offsetof(conn_t, timer));
+    int rc = -1;
+
+    if (c->deadline > lp->now) {
+        timer_add(&lp->wheel, t, c->deadline);
+        return;
+    }
+    stats_add(STAT_TIMEOUT_HEADER + c->tkind, 1);
+    if (c->tkind == TO_CONNECT) {
+        if (c->state == ST_RESOLVE) /* 注销后才能关闭eventfd */
+            dns_unwatch(c->host, c->port, c->serverfd);
+        close_server(c);
+        rc = reply_error(c, c->host, "502", "Bad Gateway", "Proxy could not connect to the server");
+    }
+    settle(lp, c, rc);
+}
+
+
+/*
+ * accept_conns 接受所有已到达的连接
+ */
+static void accept_conns(event_loop* lp)
+{
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    char hostname[MAXLINE], port[MAXLINE];
+    conn_t* c;
+    int connfd;
+
+    for (;;) {
+        clientlen = sizeof(clientaddr);
+        connfd = accept(lp->listenfd, (SA*)&clientaddr, &clientlen);
+        if (connfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return; /* EAGAIN，或者描述符耗尽时等待下一次事件 */
+        }
+        fcntl(connfd, F_SETFL, O_NONBLOCK);
+        if (LV_DEBUG <= log_threshold && getnameinfo((SA*)&clientaddr, clientlen, hostname, MAXLINE,
+            port, MAXLINE, NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+            LOG(LV_DEBUG, "Accepted connection from (%s, %s)", hostname, port);
+
+        c = (conn_t*)Calloc(1, sizeof(conn_t));
+        c->state = ST_REQUEST;
+        req_init(&c->rq);
+        c->clientfd = connfd;
+        c->serverfd = -1;
+        c->timer.fn = on_timeout;
+        c->tkind = -1;
+        update_interest(lp, c);
+        conn_timer(lp, c);
+    }
+}
+
+
+/*
+ * loop_thread 单个事件循环
+ */
+static void* loop_thread(void* vargp)
+{
+    event_loop* lp = (event_loop*)vargp;
+    struct epoll_event evs[MAX_EVENTS], ev;
+    int n;
+
+    if ((lp->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1 error");
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, lp->listenfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+
+    timer_init(&lp->wheel);
+    lp->now = timer_now();
+    while (1) {
+        n = epoll_wait(lp->epfd, evs, MAX_EVENTS, timer_wait_ms(&lp->wheel, lp->now));
+        lp->now = timer_now();
+        for (int i = 0; i < n; i++) {
+            conn_t* c = (conn_t*)evs[i].data.ptr;
+            if (c == NULL)
+                accept_conns(lp);
+            else
+                handle_event(lp, c);
+        }
+        timer_advance(&lp->wheel, lp->now, lp);
+        while (lp->dead) {
+            conn_t* c = lp->dead;
+            lp->dead = c->next_dead;
+            Free(c);
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * event_run 启动nloops个事件循环，当前线程运行其中一个
+ */
+void event_run(int listenfd, int nloops)
+{
+    event_loop* loops;
+    pthread_t tid;
+
+    if (nloops <= 0)
+        nloops = 1;
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+
+    loops = (event_loop*)Calloc(nloops, sizeof(event_loop));
+    for (int i = 0; i < nloops; i++) {
+        loops[i].listenfd = listenfd;
+        if (i > 0)
+            Pthread_create(&tid, NULL, loop_thread, &loops[i]);
+    }
+    loop_thread(&loops[0]);
+}
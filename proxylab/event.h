@@ -0,0 +1,9 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include "csapp.h"
+
+/* 启动nloops个epoll事件循环线程，共同服务listenfd，不返回 */
+void event_run(int listenfd, int nloops);
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * 未命中请求的合并（single-flight）
+ * 热门URL首次被请求或从cache中淘汰时，同时到达的请求都会未命中；
+ * 只有第一个请求连接服务器，其余请求加入它的回源，随响应到达逐步转发，
+ * 避免同一对象被并发地多次回源、又多次插入cache
+ * 不可缓存的响应可能是私有的，过大的响应不值得缓冲，回源者此时脱离，跟随者各自回源
+ */
+
+#include <stdint.h>
+#include "flight.h"
+#include "util.h"
+
+static flight *buckets[FLIGHT_BUCKETS];
+static sem_t mutex; /* 保护哈希表与引用计数 */
+
+/*
+ * notify 唤醒等待的线程并通知所有事件驱动的跟随者，调用者持有fp->lock
+ */
+static void notify(flight* fp)
+{
+    uint64_t one = 1;
+
+    pthread_cond_broadcast(&fp->more);
+    /* eventfd计数器已满（EAGAIN）时对方必定还未读取，不会丢失通知 */
+    for(flight_watcher *w = fp->watchers; w; w = w->next)
+        write(w->fd, &one, sizeof(one));
+}
+
+/*
+ * unlink_flight 从表中移除，之后的请求不会再加入这次回源
+ */
+static void unlink_flight(flight* fp)
+{
+    flight **pp;
+
+    P(&mutex);
+    for(pp = &buckets[fp->hash % FLIGHT_BUCKETS]; *pp; pp = &(*pp)->next)
+        if(*pp == fp){
+            *pp = fp->next;
+            break;
+        }
+    V(&mutex);
+}
+
+/*
+ * flight_init 初始化回源表
+ */
+void flight_init(void)
+{
+    Sem_init(&mutex, 0, 1);
+}
+
+/*
+ * flight_join 加入url上进行中的回源；没有时新建一个并由调用者回源
+ */
+flight* flight_join(char* url, int* leader)
+{
+    unsigned int hash = hash_url(url);
+    flight **bp = &buckets[hash % FLIGHT_BUCKETS], *fp;
+
+    P(&mutex);
+    for(fp = *bp; fp; fp = fp->next)
+        if(fp->hash == hash && strcmp(fp->url, url) == 0){
+            fp->refcnt++;
+            V(&mutex);
+            *leader = 0;
+            return fp;
+        }
+    fp = (flight*)Calloc(1, sizeof(flight));
+    fp->hash = hash;
+    fp->url = (char*)Malloc(strlen(url) + 1);
+    strcpy(fp->url, url);
+    fp->refcnt = 1;
+    pthread_mutex_init(&fp->lock, NULL);
+    pthread_cond_init(&fp->more, NULL);
+    fp->state = FLIGHT_FILLING;
+    fp->next = *bp;
+    *bp = fp;
+    V(&mutex);
+    *leader = 1;
+    return fp;
+}
+
+/*
+ * flight_append 回源者追加收到的响应字节
+ * 跟随者随时可能加入并从头开始读，缓冲期间保留完整的响应；超出FLIGHT_MAX时跟随者脱离
+ */
+void flight_append(flight* fp, const char* buf, size_t n)
+{
+    /* state与size只由回源者自己修改，回源者读取时不必加锁 */
+    if(fp == NULL || n == 0 || fp->state != FLIGHT_FILLING)
+        return;
+    if(fp->size + n > FLIGHT_MAX){
+        flight_detach(fp);
+        return;
+    }
+    pthread_mutex_lock(&fp->lock);
+    if(fp->size + n > fp->cap){
+        fp->cap = fp->cap ? fp->cap * 2 : MAXLINE;
+        while(fp->cap < fp->size + n)
+            fp->cap *= 2;
+        fp->data = (char*)Realloc(fp->data, fp->cap);
+    }
+    memcpy(fp->data + fp->size, buf, n);
+    fp->size += n;
+    notify(fp);
+    pthread_mutex_unlock(&fp->lock);
+}
+
+/*
+ * flight_detach 回源者不再为跟随者缓冲：从表中移除并丢弃已缓冲的数据
+ * 尚未收到任何字节的跟随者改为自行回源，已转发了部分响应的只能断开
+ */
+void flight_detach(flight* fp)
+{
+    if(fp == NULL || fp->state != FLIGHT_FILLING)
+        return;
+    pthread_mutex_lock(&fp->lock);
+    fp->state = FLIGHT_DETACHED;
+    Free(fp->data);
+    fp->data = NULL;
+    fp->size = fp->cap = 0;
+    notify(fp);
+    pthread_mutex_unlock(&fp->lock);
+    unlink_flight(fp);
+}
+
+/*
+ * flight_finish 回源结束，从表中移除；此后的请求查cache或发起新的回源
+ * 已脱离的回源保持FLIGHT_DETACHED，还没读到这一状态的跟随者照样自行回源
+ */
+void flight_finish(flight* fp, int complete, int persistent)
+{
+    if(fp == NULL)
+        return;
+    unlink_flight(fp);
+
+    pthread_mutex_lock(&fp->lock);
+    if(fp->state == FLIGHT_FILLING){
+        fp->state = complete ? FLIGHT_DONE : FLIGHT_ABORTED;
+        fp->persistent = complete && persistent;
+    }
+    notify(fp);
+    pthread_mutex_unlock(&fp->lock);
+}
+
+/*
+ * flight_read 从off处读取至多n字节；block非0时等待直到有新数据或回源结束
+ * 返回读到的字节数；返回0时*state为FLIGHT_FILLING（非阻塞且暂无数据）、FLIGHT_DONE或FLIGHT_ABORTED
+ */
+size_t flight_read(flight* fp, size_t off, char* buf, size_t n, int block, int* state)
+{
+    pthread_mutex_lock(&fp->lock);
+    while(block && off >= fp->size && fp->state == FLIGHT_FILLING)
+        pthread_cond_wait(&fp->more, &fp->lock);
+    if(off < fp->size){
+        if(n > fp->size - off)
+            n = fp->size - off;
+        memcpy(buf, fp->data + off, n);
+    }
+    else
+        n = 0;
+    *state = fp->state;
+    pthread_mutex_unlock(&fp->lock);
+    return n;
+}
+
+/*
+ * flight_watch 注册事件驱动连接的eventfd
+ */
+void flight_watch(flight* fp, int fd)
+{
+    flight_watcher *w = (flight_watcher*)Malloc(sizeof(flight_watcher));
+
+    w->fd = fd;
+    pthread_mutex_lock(&fp->lock);
+    w->next = fp->watchers;
+    fp->watchers = w;
+    pthread_mutex_unlock(&fp->lock);
+}
+
+/*
+ * flight_unwatch 注销eventfd，之后调用者可以关闭它
+ */
+void flight_unwatch(flight* fp, int fd)
+{
+    flight_watcher **pp, *w = NULL;
+
+    pthread_mutex_lock(&fp->lock);
+    for(pp = &fp->watchers; *pp; pp = &(*pp)->next)
+        if((*pp)->fd == fd){
+            w = *pp;
+            *pp = w->next;
+            break;
+        }
+    pthread_mutex_unlock(&fp->lock);
+    Free(w);
+}
+
+/*
+ * flight_release 释放引用，最后一个引用释放时回收
+ */
+void flight_release(flight* fp)
+{
+    int last;
+
+    if(fp == NULL)
+        return;
+    P(&mutex);
+    last = (--fp->refcnt == 0);
+    V(&mutex);
+    if(!last)
+        return;
+    pthread_mutex_destroy(&fp->lock);
+    pthread_cond_destroy(&fp->more);
+    Free(fp->data);
+    Free(fp->url);
+    Free(fp);
+}
@@ -0,0 +1,64 @@
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include "csapp.h"
+
+/* 此处定义请求合并相关的常量 */
+#define FLIGHT_BUCKETS 64
+#define FLIGHT_MAX (1024 * 1024) /* 为跟随者缓冲的响应字节数上限 */
+
+/* 一次进行中的回源的状态 */
+enum {
+    FLIGHT_FILLING, /* 正在从服务器接收 */
+    FLIGHT_DONE,    /* 响应已完整 */
+    FLIGHT_ABORTED, /* 回源失败或中途断开 */
+    FLIGHT_DETACHED /* 回源者不再为跟随者缓冲，尚未收到任何字节的跟随者自行回源 */
+};
+
+/* 等待新数据的事件驱动连接，通过eventfd通知 */
+typedef struct flight_watcher{
+    struct flight_watcher *next;
+    int fd;
+}flight_watcher;
+
+/*
+ * 同一URL上正在进行的一次回源
+ * 第一个未命中的请求负责回源，把收到的字节追加到data；之后未命中同一URL的请求
+ * 只从data中读取，随数据到达逐步发给各自的客户端，不再各自连接服务器
+ * 至多缓冲FLIGHT_MAX字节，超出后跟随者脱离（见flight_detach）
+ */
+typedef struct flight{
+    struct flight *next; /* 哈希桶链 */
+    unsigned int hash;
+    char *url;
+    int refcnt; /* 由哈希表锁保护 */
+
+    pthread_mutex_t lock; /* 保护以下字段 */
+    pthread_cond_t more;  /* 有新数据或回源结束 */
+    char *data;
+    size_t size, cap;
+    int state;
+    int persistent; /* 响应分帧且服务器允许保持连接，跟随者的客户端连接也可以保持 */
+    flight_watcher *watchers;
+}flight;
+
+/* 以下回源者调用的函数中fp可以为NULL，表示不参与合并的回源，什么也不做 */
+
+void flight_init(void);
+/* 加入url上进行中的回源；没有时新建一个，*leader置1，由调用者回源 */
+flight* flight_join(char* url, int* leader);
+/* 回源者追加收到的响应字节；超出FLIGHT_MAX时改为脱离 */
+void flight_append(flight* fp, const char* buf, size_t n);
+/* 回源者不再为跟随者缓冲：响应不可缓存（可能是私有的）或过大时调用，此后新的请求不会再加入 */
+void flight_detach(flight* fp);
+/* 回源结束：complete表示响应完整；此后新的请求不会再加入这次回源 */
+void flight_finish(flight* fp, int complete, int persistent);
+/* 从off处读取至多n字节，block非0时等待新数据；返回0时*state说明原因（FLIGHT_DETACHED时不再有数据） */
+size_t flight_read(flight* fp, size_t off, char* buf, size_t n, int block, int* state);
+/* 注册/注销事件驱动连接的eventfd，有新数据或结束时写入 */
+void flight_watch(flight* fp, int fd);
+void flight_unwatch(flight* fp, int fd);
+/* 释放flight_join取得的引用 */
+void flight_release(flight* fp);
+
+#endif
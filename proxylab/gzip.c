@@ -0,0 +1,594 @@
+/*
+ * 压缩变体
+ * 启用-z时，可缓存的文本响应发布到cache之后压缩一次，以URL加GZIP_SUFFIX为键另存为一个对象；
+ * 接受gzip的客户端直接得到压缩的变体，既不必每次压缩，也减少发出的字节，同样的cache容量放得下更多对象
+ * 压缩用内置的deflate（RFC 1951）：哈希链查找LZ77匹配并带一步惰性匹配，
+ * 每GZIP_BLOCK_SYMS个符号为一块，按块内的频率重建限长的动态Huffman编码
+ * 变体的新鲜期与原对象相同，过期后不单独重新验证，随原对象的304延长或随新内容重新生成
+ * 压缩由后台线程完成，转发响应的工作线程与事件循环只把URL放入队列，不因压缩而停顿
+ */
+
+#include "gzip.h"
+#include "stats.h"
+
+int gzip_enabled = 0;
+static uint32_t crc_table[256];
+static gzip_job *qhead, *qtail; /* 等待压缩的对象 */
+static int qlen;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; /* 保护压缩队列 */
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER; /* 压缩队列非空 */
+
+/* deflate的长度码与距离码（RFC 1951 3.2.5） */
+static const uint16_t len_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t len_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+/* 码长编码自身的码长的发送顺序 */
+static const uint8_t cl_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+#define NLITLEN 286 /* 字面字节、块结束与长度码 */
+#define NDIST 30
+#define NCL 19
+
+/* LZ77的一个符号：dist为0时len是字面字节，否则是长度为len、距离为dist的匹配 */
+typedef struct{
+    uint16_t len, dist;
+}lz_sym;
+
+/* 按位输出，从每个字节的最低位开始填；超出cap的部分只计数不写入 */
+typedef struct{
+    unsigned char *out;
+    size_t len, cap;
+    uint64_t bits;
+    int nbits;
+}bit_writer;
+
+/* 一次压缩的状态 */
+typedef struct{
+    const unsigned char *in;
+    size_t n;
+    int32_t head[1 << GZIP_HASH_BITS]; /* 各哈希值最近的位置，-1表示没有 */
+    int32_t prev[GZIP_WSIZE]; /* 同一哈希值的上一个位置，按位置对窗口取模存放 */
+    lz_sym syms[GZIP_BLOCK_SYMS]; /* 当前块的符号 */
+    int nsyms;
+    bit_writer w;
+}deflate_state;
+
+void gzip_init(void)
+{
+    uint32_t c;
+
+    for(int i = 0; i < 256; i++){
+        c = i;
+        for(int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+    gzip_enabled = 1;
+    upstream_identity = 1; /* cache中的原对象必须是未压缩的 */
+}
+
+static void put_bits(bit_writer* w, uint32_t v, int n)
+{
+    w->bits |= (uint64_t)v << w->nbits;
+    w->nbits += n;
+    while(w->nbits >= 8){
+        if(w->len < w->cap)
+            w->out[w->len] = (unsigned char)w->bits;
+        w->len++;
+        w->bits >>= 8;
+        w->nbits -= 8;
+    }
+}
+
+/*
+ * huff_lengths 由频率计算各符号的码长，最长不超过maxbits
+ * 叶子按频率排序后用两个有序队列合并出Huffman树；树太深时把频率减半（不减到0）重建，
+ * 频率差距缩小后树随之变浅，最终所有频率相同时深度只有log2(符号数)
+ */
+static void huff_lengths(const uint32_t* freq, int n, int maxbits, uint8_t* lens)
+{
+    uint32_t f[NLITLEN], w[2 * NLITLEN];
+    int sym[NLITLEN], parent[2 * NLITLEN], depth[2 * NLITLEN];
+    int m, i, j, k, a, leaf, node, maxd;
+
+    memcpy(f, freq, n * sizeof(f[0]));
+    while(1){
+        memset(lens, 0, n);
+        for(m = 0, i = 0; i < n; i++)
+            if(f[i])
+                sym[m++] = i;
+        if(m < 2){
+            if(m == 1)
+                lens[sym[0]] = 1;
+            return;
+        }
+        for(i = 1; i < m; i++){
+            k = sym[i];
+            for(j = i; j > 0 && f[sym[j - 1]] > f[k]; j--)
+                sym[j] = sym[j - 1];
+            sym[j] = k;
+        }
+        /* 0..m-1是按频率排好的叶子，m..2m-2是依次生成的内部节点，其权重也不减 */
+        for(i = 0; i < m; i++)
+            w[i] = f[sym[i]];
+        for(leaf = 0, node = m, k = m; k < 2 * m - 1; k++){
+            w[k] = 0;
+            for(j = 0; j < 2; j++){
+                a = (leaf < m && (node >= k || w[leaf] <= w[node])) ? leaf++ : node++;
+                parent[a] = k;
+                w[k] += w[a];
+            }
+        }
+        /* 父节点总在子节点之后生成，从根往回即可求出深度 */
+        depth[2 * m - 2] = 0;
+        for(k = 2 * m - 3; k >= 0; k--)
+            depth[k] = depth[parent[k]] + 1;
+        for(maxd = 0, i = 0; i < m; i++){
+            lens[sym[i]] = depth[i];
+            if(depth[i] > maxd)
+                maxd = depth[i];
+        }
+        if(maxd <= maxbits)
+            return;
+        for(i = 0; i < n; i++)
+            if(f[i])
+                f[i] = (f[i] + 1) / 2;
+    }
+}
+
+/*
+ * huff_codes 由码长求规范Huffman编码
+ * deflate的Huffman码从最高位开始发送，而put_bits从最低位开始填，因此存放位反转后的码
+ */
+static void huff_codes(const uint8_t* lens, int n, uint16_t* codes)
+{
+    int count[16] = { 0 }, next[16], code = 0, c, r;
+
+    for(int i = 0; i < n; i++)
+        count[lens[i]]++;
+    count[0] = 0;
+    for(int b = 1; b < 16; b++){
+        code = (code + count[b - 1]) << 1;
+        next[b] = code;
+    }
+    for(int i = 0; i < n; i++){
+        if(!lens[i])
+            continue;
+        c = next[lens[i]]++;
+        for(r = 0, code = 0; r < lens[i]; r++, c >>= 1)
+            code = (code << 1) | (c & 1);
+        codes[i] = code;
+    }
+}
+
+/*
+ * at_least_two 保证至少两个符号有码
+ * 只有一个码的Huffman编码不完整，解码器（如zlib）会拒绝，补上的符号不会被用到
+ */
+static void at_least_two(uint32_t* freq, int n)
+{
+    int used = 0;
+
+    for(int i = 0; i < n; i++)
+        used += freq[i] != 0;
+    for(int i = 0; used < 2 && i < n; i++)
+        if(!freq[i]){
+            freq[i] = 1;
+            used++;
+        }
+}
+
+static int len_code(int len)
+{
+    int c = 28;
+
+    while(len_base[c] > len)
+        c--;
+    return c;
+}
+
+static int dist_code(int dist)
+{
+    int c = 29;
+
+    while(dist_base[c] > dist)
+        c--;
+    return c;
+}
+
+/*
+ * write_block 用动态Huffman编码输出当前块的符号，清空符号缓冲区
+ * 两组码长连在一起做游程编码：16重复上一个码长3-6次，17与18表示3-10个与11-138个0
+ */
+static void write_block(deflate_state* s, int last)
+{
+    uint32_t lfreq[NLITLEN] = { 0 }, dfreq[NDIST] = { 0 }, cfreq[NCL] = { 0 };
+    uint8_t llens[NLITLEN], dlens[NDIST], clens[NCL], all[NLITLEN + NDIST];
+    uint8_t rle[NLITLEN + NDIST], rle_x[NLITLEN + NDIST];
+    uint16_t lcodes[NLITLEN], dcodes[NDIST], ccodes[NCL];
+    int nlit, ndist, ncl, nall, nrle = 0, run, c;
+    bit_writer* w = &s->w;
+    lz_sym* p;
+
+    for(p = s->syms; p < s->syms + s->nsyms; p++)
+        if(p->dist == 0)
+            lfreq[p->len]++;
+        else{
+            lfreq[257 + len_code(p->len)]++;
+            dfreq[dist_code(p->dist)]++;
+        }
+    lfreq[256] = 1;
+    at_least_two(lfreq, NLITLEN);
+    at_least_two(dfreq, NDIST);
+    huff_lengths(lfreq, NLITLEN, 15, llens);
+    huff_lengths(dfreq, NDIST, 15, dlens);
+    huff_codes(llens, NLITLEN, lcodes);
+    huff_codes(dlens, NDIST, dcodes);
+    for(nlit = NLITLEN; nlit > 257 && !llens[nlit - 1]; nlit--)
+        ;
+    for(ndist = NDIST; ndist > 1 && !dlens[ndist - 1]; ndist--)
+        ;
+
+    memcpy(all, llens, nlit);
+    memcpy(all + nlit, dlens, ndist);
+    nall = nlit + ndist;
+    for(int i = 0; i < nall; i += run){
+        for(run = 1; i + run < nall && all[i + run] == all[i]; run++)
+            ;
+        if(all[i] == 0 && run >= 3){
+            if(run > 138)
+                run = 138;
+            rle[nrle] = run <= 10 ? 17 : 18;
+            rle_x[nrle++] = run - (run <= 10 ? 3 : 11);
+        }
+        else if(all[i] != 0 && run >= 4){
+            if(run > 7)
+                run = 7;
+            rle[nrle] = all[i];
+            rle_x[nrle++] = 0;
+            rle[nrle] = 16;
+            rle_x[nrle++] = run - 4;
+        }
+        else{
+            run = 1;
+            rle[nrle] = all[i];
+            rle_x[nrle++] = 0;
+        }
+    }
+    for(int i = 0; i < nrle; i++)
+        cfreq[rle[i]]++;
+    at_least_two(cfreq, NCL);
+    huff_lengths(cfreq, NCL, 7, clens);
+    huff_codes(clens, NCL, ccodes);
+    for(ncl = NCL; ncl > 4 && !clens[cl_order[ncl - 1]]; ncl--)
+        ;
+
+    put_bits(w, last, 1);
+    put_bits(w, 2, 2); /* 动态Huffman编码的块 */
+    put_bits(w, nlit - 257, 5);
+    put_bits(w, ndist - 1, 5);
+    put_bits(w, ncl - 4, 4);
+    for(int i = 0; i < ncl; i++)
+        put_bits(w, clens[cl_order[i]], 3);
+    for(int i = 0; i < nrle; i++){
+        put_bits(w, ccodes[rle[i]], clens[rle[i]]);
+        if(rle[i] >= 16)
+            put_bits(w, rle_x[i], rle[i] == 16 ? 2 : rle[i] == 17 ? 3 : 7);
+    }
+    for(p = s->syms; p < s->syms + s->nsyms; p++){
+        if(p->dist == 0){
+            put_bits(w, lcodes[p->len], llens[p->len]);
+            continue;
+        }
+        c = len_code(p->len);
+        put_bits(w, lcodes[257 + c], llens[257 + c]);
+        put_bits(w, p->len - len_base[c], len_extra[c]);
+        c = dist_code(p->dist);
+        put_bits(w, dcodes[c], dlens[c]);
+        put_bits(w, p->dist - dist_base[c], dist_extra[c]);
+    }
+    put_bits(w, lcodes[256], llens[256]);
+    s->nsyms = 0;
+}
+
+static void emit(deflate_state* s, int len, int dist)
+{
+    s->syms[s->nsyms].len = len;
+    s->syms[s->nsyms].dist = dist;
+    if(++s->nsyms == GZIP_BLOCK_SYMS)
+        write_block(s, 0);
+}
+
+static uint32_t hash3(const unsigned char* p)
+{
+    uint32_t v = p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16);
+
+    return (v * 2654435761u) >> (32 - GZIP_HASH_BITS);
+}
+
+/*
+ * insert_pos 把位置i加入它的哈希链
+ */
+static void insert_pos(deflate_state* s, size_t i)
+{
+    uint32_t h;
+
+    if(i + 3 > s->n)
+        return;
+    h = hash3(s->in + i);
+    s->prev[i & (GZIP_WSIZE - 1)] = s->head[h];
+    s->head[h] = (int32_t)i;
+}
+
+/*
+ * longest_match 沿哈希链找位置i处窗口内最长的匹配，返回长度（不足3时为0）
+ * 链上的位置递减；超出窗口的位置的prev槽可能已被新位置覆盖，遇到时即停止
+ */
+static int longest_match(deflate_state* s, size_t i, int* dist)
+{
+    const unsigned char *cur = s->in + i, *m;
+    int best = 0, chain = GZIP_CHAIN, maxlen, k;
+    int32_t cand;
+
+    if(i + 3 > s->n)
+        return 0;
+    maxlen = s->n - i < 258 ? (int)(s->n - i) : 258;
+    for(cand = s->head[hash3(cur)]; cand >= 0 && i - cand <= GZIP_WSIZE && chain-- > 0;
+        cand = s->prev[cand & (GZIP_WSIZE - 1)]){
+        m = s->in + cand;
+        if(m[best] != cur[best] || m[0] != cur[0] || m[1] != cur[1])
+            continue;
+        for(k = 0; k < maxlen && m[k] == cur[k]; k++)
+            ;
+        if(k > best){
+            best = k;
+            *dist = i - cand;
+            if(k == maxlen)
+                break;
+        }
+    }
+    return best >= 3 ? best : 0;
+}
+
+/*
+ * deflate_run 把整个输入切分为字面字节与匹配
+ * 惰性匹配：位置i的匹配不够长时先看i+1，那里的匹配更长则i作为字面字节输出，
+ * 已求出的i+1处的匹配留到下一轮使用；输出已超出cap时提前放弃
+ */
+static void deflate_run(deflate_state* s)
+{
+    size_t i = 0, j;
+    int len = 0, dist = 0, len2, dist2, pending = 0;
+
+    while(i < s->n && s->w.len < s->w.cap){
+        if(!pending)
+            len = longest_match(s, i, &dist);
+        pending = 0;
+        insert_pos(s, i);
+        if(len && len < GZIP_LAZY && (len2 = longest_match(s, i + 1, &dist2)) > len){
+            emit(s, s->in[i++], 0);
+            len = len2;
+            dist = dist2;
+            pending = 1;
+            continue;
+        }
+        if(len){
+            emit(s, len, dist);
+            for(j = i + 1; j < i + len; j++)
+                insert_pos(s, j);
+            i += len;
+        }
+        else
+            emit(s, s->in[i++], 0);
+    }
+}
+
+/*
+ * gzip_compress 输出gzip格式：10字节的头、deflate数据、CRC32与原长度（小端）
+ */
+size_t gzip_compress(const char* in, size_t n, char* out, size_t cap)
+{
+    static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+    deflate_state* s;
+    uint32_t crc = 0xffffffff;
+    size_t len;
+
+    if(cap <= sizeof(header) + 8)
+        return 0;
+    s = Malloc(sizeof(deflate_state));
+    s->in = (const unsigned char*)in;
+    s->n = n;
+    s->nsyms = 0;
+    memset(s->head, 0xff, sizeof(s->head));
+    s->w.out = (unsigned char*)out + sizeof(header);
+    s->w.cap = cap - sizeof(header) - 8;
+    s->w.len = 0;
+    s->w.bits = 0;
+    s->w.nbits = 0;
+    deflate_run(s);
+    if(s->w.len < s->w.cap){
+        write_block(s, 1);
+        if(s->w.nbits)
+            put_bits(&s->w, 0, 8 - s->w.nbits);
+    }
+    len = s->w.len;
+    Free(s);
+    if(len >= cap - sizeof(header) - 8)
+        return 0;
+
+    memcpy(out, header, sizeof(header));
+    len += sizeof(header);
+    for(size_t i = 0; i < n; i++)
+        crc = crc_table[(crc ^ (unsigned char)in[i]) & 0xff] ^ (crc >> 8);
+    crc ^= 0xffffffff;
+    for(int i = 0; i < 4; i++)
+        out[len++] = (char)(crc >> (8 * i));
+    for(int i = 0; i < 4; i++)
+        out[len++] = (char)((uint32_t)n >> (8 * i));
+    return len;
+}
+
+int gzip_key(char* key, const char* url)
+{
+    if(strlen(url) + sizeof(GZIP_SUFFIX) > MAXLINE)
+        return -1;
+    sprintf(key, "%s" GZIP_SUFFIX, url);
+    return 0;
+}
+
+/*
+ * gzip_lookup 过期的变体不用，由调用者按原对象处理（重新验证或回源之后变体随之更新）
+ * 只发出确实按gzip编码的对象，键下若是别的内容也按未命中处理
+ */
+cache_block* gzip_lookup(http_req* rq, char* url)
+{
+    char key[MAXLINE];
+    cache_block* cb;
+    http_resp rp;
+
+    if(!gzip_enabled || !req_accepts(rq, "gzip") || gzip_key(key, url) < 0)
+        return NULL;
+    if((cb = lookup_cache(key)) == NULL)
+        return NULL;
+    if(!cache_fresh(cb)){
+        release_cache(cb);
+        return NULL;
+    }
+    resp_head(&rp, cb->block, cb->size);
+    if(!rp.gzipped){
+        release_cache(cb);
+        return NULL;
+    }
+    stats_add(STAT_GZIP_HITS, 1);
+    return cb;
+}
+
+/*
+ * make_variant 只压缩长度已知、未编码、不按其他报头区分的文本200响应
+ * 变体只放在内存cache中，压缩后不比原内容短或放不进一个block时放弃
+ */
+static void make_variant(char* url, const char* data, size_t size)
+{
+    http_resp rp;
+    char key[MAXLINE], *buf;
+    size_t body, room, zlen, hlen;
+
+    resp_head(&rp, data, size);
+    if(rp.status != 200 || rp.chunked || rp.encoded || !rp.textual || rp.vary_other
+        || rp.content_length < GZIP_MIN_SIZE || rp.content_length > GZIP_MAX_SIZE
+        || rp.head_len + rp.content_length != size || gzip_key(key, url) < 0)
+        return;
+    body = rp.content_length;
+    room = rp.head_len + 128; /* 报头加上ETag的后缀与Content-Encoding、Vary */
+    if(room >= MAX_OBJECT_SIZE)
+        return;
+    buf = Malloc(MAX_OBJECT_SIZE);
+    zlen = gzip_compress(data + rp.head_len, body, buf + room,
+        body < MAX_OBJECT_SIZE - room ? body : MAX_OBJECT_SIZE - room);
+    if(zlen && (hlen = build_encoded(buf, room, data, rp.head_len, "gzip", zlen)) > 0){
+        memmove(buf + hlen, buf + room, zlen);
+        insert_cache(key, buf, hlen + zlen);
+        stats_add(STAT_GZIP_STORED, 1);
+    }
+    Free(buf);
+}
+
+/*
+ * compress_url 为已发布的url生成变体；大对象填充在磁盘层中，从那里读出原内容
+ */
+static void compress_url(char* url)
+{
+    cache_block* cb;
+    disk_hit dh;
+
+    if((cb = lookup_cache(url)) != NULL){
+        make_variant(url, cb->block, cb->size);
+        release_cache(cb);
+    }
+    else if(disk_lookup(url, &dh)){
+        make_variant(url, disk_data(&dh), dh.size);
+        disk_release(&dh);
+    }
+}
+
+/*
+ * compressor 后台压缩线程
+ */
+static void* compressor(void* vargp)
+{
+    gzip_job *j;
+
+    Pthread_detach(pthread_self());
+    while(1){
+        pthread_mutex_lock(&lock);
+        while(qhead == NULL)
+            pthread_cond_wait(&work, &lock);
+        j = qhead;
+        if((qhead = j->next) == NULL)
+            qtail = NULL;
+        qlen--;
+        pthread_mutex_unlock(&lock);
+
+        compress_url(j->url);
+        Free(j);
+    }
+    return NULL;
+}
+
+/*
+ * gzip_start 启动后台压缩线程
+ */
+void gzip_start(void)
+{
+    pthread_t tid;
+
+    if(!gzip_enabled)
+        return;
+    for(int i = 0; i < GZIP_THREADS; i++)
+        Pthread_create(&tid, NULL, compressor, NULL);
+}
+
+/*
+ * gzip_store 把url放入压缩队列；队列已满说明压缩跟不上发布，放弃这个对象的变体
+ */
+void gzip_store(char* url)
+{
+    gzip_job *j;
+
+    if(!gzip_enabled)
+        return;
+    pthread_mutex_lock(&lock);
+    if(qlen >= GZIP_QUEUE){
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    j = (gzip_job*)Malloc(sizeof(gzip_job) + strlen(url) + 1);
+    strcpy(j->url, url);
+    j->next = NULL;
+    if(qtail)
+        qtail->next = j;
+    else
+        qhead = j;
+    qtail = j;
+    qlen++;
+    pthread_cond_signal(&work);
+    pthread_mutex_unlock(&lock);
+}
+
+void gzip_refresh(cache_block* cb)
+{
+    char key[MAXLINE];
+    cache_block* v;
+
+    if(!gzip_enabled || gzip_key(key, cb->url) < 0)
+        return;
+    if((v = lookup_cache(key)) != NULL){
+        cache_refresh(v, cb->expires);
+        release_cache(v);
+    }
+}
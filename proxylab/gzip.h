@@ -0,0 +1,48 @@
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include <stdint.h>
+#include "csapp.h"
+#include "cache.h"
+#include "http.h"
+
+/* 此处定义压缩变体相关的常量 */
+#define GZIP_MIN_SIZE 256 /* 更短的响应体压缩后省不了多少，不生成变体 */
+#define GZIP_MAX_SIZE (1024 * 1024) /* 更长的响应体不压缩，以免一次压缩占用后台线程太久 */
+#define GZIP_SUFFIX " gzip" /* 变体的键在URL之后追加的后缀；请求行中的URL不含空格，不会与之相同 */
+#define GZIP_WSIZE 32768 /* LZ77窗口，即deflate允许的最远距离 */
+#define GZIP_HASH_BITS 15
+#define GZIP_CHAIN 128 /* 每个位置最多比较的候选数 */
+#define GZIP_LAZY 32 /* 找到的匹配短于此长度时再看下一个位置有没有更长的匹配 */
+#define GZIP_BLOCK_SYMS 16384 /* 每个deflate块的符号数，块之间各自重建Huffman编码 */
+#define GZIP_THREADS 2 /* 后台压缩线程数 */
+#define GZIP_QUEUE 256 /* 等待压缩的URL数上限，队列已满时不再为新发布的对象生成变体 */
+
+/* 等待后台线程压缩的对象 */
+typedef struct gzip_job{
+    struct gzip_job *next;
+    char url[];
+}gzip_job;
+
+/* 为1时（-z）为可压缩的对象生成gzip变体，并把它发给接受gzip的客户端 */
+extern int gzip_enabled;
+
+/* 启用压缩变体：准备CRC表，此后响应会进入cache的请求不再向服务器转发Accept-Encoding（见req_identity） */
+void gzip_init(void);
+/* 启用了压缩变体时启动后台压缩线程；多进程模式下由各工作进程在fork之后调用 */
+void gzip_start(void);
+/*
+ * 把in的n字节压缩为gzip格式写入out，返回压缩后的长度
+ * 结果不短于cap时放弃并返回0
+ */
+size_t gzip_compress(const char* in, size_t n, char* out, size_t cap);
+/* 变体的键，URL过长时返回-1 */
+int gzip_key(char* key, const char* url);
+/* 客户端接受gzip且cache中有url的新鲜变体时返回它（持有引用），否则返回NULL */
+cache_block* gzip_lookup(http_req* rq, char* url);
+/* url刚发布到cache，交给后台线程，可以压缩时生成它的变体并存入cache；不等待压缩完成 */
+void gzip_store(char* url);
+/* 原对象重新验证之后，变体的新鲜期随之延长 */
+void gzip_refresh(cache_block* cb);
+
+#endif
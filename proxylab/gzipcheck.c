@@ -0,0 +1,140 @@
+/*
+ * gzipcheck
+ *
+ * 检查内置deflate（见gzip.c）的输出：把几类样本压缩后交给系统的gzip -d解压，
+ * 结果须与原样本逐字节相同；样本包括全部相同的字节、随机字节、JSON文本，
+ * 以及超过GZIP_BLOCK_SYMS个符号、需要分成多个deflate块的长文本
+ *
+ * 用法：gzipcheck（make check）
+ */
+
+#include <stdio.h>
+#include "csapp.h"
+#include "gzip.h"
+
+#define CHECK_TMP "/tmp/gzipcheck.XXXXXX"
+
+typedef struct {
+    const char* name;
+    char* data;
+    size_t n;
+} sample;
+
+/*
+ * fill_same 全部相同的字节，几乎都是最长的匹配
+ */
+static size_t fill_same(char* buf, size_t n)
+{
+    memset(buf, 'a', n);
+    return n;
+}
+
+/*
+ * fill_random 随机字节，几乎没有匹配，压缩后比原样本略长
+ */
+static size_t fill_random(char* buf, size_t n)
+{
+    unsigned int seed = 1;
+
+    for (size_t i = 0; i < n; i++)
+        buf[i] = (char)rand_r(&seed);
+    return n;
+}
+
+/*
+ * fill_json 类似API响应的JSON数组
+ */
+static size_t fill_json(char* buf, size_t n)
+{
+    size_t len = 0;
+    unsigned int seed = 2;
+
+    len += snprintf(buf, n, "[");
+    for (int i = 0; len + 128 < n; i++)
+        len += snprintf(buf + len, n - len,
+            "%s{\"id\":%d,\"name\":\"user-%u\",\"score\":%u.%02u,\"tags\":[\"t%u\",\"t%u\"],\"active\":%s}",
+            i ? "," : "", i, rand_r(&seed) % 100000, rand_r(&seed) % 1000, rand_r(&seed) % 100,
+            rand_r(&seed) % 16, rand_r(&seed) % 16, rand_r(&seed) % 2 ? "true" : "false");
+    len += snprintf(buf + len, n - len, "]");
+    return len;
+}
+
+/*
+ * fill_text 由较大词表随机组成的文本，长度远超一个块的符号数
+ */
+static size_t fill_text(char* buf, size_t n)
+{
+    size_t len = 0;
+    unsigned int seed = 3;
+    char word[16];
+
+    while (len + sizeof(word) < n) {
+        snprintf(word, sizeof(word), "%x ", rand_r(&seed) % 4096);
+        memcpy(buf + len, word, strlen(word));
+        len += strlen(word);
+        if (rand_r(&seed) % 16 == 0)
+            buf[len - 1] = '\n';
+    }
+    return len;
+}
+
+/*
+ * check 压缩s并用gzip -d解压，与原样本比较；通过时返回0
+ */
+static int check(sample* s)
+{
+    size_t cap = s->n + s->n / 8 + 1024, zlen, got = 0;
+    char *z = (char*)Malloc(cap), *out = (char*)Malloc(s->n + 1), path[] = CHECK_TMP, cmd[64];
+    int fd, ok = 0;
+    size_t k;
+    FILE* fp;
+
+    if ((zlen = gzip_compress(s->data, s->n, z, cap)) == 0)
+        printf("FAIL %-8s compression gave up\n", s->name);
+    else if ((fd = mkstemp(path)) < 0)
+        unix_error("mkstemp");
+    else {
+        Rio_writen(fd, z, zlen);
+        Close(fd);
+        snprintf(cmd, sizeof(cmd), "gzip -dc < %s", path);
+        if ((fp = popen(cmd, "r")) == NULL)
+            unix_error("popen");
+        while (got <= s->n && (k = fread(out + got, 1, s->n + 1 - got, fp)) > 0)
+            got += k;
+        ok = (pclose(fp) == 0 && got == s->n && memcmp(out, s->data, s->n) == 0);
+        unlink(path);
+        printf("%s %-8s %8zu -> %8zu\n", ok ? "ok  " : "FAIL", s->name, s->n, zlen);
+    }
+    Free(z);
+    Free(out);
+    return !ok;
+}
+
+int main(void)
+{
+    static struct {
+        const char* name;
+        size_t (*fill)(char*, size_t);
+        size_t n;
+    } kinds[] = {
+        { "empty", fill_same, 0 },
+        { "one", fill_same, 1 },
+        { "same", fill_same, 200000 },
+        { "random", fill_random, 100000 },
+        { "json", fill_json, 300000 },
+        { "text", fill_text, 600000 },
+    };
+    int failed = 0;
+    sample s;
+
+    gzip_init();
+    for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+        s.name = kinds[i].name;
+        s.data = (char*)Malloc(kinds[i].n + 1);
+        s.n = kinds[i].fill(s.data, kinds[i].n);
+        failed += check(&s);
+        Free(s.data);
+    }
+    printf("%s\n", failed ? "gzip check failed" : "gzip check passed");
+    return failed != 0;
+}
@@ -0,0 +1,921 @@
+/*
+ * HTTP报文的解析与编制
+ * 供多线程路径（proxy.c）与事件驱动路径（event.c）共用
+ * 请求由增量解析器直接在接收缓冲区上解析，结果以指向缓冲区的span给出；响应由增量分帧器判断边界
+ */
+
+#include "http.h"
+
+const char* user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+const char* https_hdr = "HTTP/1.1 200 Connection Established\r\nConnection: close\r\n\r\n";
+int upstream_identity = 0;
+
+/*
+ * next_item 取出逗号分隔的列表[*p, end)中下一个非空的项，去掉两端的空白，*p随之前进；
+ * 列表结束时返回长度为0的span
+ */
+static http_span next_item(const char** p, const char* end)
+{
+    http_span t = { NULL, 0 };
+    const char* last;
+
+    while (*p < end && t.len == 0) {
+        if ((last = memchr(*p, ',', end - *p)) == NULL)
+            last = end;
+        for (t.p = *p; t.p < last && (*t.p == ' ' || *t.p == '\t'); t.p++)
+            ;
+        *p = last + (last < end);
+        while (last > t.p && (last[-1] == ' ' || last[-1] == '\t' || last[-1] == '\r'))
+            last--;
+        t.len = last - t.p;
+    }
+    return t;
+}
+
+/*
+ * has_token 逗号分隔的报头值（len字节）中是否有一项恰好是tok（不区分大小写）
+ */
+static int has_token(const char* val, size_t len, const char* tok)
+{
+    const char* p = val;
+    http_span t;
+
+    while ((t = next_item(&p, val + len)).len > 0)
+        if (span_is(t, tok))
+            return 1;
+    return 0;
+}
+
+/*
+ * has_other_token 逗号分隔的报头值中是否有tok以外的项
+ */
+static int has_other_token(const char* val, size_t len, const char* tok)
+{
+    const char* p = val;
+    http_span t;
+
+    while ((t = next_item(&p, val + len)).len > 0)
+        if (!span_is(t, tok))
+            return 1;
+    return 0;
+}
+
+/*
+ * has_substr 报头值中是否含有子串str（不区分大小写），用于粗略判断媒体类型
+ */
+static int has_substr(const char* val, const char* str)
+{
+    size_t n = strlen(str);
+
+    for (; *val; val++)
+        if (!strncasecmp(val, str, n))
+            return 1;
+    return 0;
+}
+
+
+/*
+ * span_is span与str是否相同（不区分大小写）
+ */
+int span_is(http_span s, const char* str)
+{
+    return strlen(str) == s.len && !strncasecmp(s.p, str, s.len);
+}
+
+
+/*
+ * span_copy 把span拷贝为以'\0'结尾的字符串，过长时截断
+ */
+size_t span_copy(char* dst, size_t maxlen, http_span s)
+{
+    size_t n = s.len < maxlen ? s.len : maxlen - 1;
+    memcpy(dst, s.p, n);
+    dst[n] = '\0';
+    return n;
+}
+
+
+/*
+ * req_init 开始解析一个新的请求
+ */
+void req_init(http_req* rq)
+{
+    memset(rq, 0, sizeof(*rq));
+}
+
+
+/*
+ * next_token 取出[*p, end)中下一个以空白分隔的词，*p随之前进
+ */
+static http_span next_token(const char** p, const char* end)
+{
+    http_span t;
+
+    while (*p < end && (**p == ' ' || **p == '\t'))
+        (*p)++;
+    t.p = *p;
+    while (*p < end && **p != ' ' && **p != '\t')
+        (*p)++;
+    t.len = *p - t.p;
+    return t;
+}
+
+
+/*
+ * req_split_url 把URL分解为主机、端口与路径
+ * 绝对形式"scheme://host[:port][/path]"、CONNECT的"host:port"与只有路径的"/path"（此时主机为空）
+ */
+static void req_split_url(http_req* rq)
+{
+    const char *p = rq->url.p, *end = p + rq->url.len, *q, *colon;
+
+    for (q = p; q < end && *q != '/'; q++)
+        ;
+    if (q > p && q[-1] == ':' && q + 1 < end && q[1] == '/') { /* 跳过"scheme://" */
+        p = q + 2;
+        for (q = p; q < end && *q != '/'; q++)
+            ;
+    }
+    rq->path.p = q < end ? q : "/";
+    rq->path.len = q < end ? (size_t)(end - q) : 1;
+
+    if ((colon = memchr(p, ':', q - p)) != NULL) {
+        rq->port.p = colon + 1;
+        rq->port.len = q - colon - 1;
+    }
+    else {
+        rq->port.p = "80";
+        rq->port.len = 2;
+        colon = q;
+    }
+    rq->host.p = p;
+    rq->host.len = colon - p;
+}
+
+
+/*
+ * req_line 解析请求行：方法、URL与版本三个词
+ */
+static int req_line(http_req* rq, const char* line, const char* end)
+{
+    rq->method = next_token(&line, end);
+    rq->url = next_token(&line, end);
+    rq->version = next_token(&line, end);
+    if (!rq->method.len || !rq->url.len || !rq->version.len || next_token(&line, end).len)
+        return -1;
+    req_split_url(rq);
+    return 0;
+}
+
+
+/*
+ * req_add_header 记录一行报头"name: value"，名字中不能有空白
+ */
+static int req_add_header(http_req* rq, const char* line, const char* end)
+{
+    const char *colon = memchr(line, ':', end - line), *v;
+    http_header* h;
+
+    if (colon == NULL || colon == line || rq->nheaders == REQ_MAX_HEADERS)
+        return -1;
+    for (v = line; v < colon; v++)
+        if (*v == ' ' || *v == '\t')
+            return -1;
+    for (v = colon + 1; v < end && (*v == ' ' || *v == '\t'); v++)
+        ;
+    while (end > v && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    h = &rq->headers[rq->nheaders++];
+    h->name.p = line;
+    h->name.len = colon - line;
+    h->value.p = v;
+    h->value.len = end - v;
+    return 0;
+}
+
+
+/*
+ * req_keepalive 客户端是否要求在本次响应之后保持连接
+ * HTTP/1.1默认保持，除非Connection或Proxy-Connection中有close；
+ * 响应报头原样转发，HTTP/1.0客户端无从得知连接会被保持，故一律在响应后关闭
+ */
+static int req_keepalive(http_req* rq)
+{
+    http_header* h;
+
+    if (!span_is(rq->version, "HTTP/1.1"))
+        return 0;
+    for (h = rq->headers; h < rq->headers + rq->nheaders; h++)
+        if ((span_is(h->name, "Connection") || span_is(h->name, "Proxy-Connection"))
+            && has_token(h->value.p, h->value.len, "close"))
+            return 0;
+    return 1;
+}
+
+
+/*
+ * req_parse 解析buf前n字节中尚未解析的完整行，上次停下的行从头再检查
+ * 请求行之前的空行按RFC 7230忽略；报头以空行结束
+ */
+int req_parse(http_req* rq, const char* buf, size_t n)
+{
+    const char *line, *end, *nl;
+
+    while (rq->pos < n) {
+        line = buf + rq->pos;
+        if ((nl = memchr(line, '\n', n - rq->pos)) == NULL)
+            return REQ_INCOMPLETE;
+        rq->pos = nl + 1 - buf;
+        end = (nl > line && nl[-1] == '\r') ? nl - 1 : nl;
+        if (rq->lines == 0) {
+            if (end == line)
+                continue;
+            if (req_line(rq, line, end) < 0)
+                return REQ_BAD;
+        }
+        else if (end == line) {
+            rq->len = rq->pos;
+            rq->keepalive = req_keepalive(rq);
+            return REQ_DONE;
+        }
+        else if (req_add_header(rq, line, end) < 0)
+            return REQ_BAD;
+        rq->lines++;
+    }
+    return REQ_INCOMPLETE;
+}
+
+
+/*
+ * req_header 按名字查找请求报头
+ */
+const http_span* req_header(http_req* rq, const char* name)
+{
+    for (int i = 0; i < rq->nheaders; i++)
+        if (span_is(rq->headers[i].name, name))
+            return &rq->headers[i].value;
+    return NULL;
+}
+
+
+/*
+ * req_credentials 请求是否带有Authorization或Cookie
+ */
+int req_credentials(http_req* rq)
+{
+    return req_header(rq, "Authorization") != NULL || req_header(rq, "Cookie") != NULL;
+}
+
+
+/*
+ * req_identity 启用压缩变体时，响应可能进入cache的请求要求服务器回答未压缩的内容
+ */
+int req_identity(http_req* rq, const char* cond)
+{
+    return upstream_identity && (cond != NULL || !req_credentials(rq));
+}
+
+
+/*
+ * req_storable 转发了Accept-Encoding的响应可能是压缩的，不能作为cache中的原对象
+ */
+int req_storable(http_req* rq, const char* cond)
+{
+    return !upstream_identity || req_identity(rq, cond);
+}
+
+
+/*
+ * req_range 解析单个字节范围
+ * If-Range要求版本不符时回答整个对象，代理不核对它，这样的请求按普通请求处理
+ */
+int req_range(http_req* rq, size_t* first, size_t* last, int* suffix)
+{
+    const http_span* h = req_header(rq, "Range");
+    char val[64], *p, *end;
+
+    if (h == NULL || req_header(rq, "If-Range") || h->len >= sizeof(val))
+        return 0;
+    span_copy(val, sizeof(val), *h);
+    if (strncasecmp(val, "bytes=", 6) || strchr(val, ','))
+        return 0;
+    p = val + 6;
+    *suffix = (*p == '-');
+    if (*suffix)
+        p++;
+    if (!isdigit((unsigned char)*p))
+        return 0;
+    *first = strtoull(p, &end, 10);
+    *last = RANGE_OPEN;
+    if (*suffix)
+        return *end == '\0' && *first > 0;
+    if (*end++ != '-')
+        return 0;
+    if (*end == '\0')
+        return 1;
+    if (!isdigit((unsigned char)*end))
+        return 0;
+    *last = strtoull(end, &p, 10);
+    return *p == '\0' && *last >= *first;
+}
+
+
+/*
+ * req_accepts 逐项检查Accept-Encoding，第一个匹配coding或"*"的项决定结果
+ * q值的所有数字都是0时表示明确拒绝
+ */
+int req_accepts(http_req* rq, const char* coding)
+{
+    const http_span* h = req_header(rq, "Accept-Encoding");
+    const char *p, *q, *item, *end;
+    size_t n = strlen(coding);
+
+    if (h == NULL)
+        return 0;
+    for (p = h->p, end = h->p + h->len; p < end; p = item + 1) {
+        if ((item = memchr(p, ',', end - p)) == NULL)
+            item = end;
+        while (p < item && (*p == ' ' || *p == '\t'))
+            p++;
+        for (q = p; q < item && *q != ';' && *q != ' ' && *q != '\t'; q++)
+            ;
+        if (!((size_t)(q - p) == n && !strncasecmp(p, coding, n)) && !(q - p == 1 && *p == '*'))
+            continue;
+        for (; q + 1 < item && strncasecmp(q, "q=", 2); q++)
+            ;
+        if (q + 1 >= item)
+            return 1;
+        for (q += 2; q < item && (*q == '0' || *q == '.'); q++)
+            ;
+        return q < item && isdigit((unsigned char)*q);
+    }
+    return 0;
+}
+
+
+/*
+ * iov_set 让iovec指向一段内容
+ */
+static void iov_set(struct iovec* iov, const char* p, size_t len)
+{
+    iov->iov_base = (void*)p;
+    iov->iov_len = len;
+}
+
+
+/*
+ * is_conditional 是否为条件请求的报头
+ */
+static int is_conditional(http_span name)
+{
+    return span_is(name, "If-None-Match") || span_is(name, "If-Modified-Since")
+        || span_is(name, "If-Match") || span_is(name, "If-Unmodified-Since") || span_is(name, "If-Range");
+}
+
+
+/*
+ * build_request_iov 编制发往服务器的请求，各段直接指向接收缓冲区中的路径与报头行，不拷贝
+ * User-Agent与逐跳报头由代理自己填写，其余报头按名字完全匹配后原样转发；
+ * 重新验证cache中的对象时（cond非空），客户端的条件报头换成代理依据该对象编制的条件报头；
+ * 客户端的Range由代理处理（见range.c），需要时由cond给出代理自己要取的范围；
+ * 由代理压缩时（见gzip.c），响应会进入cache的请求不转发Accept-Encoding，服务器回答未压缩的内容；
+ * 使用HTTP/1.1并要求保持连接，以便与服务器的连接放回连接池复用
+ * 整个请求由调用者用一次writev发出，而不是每行一次写入
+ */
+int build_request_iov(struct iovec* iov, http_req* rq, const char* cond)
+{
+    int n = 0, have_Host = 0;
+    http_header* h;
+
+    iov_set(&iov[n++], "GET ", 4);
+    iov_set(&iov[n++], rq->path.p, rq->path.len);
+    iov_set(&iov[n++], " HTTP/1.1\r\n", 11);
+    for (h = rq->headers; h < rq->headers + rq->nheaders; h++) {
+        if (span_is(h->name, "Host"))
+            have_Host = 1;
+        else if (span_is(h->name, "User-Agent") || span_is(h->name, "Connection")
+            || span_is(h->name, "Proxy-Connection") || span_is(h->name, "Keep-Alive")
+            || span_is(h->name, "Range") || span_is(h->name, "If-Range")
+            || (span_is(h->name, "Accept-Encoding") && req_identity(rq, cond))
+            || (cond && is_conditional(h->name)))
+            continue;
+        /* 名字到值的结尾在缓冲区中连续，整行作为一段 */
+        iov_set(&iov[n++], h->name.p, h->value.p + h->value.len - h->name.p);
+        iov_set(&iov[n++], "\r\n", 2);
+    }
+
+    if (!have_Host) {
+        iov_set(&iov[n++], "Host: ", 6);
+        iov_set(&iov[n++], rq->host.p, rq->host.len);
+        iov_set(&iov[n++], "\r\n", 2);
+    }
+    if (cond)
+        iov_set(&iov[n++], cond, strlen(cond));
+    iov_set(&iov[n++], user_agent_hdr, strlen(user_agent_hdr));
+    iov_set(&iov[n++], "Connection: keep-alive\r\n\r\n", 26);
+    return n;
+}
+
+
+/*
+ * build_request 把build_request_iov的各段依次拷贝到buf中，供需要保留请求以便重发的调用者使用
+ * 缓冲区不足时截断并返回已编制的长度
+ */
+size_t build_request(char* buf, size_t maxlen, http_req* rq, const char* cond)
+{
+    struct iovec iov[REQ_IOV_MAX];
+    int n = build_request_iov(iov, rq, cond);
+    size_t len = 0, k;
+
+    for (int i = 0; i < n && len < maxlen; i++) {
+        k = iov[i].iov_len < maxlen - len ? iov[i].iov_len : maxlen - len;
+        memcpy(buf + len, iov[i].iov_base, k);
+        len += k;
+    }
+    return len;
+}
+
+
+/*
+ * build_clienterror 编制返回给客户端的错误信息
+ */
+size_t build_clienterror(char* buf, size_t maxlen, char* cause, char* errnum,
+    char* shortmsg, char* longmsg)
+{
+    char body[MAXBUF];
+    size_t len;
+
+    /* Build the HTTP response body */
+    snprintf(body, sizeof(body),
+        "<html><title>Tiny Error</title>"
+        "<body bgcolor=""ffffff"">\r\n"
+        "%s: %s\r\n"
+        "<p>%s: %.2048s\r\n"
+        "<hr><em>The Tiny Web server</em>\r\n",
+        errnum, shortmsg, longmsg, cause);
+
+    /* Build the HTTP response */
+    len = snprintf(buf, maxlen,
+        "HTTP/1.0 %s %s\r\n"
+        "Content-type: text/html\r\n"
+        "Content-length: %d\r\n\r\n%s",
+        errnum, shortmsg, (int)strlen(body), body);
+    return len < maxlen ? len : maxlen;
+}
+
+
+/*
+ * resp_init 开始分帧一个新的响应
+ */
+void resp_init(http_resp* rp)
+{
+    rp->state = RESP_HEAD;
+    rp->status = 0;
+    rp->keepalive = 0;
+    rp->chunked = 0;
+    rp->content_length = -1;
+    rp->remaining = 0;
+    rp->total = 0;
+    rp->head_len = 0;
+    rp->expected = 0;
+    rp->linelen = 0;
+    rp->no_store = rp->no_cache = 0;
+    rp->max_age = -1;
+    rp->age = 0;
+    rp->date = rp->expires = 0;
+    rp->etag[0] = rp->last_modified[0] = '\0';
+    rp->range_first = rp->range_total = -1;
+    rp->encoded = rp->gzipped = rp->textual = rp->vary_other = 0;
+}
+
+/*
+ * http_date 解析IMF-fixdate格式的时间（如"Sun, 06 Nov 1994 08:49:37 GMT"），无法解析时返回0
+ * 已废弃的两种格式不再支持，按无法解析处理
+ */
+static time_t http_date(const char* s)
+{
+    static const char* months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char mon[4];
+    const char* m;
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(s, "%*3s, %d %3s %d %d:%d:%d GMT", &tm.tm_mday, mon, &tm.tm_year,
+        &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 || strlen(mon) != 3
+        || (m = strstr(months, mon)) == NULL || (m - months) % 3)
+        return 0;
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_year -= 1900;
+    return timegm(&tm);
+}
+
+/*
+ * save_validator 保存ETag或Last-Modified的值，过长的不保存
+ */
+static void save_validator(char* dst, const char* val)
+{
+    if (strlen(val) < RESP_VALIDATOR_MAX)
+        strcpy(dst, val);
+}
+
+/*
+ * cache_control 逐个处理Cache-Control中以逗号分隔的指令
+ * s-maxage是专门给共享cache的，优先于max-age
+ */
+static void cache_control(http_resp* rp, char* val)
+{
+    char *d, *arg, *save = NULL;
+    int shared = 0;
+
+    for (d = strtok_r(val, ",", &save); d; d = strtok_r(NULL, ",", &save)) {
+        while (*d == ' ' || *d == '\t')
+            d++;
+        if ((arg = strchr(d, '=')) != NULL)
+            *arg++ = '\0';
+        d[strcspn(d, " \t")] = '\0';
+        if (!strcasecmp(d, "no-store") || !strcasecmp(d, "private"))
+            rp->no_store = 1;
+        else if (!strcasecmp(d, "no-cache"))
+            rp->no_cache = 1;
+        else if (!strcasecmp(d, "s-maxage") && arg) {
+            rp->max_age = atol(arg);
+            shared = 1;
+        }
+        else if (!strcasecmp(d, "max-age") && arg && !shared)
+            rp->max_age = atol(arg);
+    }
+}
+
+/*
+ * resp_header 处理一行完整的状态行或报头
+ */
+static void resp_header(http_resp* rp, char* line)
+{
+    int minor;
+    char* val;
+
+    if (rp->status == 0) {
+        if (sscanf(line, "HTTP/1.%d %d", &minor, &rp->status) == 2)
+            rp->keepalive = (minor >= 1); /* HTTP/1.1默认保持连接 */
+        else
+            rp->status = -1;
+        return;
+    }
+    if ((val = strchr(line, ':')) == NULL)
+        return;
+    *val++ = '\0';
+    while (*val == ' ' || *val == '\t')
+        val++;
+    if (!strcasecmp(line, "Content-Length"))
+        rp->content_length = atol(val);
+    else if (!strcasecmp(line, "Transfer-Encoding"))
+        rp->chunked = has_token(val, strlen(val), "chunked");
+    else if (!strcasecmp(line, "Connection")) {
+        if (has_token(val, strlen(val), "close"))
+            rp->keepalive = 0;
+        else if (has_token(val, strlen(val), "keep-alive"))
+            rp->keepalive = 1;
+    }
+    else if (!strcasecmp(line, "Cache-Control"))
+        cache_control(rp, val);
+    else if (!strcasecmp(line, "Age"))
+        rp->age = atol(val);
+    else if (!strcasecmp(line, "Date"))
+        rp->date = http_date(val);
+    else if (!strcasecmp(line, "Expires")) {
+        if ((rp->expires = http_date(val)) == 0)
+            rp->expires = 1; /* 无法解析的Expires（如"0"）表示已经过期 */
+    }
+    else if (!strcasecmp(line, "ETag"))
+        save_validator(rp->etag, val);
+    else if (!strcasecmp(line, "Last-Modified"))
+        save_validator(rp->last_modified, val);
+    else if (!strcasecmp(line, "Content-Range")
+        && sscanf(val, "bytes %ld-%*[0-9]/%ld", &rp->range_first, &rp->range_total) < 1)
+        rp->range_first = -1;
+    else if (!strcasecmp(line, "Content-Encoding")) {
+        rp->encoded = strcasecmp(val, "identity") != 0;
+        rp->gzipped = !strcasecmp(val, "gzip") || !strcasecmp(val, "x-gzip");
+    }
+    else if (!strcasecmp(line, "Content-Type"))
+        rp->textual = !strncasecmp(val, "text/", 5) || has_substr(val, "json")
+            || has_substr(val, "javascript") || has_substr(val, "xml");
+    else if (!strcasecmp(line, "Vary"))
+        rp->vary_other = has_other_token(val, strlen(val), "Accept-Encoding");
+}
+
+/*
+ * resp_body_start 报头结束，确定响应体的分帧方式
+ */
+static void resp_body_start(http_resp* rp)
+{
+    if (rp->status < 0) {
+        rp->state = RESP_UNTIL_EOF;
+        rp->keepalive = 0;
+    }
+    else if ((rp->status >= 100 && rp->status < 200) || rp->status == 204 || rp->status == 304) {
+        rp->state = RESP_DONE; /* 没有响应体 */
+        rp->expected = rp->head_len;
+    }
+    else if (rp->chunked)
+        rp->state = RESP_CHUNK_SIZE;
+    else if (rp->content_length >= 0) {
+        rp->remaining = rp->content_length;
+        rp->state = rp->remaining ? RESP_LENGTH : RESP_DONE;
+        rp->expected = rp->head_len + rp->content_length;
+    }
+    else {
+        rp->state = RESP_UNTIL_EOF;
+        rp->keepalive = 0;
+    }
+}
+
+/*
+ * resp_line 处理以行为单位的部分（报头、chunk大小、trailer）中完整的一行
+ */
+static void resp_line(http_resp* rp)
+{
+    char* line = rp->line;
+
+    rp->line[rp->linelen] = '\0';
+    rp->linelen = 0;
+    line[strcspn(line, "\r\n")] = '\0';
+
+    switch (rp->state) {
+    case RESP_HEAD:
+        if (*line == '\0') {
+            if (rp->status == 100) { /* 100 Continue之后还有真正的响应 */
+                rp->status = 0;
+                return;
+            }
+            resp_body_start(rp);
+        }
+        else
+            resp_header(rp, line);
+        break;
+    case RESP_CHUNK_SIZE:
+        rp->remaining = strtoul(line, NULL, 16);
+        rp->state = rp->remaining ? RESP_CHUNK_DATA : RESP_TRAILER;
+        break;
+    case RESP_TRAILER:
+        if (*line == '\0')
+            rp->state = RESP_DONE;
+        break;
+    }
+}
+
+/*
+ * resp_feed 输入收到的n字节，返回其中属于本响应的字节数
+ * 返回值小于n时，多出的字节不属于本响应（服务器多发了数据，连接不能复用）
+ */
+size_t resp_feed(http_resp* rp, const char* buf, size_t n)
+{
+    size_t i = 0, k;
+
+    while (i < n && rp->state != RESP_DONE) {
+        switch (rp->state) {
+        case RESP_HEAD:
+        case RESP_CHUNK_SIZE:
+        case RESP_TRAILER:
+            if (rp->state == RESP_HEAD)
+                rp->head_len++;
+            if (rp->linelen < MAXLINE - 1)
+                rp->line[rp->linelen++] = buf[i];
+            if (buf[i++] == '\n')
+                resp_line(rp);
+            break;
+        case RESP_LENGTH:
+        case RESP_CHUNK_DATA:
+            k = n - i < rp->remaining ? n - i : rp->remaining;
+            i += k;
+            rp->remaining -= k;
+            if (rp->remaining == 0)
+                rp->state = (rp->state == RESP_LENGTH) ? RESP_DONE : RESP_CHUNK_CRLF;
+            break;
+        case RESP_CHUNK_CRLF:
+            if (buf[i++] == '\n')
+                rp->state = RESP_CHUNK_SIZE;
+            break;
+        case RESP_UNTIL_EOF:
+            i = n;
+            break;
+        }
+    }
+    if (i < n)
+        rp->keepalive = 0;
+    rp->total += i;
+    return i;
+}
+
+/*
+ * resp_reusable 响应已完整且服务器允许复用连接
+ */
+int resp_reusable(http_resp* rp)
+{
+    return rp->state == RESP_DONE && rp->keepalive;
+}
+
+/*
+ * resp_persistent 一段完整的响应（如cache中的对象）自身分帧且允许保持连接
+ * 没有长度信息、以关闭连接结束的响应发给客户端之后必须关闭连接
+ */
+int resp_persistent(const char* buf, size_t n)
+{
+    http_resp resp;
+
+    resp_init(&resp);
+    resp_feed(&resp, buf, n);
+    return resp_reusable(&resp);
+}
+
+/*
+ * resp_cacheable 报头已完整的响应能否缓存
+ * 只缓存默认可缓存且完整表示资源的状态码；no-store与private的响应不缓存
+ */
+int resp_cacheable(http_resp* rp)
+{
+    switch (rp->status) {
+    case 200: case 203: case 300: case 301: case 404: case 410:
+        return !rp->no_store;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * resp_expires 计算新鲜期截止的时刻（RFC 9111第4.2节）
+ * 新鲜期依次取s-maxage或max-age、Expires与Date之差、Last-Modified推算的10%，都没有时取默认值；
+ * 当前的年龄由Date与Age得出，所以同一个保存的响应在不同时刻计算得到的截止时刻相同
+ */
+time_t resp_expires(http_resp* rp, time_t now)
+{
+    time_t date = rp->date ? rp->date : now, lm;
+    long lifetime, age;
+
+    if (rp->no_cache)
+        lifetime = 0;
+    else if (rp->max_age >= 0)
+        lifetime = rp->max_age;
+    else if (rp->expires)
+        lifetime = rp->expires - date;
+    else if (rp->last_modified[0] && (lm = http_date(rp->last_modified)) && lm < date) {
+        lifetime = (date - lm) / 10;
+        if (lifetime > RESP_HEURISTIC_MAX)
+            lifetime = RESP_HEURISTIC_MAX;
+    }
+    else
+        lifetime = RESP_DEFAULT_TTL;
+    age = (now > date ? now - date : 0) + (rp->age > 0 ? rp->age : 0);
+    return now + lifetime - age;
+}
+
+/*
+ * resp_head 只分帧保存的响应的报头部分，不遍历响应体
+ */
+void resp_head(http_resp* rp, const char* buf, size_t n)
+{
+    size_t k;
+
+    resp_init(rp);
+    for (; n > 0 && rp->state == RESP_HEAD; buf += k, n -= k) {
+        k = n < MAXLINE ? n : MAXLINE;
+        resp_feed(rp, buf, k);
+    }
+}
+
+/*
+ * resp_fresh_until 保存的响应的新鲜期截止的时刻
+ */
+time_t resp_fresh_until(const char* buf, size_t n, time_t now)
+{
+    http_resp resp;
+
+    resp_head(&resp, buf, n);
+    return resp_expires(&resp, now);
+}
+
+/*
+ * resp_refresh 304之后的新鲜期：304带有新鲜期报头时以它为准，否则沿用保存的响应的，
+ * 年龄都从304的Date算起
+ */
+time_t resp_refresh(http_resp* rp, const char* buf, size_t n, time_t now)
+{
+    http_resp old;
+
+    if (rp->max_age < 0 && !rp->expires && !rp->no_cache) {
+        resp_head(&old, buf, n);
+        rp->max_age = old.max_age;
+        rp->no_cache = old.no_cache;
+        /* Expires是绝对时刻，对照的Date须是同一个响应的 */
+        if (old.expires)
+            rp->expires = old.expires + ((rp->date ? rp->date : now) - (old.date ? old.date : now));
+        if (!rp->last_modified[0])
+            strcpy(rp->last_modified, old.last_modified);
+    }
+    return resp_expires(rp, now);
+}
+
+/*
+ * build_conditional 由保存的响应中的验证器编制条件报头行，供重新验证使用
+ */
+size_t build_conditional(char* buf, size_t maxlen, const char* resp, size_t n)
+{
+    http_resp rp;
+    size_t len = 0;
+
+    resp_head(&rp, resp, n);
+    if (rp.etag[0])
+        len += snprintf(buf + len, maxlen - len, "If-None-Match: %s\r\n", rp.etag);
+    if (rp.last_modified[0] && len < maxlen)
+        len += snprintf(buf + len, maxlen - len, "If-Modified-Since: %s\r\n", rp.last_modified);
+    return len < maxlen ? len : 0;
+}
+
+
+/*
+ * is_framing 是否为描述报文本身长度与连接的报头，编制206时由代理重新填写
+ */
+static int is_framing(const char* line, size_t len)
+{
+    static const char* names[] = { "Content-Length:", "Content-Range:", "Transfer-Encoding:",
+        "Connection:", "Proxy-Connection:", "Keep-Alive:" };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        if (len >= strlen(names[i]) && !strncasecmp(line, names[i], strlen(names[i])))
+            return 1;
+    return 0;
+}
+
+/*
+ * build_partial 换掉模板的状态行与分帧报头，其余报头（验证器、新鲜期等）原样保留，
+ * 因此编制出的206与模板一样可以判断新鲜期与重新验证
+ */
+size_t build_partial(char* buf, size_t maxlen, const char* resp, size_t head_len,
+    size_t first, size_t last, size_t total)
+{
+    const char *p = memchr(resp, '\n', head_len), *end = resp + head_len, *eol;
+    size_t len = snprintf(buf, maxlen, "HTTP/1.1 206 Partial Content\r\n"), k;
+
+    for (p = p ? p + 1 : end; p < end; p = eol + 1) {
+        if ((eol = memchr(p, '\n', end - p)) == NULL || eol - p <= 1)
+            break; /* 报头结尾的空行 */
+        k = eol + 1 - p;
+        if (is_framing(p, k))
+            continue;
+        if (len + k >= maxlen)
+            return 0;
+        memcpy(buf + len, p, k);
+        len += k;
+    }
+    if (len < maxlen)
+        len += snprintf(buf + len, maxlen - len, "Content-Range: bytes %zu-%zu/%zu\r\n"
+            "Content-Length: %zu\r\n\r\n", first, last, total, last - first + 1);
+    return len < maxlen ? len : 0;
+}
+
+/*
+ * build_encoded 保留模板的状态行与其余报头，去掉分帧报头与原有的Content-Encoding、Vary，
+ * 改为声明coding编码并按Accept-Encoding区分变体；强弱ETag都在结尾的引号前加上"-coding"，
+ * 避免按ETag比较时把两种编码的表示混为一谈
+ * 变体只在原对象新鲜时使用，它的新鲜期报头与原对象相同
+ */
+size_t build_encoded(char* buf, size_t maxlen, const char* resp, size_t head_len,
+    const char* coding, size_t length)
+{
+    const char *p = memchr(resp, '\n', head_len), *end = resp + head_len, *eol, *q;
+    size_t len, k, extra = strlen(coding) + 1;
+
+    if (p == NULL || (size_t)(p + 1 - resp) >= maxlen)
+        return 0;
+    len = p + 1 - resp;
+    memcpy(buf, resp, len);
+    for (p++; p < end; p = eol + 1) {
+        if ((eol = memchr(p, '\n', end - p)) == NULL || eol - p <= 1)
+            break; /* 报头结尾的空行 */
+        k = eol + 1 - p;
+        if (is_framing(p, k) || !strncasecmp(p, "Content-Encoding:", 17) || !strncasecmp(p, "Vary:", 5))
+            continue;
+        if (len + k + extra >= maxlen)
+            return 0;
+        q = eol;
+        if (!strncasecmp(p, "ETag:", 5))
+            while (q > p && *q != '"')
+                q--;
+        if (q < eol && memchr(p, '"', q - p)) {
+            /* 在结尾的引号之前插入后缀 */
+            memcpy(buf + len, p, q - p);
+            len += q - p;
+            len += sprintf(buf + len, "-%s", coding);
+            memcpy(buf + len, q, eol + 1 - q);
+            len += eol + 1 - q;
+        }
+        else {
+            memcpy(buf + len, p, k);
+            len += k;
+        }
+    }
+    if (len < maxlen)
+        len += snprintf(buf + len, maxlen - len, "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n"
+            "Content-Length: %zu\r\n\r\n", coding, length);
+    return len < maxlen ? len : 0;
+}
@@ -0,0 +1,176 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <sys/uio.h>
+#include "csapp.h"
+
+/* 多线程路径和事件驱动路径共用的报头常量 */
+extern const char* user_agent_hdr;
+extern const char* https_hdr;
+/* 为1时不向服务器转发客户端的Accept-Encoding，cache中总是未压缩的内容（见gzip.c） */
+extern int upstream_identity;
+
+#define REQ_MAX_HEADERS 64 /* 请求报头的最多行数 */
+#define REQ_IOV_MAX (2 * REQ_MAX_HEADERS + 9) /* build_request_iov最多用到的iovec个数 */
+#define RESP_VALIDATOR_MAX 256 /* 保存的ETag与Last-Modified的最大长度，更长时不用于重新验证 */
+#define RESP_COND_MAX (2 * RESP_VALIDATOR_MAX + 64) /* build_conditional编制的条件报头的最大长度 */
+#define RESP_DEFAULT_TTL 300 /* 既没有新鲜期也没有Last-Modified的响应保持新鲜的秒数 */
+#define RESP_HEURISTIC_MAX 86400 /* 按Last-Modified推算的新鲜期的上限 */
+#define RANGE_OPEN ((size_t)-1) /* Range中省略的最后一个字节位置（直到对象结尾） */
+
+/* 缓冲区中的一段，不以'\0'结尾 */
+typedef struct {
+    const char* p;
+    size_t len;
+} http_span;
+
+typedef struct {
+    http_span name, value; /* 值已去掉两端的空白 */
+} http_header;
+
+/* req_parse的返回值 */
+enum { REQ_INCOMPLETE, REQ_DONE, REQ_BAD };
+
+/* 
+ * 客户端请求的增量解析器
+ * 直接在接收缓冲区上解析，各部分以指向缓冲区的span给出而不拷贝；可以分多次输入，
+ * 每次只检查新到达的行。解析期间与使用结果期间，缓冲区的地址与已收到的内容不能改变
+ */
+typedef struct {
+    size_t pos; /* 下一行在缓冲区中的起点，之前的行已解析 */
+    size_t len; /* 解析完成后为请求行与报头（含结尾空行）的字节数，其后是请求体或流水线中的下一个请求 */
+    int lines; /* 已解析的行数 */
+    http_span method, url, version;
+    http_span host, port, path; /* 由url分解得到，省略时端口为"80"，路径为"/" */
+    int nheaders;
+    http_header headers[REQ_MAX_HEADERS];
+    int keepalive; /* 客户端要求在本次响应之后保持连接 */
+} http_req;
+
+void req_init(http_req* rq);
+/* 解析buf的前n字节中尚未解析的完整行，返回REQ_DONE、REQ_INCOMPLETE（需要更多输入）或REQ_BAD */
+int req_parse(http_req* rq, const char* buf, size_t n);
+/* 按名字查找请求报头（不区分大小写，完全匹配），没有时返回NULL */
+const http_span* req_header(http_req* rq, const char* name);
+/* 请求是否带有凭据（Authorization或Cookie），响应可能因人而异 */
+int req_credentials(http_req* rq);
+/* 
+ * upstream_identity时，响应会进入cache的请求不向服务器转发Accept-Encoding，cache中的原对象因此未压缩；
+ * 带凭据的请求照常转发，服务器可以压缩，响应不进入cache；cond非空（重新验证或Range回源）时总是针对cache
+ */
+int req_identity(http_req* rq, const char* cond);
+/* 服务器对这个请求的响应能否进入cache（见req_identity） */
+int req_storable(http_req* rq, const char* cond);
+/* span与str是否相同（不区分大小写） */
+int span_is(http_span s, const char* str);
+/* 把span拷贝为字符串，过长时截断，返回拷贝的字节数 */
+size_t span_copy(char* dst, size_t maxlen, http_span s);
+/* 
+ * 解析Range报头中的单个字节范围"bytes=first-last"、"bytes=first-"或"bytes=-n"，
+ * 后者*suffix置1、*first为n；省略的last为RANGE_OPEN
+ * 没有Range、有If-Range、有多个范围或无法解析时返回0
+ */
+int req_range(http_req* rq, size_t* first, size_t* last, int* suffix);
+/* 客户端的Accept-Encoding是否接受coding（列出它或"*"且q不为0） */
+int req_accepts(http_req* rq, const char* coding);
+/* 
+ * 由客户端的请求编制发往服务器的完整请求（HTTP/1.1，保持连接），返回请求长度
+ * 客户端的Range与If-Range不转发，由代理决定要取的部分；req_identity时也不转发Accept-Encoding；
+ * cond非空时是代理自己的条件报头（见build_conditional）或Range报头，取代客户端的条件报头
+ */
+size_t build_request(char* buf, size_t maxlen, http_req* rq, const char* cond);
+/* 同build_request，但不拷贝：各段指向接收缓冲区与常量字符串，返回iovec的个数，供一次writev发出 */
+int build_request_iov(struct iovec* iov, http_req* rq, const char* cond);
+/* 编制返回给客户端的错误信息，返回报文长度 */
+size_t build_clienterror(char* buf, size_t maxlen, char* cause, char* errnum,
+    char* shortmsg, char* longmsg);
+
+/* 响应分帧的状态 */
+enum {
+    RESP_HEAD,       /* 读取状态行与响应报头 */
+    RESP_LENGTH,     /* 按Content-Length读取响应体 */
+    RESP_CHUNK_SIZE, /* 读取chunk大小行 */
+    RESP_CHUNK_DATA, /* 读取chunk数据 */
+    RESP_CHUNK_CRLF, /* 读取chunk数据之后的CRLF */
+    RESP_TRAILER,    /* 读取最后一个chunk之后的trailer */
+    RESP_UNTIL_EOF,  /* 没有长度信息，响应体直到服务器关闭连接 */
+    RESP_DONE        /* 响应已完整 */
+};
+
+/* 
+ * 服务器响应的增量分帧器
+ * 逐段输入收到的字节，判断响应在何处结束以及连接能否复用
+ */
+typedef struct {
+    int state;
+    int status; /* 状态码 */
+    int keepalive; /* 服务器允许复用连接 */
+    int chunked;
+    long content_length; /* -1表示没有Content-Length */
+    size_t remaining; /* 当前响应体或chunk剩余的字节数 */
+    size_t total; /* 已输入的字节数 */
+    size_t head_len; /* 状态行与报头的字节数 */
+    size_t expected; /* 报头结束后得知的响应总字节数，事先未知（chunked或直到关闭）时为0 */
+    char line[MAXLINE]; /* 正在读取的报头行，过长部分被截断 */
+    size_t linelen;
+
+    /* 决定能否缓存与新鲜期的报头 */
+    int no_store; /* Cache-Control中有no-store或private，共享的代理不能缓存 */
+    int no_cache; /* Cache-Control中有no-cache，每次使用前都要重新验证 */
+    long max_age; /* s-maxage，没有时为max-age，都没有时为-1 */
+    long age; /* Age报头 */
+    time_t date; /* Date报头，0表示没有 */
+    time_t expires; /* Expires报头，0表示没有，无法解析时为1（已过期） */
+    char etag[RESP_VALIDATOR_MAX]; /* 重新验证用的ETag与Last-Modified，原样保存，空串表示没有 */
+    char last_modified[RESP_VALIDATOR_MAX];
+
+    /* 206的Content-Range "bytes first-last/total"，没有时为-1，总长度未知（"*"）时total为-1 */
+    long range_first, range_total;
+
+    /* 决定能否在cache中另存压缩变体的报头 */
+    int encoded; /* 有Content-Encoding（identity除外） */
+    int gzipped; /* Content-Encoding是gzip */
+    int textual; /* Content-Type是文本类（text/类型、JSON、JavaScript、XML） */
+    int vary_other; /* Vary中有Accept-Encoding以外的报头 */
+} http_resp;
+
+void resp_init(http_resp* rp);
+/* 输入n字节，返回其中属于本响应的字节数 */
+size_t resp_feed(http_resp* rp, const char* buf, size_t n);
+/* 响应已完整且连接可以复用 */
+int resp_reusable(http_resp* rp);
+/* 一段完整的响应（如cache中的对象）自身分帧且允许保持连接 */
+int resp_persistent(const char* buf, size_t n);
+/* 报头已完整的响应能否由共享的代理缓存 */
+int resp_cacheable(http_resp* rp);
+/* 报头已完整的响应在now收到，新鲜期截止的时刻 */
+time_t resp_expires(http_resp* rp, time_t now);
+/* 只分帧一段保存的响应的报头部分，不遍历响应体 */
+void resp_head(http_resp* rp, const char* buf, size_t n);
+/* 由cache中保存的响应buf（n字节）计算新鲜期截止的时刻，now为第一次使用它的时刻 */
+time_t resp_fresh_until(const char* buf, size_t n, time_t now);
+/* 
+ * 对保存的响应buf的重新验证得到304（报头在rp中）：304中的新鲜期报头取代保存的，
+ * 返回新的截止时刻
+ */
+time_t resp_refresh(http_resp* rp, const char* buf, size_t n, time_t now);
+/* 
+ * 由保存的响应中的验证器编制If-None-Match与If-Modified-Since报头行，
+ * 返回其长度；没有可用的验证器时返回0
+ */
+size_t build_conditional(char* buf, size_t maxlen, const char* resp, size_t n);
+/* 
+ * 以保存的响应resp的报头（head_len字节）为模板编制对象中[first, last]部分的206报头，
+ * total为对象的总长度；返回报头长度，放不下时返回0
+ */
+size_t build_partial(char* buf, size_t maxlen, const char* resp, size_t head_len,
+    size_t first, size_t last, size_t total);
+/* 
+ * 以保存的200响应resp的报头为模板编制按coding压缩、长度为length的变体的报头，
+ * ETag（包括W/开头的弱ETag）在结尾的引号前加上"-coding"后缀以区别于未压缩的表示；
+ * 返回报头长度，放不下时返回0
+ */
+size_t build_encoded(char* buf, size_t maxlen, const char* resp, size_t head_len,
+    const char* coding, size_t length);
+
+#endif
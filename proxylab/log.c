@@ -0,0 +1,238 @@
+/*
+ * 异步日志
+ * 请求路径上只把格式化好的消息连同级别与时间戳追加到本线程的环形缓冲区，不取stdio的锁，
+ * 也不做系统调用；输出过慢时丢弃日志而不是阻塞请求；
+ * 后台线程定期把各线程缓冲区中的记录转成文本行，攒成大块后一次write写到标准输出
+ * 同一线程的日志保持顺序，不同线程之间的先后以时间戳为准
+ * 多进程模式下每个工作进程有自己的后台线程，fork时继承的缓冲区中尚未写出的日志由主进程写出
+ */
+
+#include <stdarg.h>
+#include "log.h"
+
+#define REC_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+int log_threshold = LV_INFO;
+
+static log_ring *rings; /* 所有线程的缓冲区，只增不减 */
+static int nrings;
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static __thread log_ring *self;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER; /* 后台线程与退出时的写出互斥，写者不受影响 */
+static const char* names[] = { "error", "warn", "info", "debug" };
+
+/*
+ * ring_release 线程退出时交还缓冲区
+ */
+static void ring_release(void* p)
+{
+    __atomic_store_n(&((log_ring*)p)->used, 0, __ATOMIC_RELEASE);
+}
+
+static void key_create(void)
+{
+    pthread_key_create(&key, ring_release);
+}
+
+/*
+ * ring_get 取得本线程的缓冲区，优先接手已退出线程的缓冲区
+ */
+static log_ring* ring_get(void)
+{
+    log_ring *r;
+    int zero;
+
+    if(self)
+        return self;
+    pthread_once(&once, key_create);
+    for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next){
+        zero = 0;
+        if(!__atomic_load_n(&r->used, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(&r->used, &zero, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if(r == NULL){
+        r = (log_ring*)Calloc(1, sizeof(log_ring));
+        r->used = 1;
+        r->id = __atomic_add_fetch(&nrings, 1, __ATOMIC_RELAXED);
+        r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&rings, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(key, r);
+    return self = r;
+}
+
+int log_level_parse(const char* name)
+{
+    for(int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++)
+        if(strcmp(names[i], name) == 0)
+            return i;
+    return -1;
+}
+
+/*
+ * log_msg 先在栈上格式化，再整条拷入缓冲区，最后以release推进head发布
+ * 缓冲区末尾放不下整条记录时先写一条填充记录，从头开始
+ */
+void log_msg(int level, const char* fmt, ...)
+{
+    log_ring *r = ring_get();
+    char msg[LOG_MAX_MSG];
+    struct timespec ts;
+    va_list ap;
+    int n;
+    size_t need, room, skip = 0, pos;
+    uint64_t head = r->head;
+    log_rec *rec;
+
+    va_start(ap, fmt);
+    n = vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    if(n < 0)
+        return;
+    if(n >= (int)sizeof(msg))
+        n = sizeof(msg) - 1;
+    while(n > 0 && msg[n - 1] == '\n') /* 换行由写出时添加 */
+        n--;
+
+    need = REC_ALIGN(sizeof(log_rec) + n);
+    pos = head & (LOG_RING_SIZE - 1);
+    if(LOG_RING_SIZE - pos < need)
+        skip = LOG_RING_SIZE - pos;
+    room = LOG_RING_SIZE - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+    if(room < skip + need){
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if(skip){
+        if(skip >= sizeof(log_rec)){
+            rec = (log_rec*)(r->buf + pos);
+            rec->len = skip;
+            rec->level = LV_PAD;
+        }
+        pos = 0;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec = (log_rec*)(r->buf + pos);
+    rec->len = need;
+    rec->msglen = n;
+    rec->level = level;
+    rec->usec = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    memcpy(rec + 1, msg, n);
+    __atomic_store_n(&r->head, head + skip + need, __ATOMIC_RELEASE);
+}
+
+/*
+ * out_write 把攒好的文本写到标准输出，遇到不足值时继续
+ */
+static void out_write(char* buf, size_t len)
+{
+    ssize_t n;
+
+    while(len > 0){
+        if((n = write(STDOUT_FILENO, buf, len)) < 0){
+            if(errno == EINTR)
+                continue;
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/*
+ * ring_drain 把一个缓冲区中已发布的记录转成文本行追加到out，out将满时先写出
+ */
+static size_t ring_drain(log_ring* r, char* out, size_t len, size_t cap)
+{
+    uint64_t tail = r->tail, head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE), dropped;
+    size_t pos;
+    log_rec *rec;
+    struct tm tm;
+    time_t sec;
+
+    while(tail < head){
+        pos = tail & (LOG_RING_SIZE - 1);
+        rec = (log_rec*)(r->buf + pos);
+        if(LOG_RING_SIZE - pos < sizeof(log_rec) || rec->level == LV_PAD){
+            tail += LOG_RING_SIZE - pos;
+            continue;
+        }
+        if(cap - len < LOG_MAX_MSG + MAXLINE){
+            out_write(out, len);
+            len = 0;
+        }
+        sec = rec->usec / 1000000;
+        localtime_r(&sec, &tm);
+        len += strftime(out + len, cap - len, "%Y-%m-%d %H:%M:%S", &tm);
+        len += snprintf(out + len, cap - len, ".%06lu %-5s [%d] %.*s\n", (unsigned long)(rec->usec % 1000000),
+            names[rec->level], r->id, (int)rec->msglen, (char*)(rec + 1));
+        tail += rec->len;
+    }
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+    dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    if(dropped != r->reported){
+        len += snprintf(out + len, cap - len, "[%d] %lu log messages dropped\n", r->id,
+            (unsigned long)(dropped - r->reported));
+        r->reported = dropped;
+    }
+    return len;
+}
+
+void log_flush(void)
+{
+    static char out[LOG_RING_SIZE];
+    size_t len = 0;
+
+    pthread_mutex_lock(&flush_lock);
+    for(log_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+        len = ring_drain(r, out, len, sizeof(out));
+    out_write(out, len);
+    pthread_mutex_unlock(&flush_lock);
+}
+
+/*
+ * flusher 后台线程，定期写出各线程的日志
+ */
+static void* flusher(void* vargp)
+{
+    struct timespec ts = { 0, LOG_FLUSH_MS * 1000000L };
+
+    Pthread_detach(pthread_self());
+    while(1){
+        log_flush();
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+/*
+ * after_fork 子进程中只有调用fork的线程：丢弃继承来的日志（父进程会写出），交还其他线程的缓冲区，
+ * 重新启动后台线程
+ */
+static void after_fork(void)
+{
+    pthread_t tid;
+
+    pthread_mutex_init(&flush_lock, NULL);
+    for(log_ring *r = rings; r; r = r->next){
+        r->tail = r->head;
+        r->reported = r->dropped;
+        if(r != self)
+            r->used = 0;
+    }
+    Pthread_create(&tid, NULL, flusher, NULL);
+}
+
+void log_init(int level)
+{
+    pthread_t tid;
+
+    log_threshold = level;
+    atexit(log_flush);
+    pthread_atfork(NULL, NULL, after_fork);
+    Pthread_create(&tid, NULL, flusher, NULL);
+}
@@ -0,0 +1,59 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+/* 此处定义日志相关的常量 */
+#define LOG_RING_SIZE (64 * 1024) /* 每个线程的环形缓冲区字节数，2的幂 */
+#define LOG_MAX_MSG 512 /* 一条消息的最大长度，过长时截断 */
+#define LOG_FLUSH_MS 10 /* 后台线程两次写出之间的毫秒数 */
+
+/* 日志级别，数值越大越详细 */
+typedef enum{
+    LV_ERROR,
+    LV_WARN,
+    LV_INFO,  /* 默认：启动信息、每个请求的请求行、隧道的结束 */
+    LV_DEBUG, /* 每个接受的连接 */
+    LV_PAD = 0xff /* 环形缓冲区末尾的填充，不是日志 */
+}log_level;
+
+/* 记录头，其后是消息正文（不含'\0'），整条记录按8字节对齐 */
+typedef struct{
+    uint32_t len; /* 整条记录的字节数 */
+    uint16_t msglen;
+    uint8_t level;
+    uint8_t pad;
+    uint64_t usec; /* 写入时的墙上时间，微秒 */
+}log_rec;
+
+/*
+ * 每个线程的环形缓冲区，单写者单读者：所属线程只推进head，后台线程只推进tail，不需要加锁
+ * head与tail是累计的字节数，对LOG_RING_SIZE取模得到位置；空间不足时丢弃新的日志并计数
+ */
+typedef struct log_ring{
+    struct log_ring *next;
+    int used; /* 已被某个线程占用；线程退出后未写出的日志仍由后台线程写出 */
+    int id; /* 日志中标识线程的序号 */
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t dropped;
+    uint64_t tail __attribute__((aligned(64)));
+    uint64_t reported; /* 已报告过的丢弃数 */
+    char buf[LOG_RING_SIZE] __attribute__((aligned(64)));
+}log_ring;
+
+extern int log_threshold;
+
+/* 高于当前级别的日志连参数都不求值 */
+#define LOG(lv, ...) do { if ((lv) <= log_threshold) log_msg((lv), __VA_ARGS__); } while (0)
+
+/* 按名字（error、warn、info、debug）解析级别，不存在时返回-1 */
+int log_level_parse(const char* name);
+/* 设置级别并启动后台写出线程，退出进程时写出剩余的日志；fork出的子进程各自重新启动后台线程 */
+void log_init(int level);
+/* 格式化一条日志放入本线程的环形缓冲区，不阻塞 */
+void log_msg(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+/* 把所有线程缓冲区中的日志写到标准输出 */
+void log_flush(void);
+
+#endif
@@ -0,0 +1,261 @@
+/*
+ * cache的淘汰策略与接纳过滤
+ * lru：命中时把block移到表头，需要加锁，由cache先记入访问缓冲，插入与淘汰前再补做；
+ * clock：命中只置访问位，淘汰时表尾置位的block清位后移回表头（二次机会）；
+ * s3fifo：新对象先进入小队列，在小队列中被再次访问的才进入主队列，
+ *   从小队列淘汰的URL记入幽灵队列，再次到来时直接进入主队列；主队列按访问计数给予多次机会；
+ * clock与s3fifo命中时只原子地修改block的访问位/计数，不需要加锁
+ * TinyLFU接纳与策略无关：分片已满时，新对象的估计访问次数不超过将被淘汰的对象就不接纳
+ */
+
+#include "cache.h"
+#include "shm.h"
+
+enum { Q_MAIN, Q_SMALL, Q_GONE };
+
+static const unsigned int seeds[SKETCH_DEPTH] = { 0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu };
+
+static unsigned int pow2_at_least(size_t n, unsigned int min)
+{
+    unsigned int w = min;
+    while(w < n)
+        w *= 2;
+    return w;
+}
+
+/*
+ * sketch_init 为大约nobjs个对象建立频率草图
+ */
+void sketch_init(freq_sketch* s, size_t nobjs)
+{
+    unsigned int width = pow2_at_least(nobjs, SKETCH_MIN_WIDTH);
+
+    s->cnt = (unsigned char*)shm_calloc((size_t)SKETCH_DEPTH * width, 1);
+    s->mask = width - 1;
+    s->adds = 0;
+    s->limit = 10 * width;
+}
+
+static unsigned int sketch_index(freq_sketch* s, unsigned int hash, int row)
+{
+    unsigned int h = hash * seeds[row];
+    return row * (s->mask + 1) + ((h ^ (h >> 16)) & s->mask);
+}
+
+/*
+ * sketch_add 记录一次访问，计数器到达上限后不再增加；累计limit次后全部减半
+ */
+void sketch_add(freq_sketch* s, unsigned int hash)
+{
+    unsigned char *c;
+
+    for(int i = 0; i < SKETCH_DEPTH; i++){
+        c = &s->cnt[sketch_index(s, hash, i)];
+        if(__atomic_load_n(c, __ATOMIC_RELAXED) < SKETCH_MAX)
+            __atomic_fetch_add(c, 1, __ATOMIC_RELAXED);
+    }
+    if(__atomic_add_fetch(&s->adds, 1, __ATOMIC_RELAXED) == s->limit){
+        for(size_t i = 0; i < (size_t)SKETCH_DEPTH * (s->mask + 1); i++)
+            __atomic_store_n(&s->cnt[i], __atomic_load_n(&s->cnt[i], __ATOMIC_RELAXED) >> 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->adds, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * sketch_estimate 各行计数器的最小值即访问次数的估计
+ */
+int sketch_estimate(freq_sketch* s, unsigned int hash)
+{
+    int est = SKETCH_MAX, v;
+
+    for(int i = 0; i < SKETCH_DEPTH; i++){
+        v = __atomic_load_n(&s->cnt[sketch_index(s, hash, i)], __ATOMIC_RELAXED);
+        if(v < est)
+            est = v;
+    }
+    return est;
+}
+
+/*
+ * queue_unlink, queue_push 维护双向链表形式的队列
+ */
+static void queue_unlink(cache_block* cb)
+{
+    cb->prev->next = cb->next;
+    cb->next->prev = cb->prev;
+}
+
+static void queue_push(cache_block* head, cache_block* cb)
+{
+    cb->next = head->next;
+    cb->prev = head;
+    head->next->prev = cb;
+    head->next = cb;
+}
+
+static void queue_remove(cache_shard* sp, cache_block* cb)
+{
+    queue_unlink(cb);
+    if(cb->queue == Q_SMALL)
+        sp->small_bytes -= cb->alloc;
+    cb->queue = Q_GONE;
+}
+
+/* lru */
+static void lru_init(cache_shard* sp)
+{
+}
+
+static void lru_insert(cache_shard* sp, cache_block* cb)
+{
+    cb->queue = Q_MAIN;
+    queue_push(&sp->lru, cb);
+}
+
+static void lru_hit(cache_shard* sp, cache_block* cb)
+{
+    if(cb->queue == Q_GONE) /* 查找之后已被淘汰 */
+        return;
+    queue_unlink(cb);
+    queue_push(&sp->lru, cb);
+}
+
+static cache_block* lru_victim(cache_shard* sp)
+{
+    return sp->lru.prev != &sp->lru ? sp->lru.prev : NULL;
+}
+
+/* clock */
+static void clock_insert(cache_shard* sp, cache_block* cb)
+{
+    cb->freq = 0;
+    cb->queue = Q_MAIN;
+    queue_push(&sp->lru, cb);
+}
+
+static void clock_hit(cache_shard* sp, cache_block* cb)
+{
+    if(!__atomic_load_n(&cb->freq, __ATOMIC_RELAXED))
+        __atomic_store_n(&cb->freq, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * clock_victim 表尾的block置了访问位时清位并移回表头，最多转一圈
+ */
+static cache_block* clock_victim(cache_shard* sp)
+{
+    cache_block *cb;
+
+    while((cb = sp->lru.prev) != &sp->lru && __atomic_load_n(&cb->freq, __ATOMIC_RELAXED)){
+        __atomic_store_n(&cb->freq, 0, __ATOMIC_RELAXED);
+        queue_unlink(cb);
+        queue_push(&sp->lru, cb);
+    }
+    return cb != &sp->lru ? cb : NULL;
+}
+
+/* s3fifo */
+static void s3fifo_init(cache_shard* sp)
+{
+    unsigned int n = pow2_at_least(sp->capacity / 4096, 256);
+
+    sp->ghost.ring = (unsigned int*)shm_calloc(n, sizeof(unsigned int));
+    sp->ghost.cnt = (unsigned char*)shm_calloc(n, 1);
+    sp->ghost.mask = n - 1;
+    sp->ghost.len = sp->ghost.head = 0;
+}
+
+static int ghost_contains(ghost_fifo* g, unsigned int hash)
+{
+    return g->cnt[hash & g->mask] > 0;
+}
+
+/*
+ * ghost_push 记录从小队列淘汰的URL，队列满时挤出最旧的一个
+ */
+static void ghost_push(ghost_fifo* g, unsigned int hash)
+{
+    unsigned int slot = (g->head + g->len) & g->mask;
+
+    if(g->len == g->mask + 1){
+        g->cnt[g->ring[g->head] & g->mask]--;
+        g->head = (g->head + 1) & g->mask;
+        slot = (g->head + g->len - 1) & g->mask;
+    }
+    else
+        g->len++;
+    g->ring[slot] = hash;
+    if(g->cnt[hash & g->mask] < 255)
+        g->cnt[hash & g->mask]++;
+}
+
+static void s3fifo_insert(cache_shard* sp, cache_block* cb)
+{
+    cb->freq = 0;
+    if(ghost_contains(&sp->ghost, cb->hash)){ /* 不久前刚被淘汰，直接进入主队列 */
+        cb->queue = Q_MAIN;
+        queue_push(&sp->lru, cb);
+    }
+    else{
+        cb->queue = Q_SMALL;
+        queue_push(&sp->small, cb);
+        sp->small_bytes += cb->alloc;
+    }
+}
+
+static void s3fifo_hit(cache_shard* sp, cache_block* cb)
+{
+    unsigned char f = __atomic_load_n(&cb->freq, __ATOMIC_RELAXED);
+    if(f < S3FIFO_MAX_FREQ)
+        __atomic_store_n(&cb->freq, f + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * s3fifo_victim 小队列超过配额（或主队列为空）时从小队列淘汰，
+ * 其中被访问过不止一次的block转入主队列；否则从主队列淘汰，访问计数不为0的减一后移回表头
+ */
+static cache_block* s3fifo_victim(cache_shard* sp)
+{
+    cache_block *cb;
+
+    while(1){
+        if(sp->small_bytes > sp->capacity / 100 * S3FIFO_SMALL_PERCENT || sp->lru.prev == &sp->lru){
+            if((cb = sp->small.prev) == &sp->small)
+                return NULL;
+            if(__atomic_load_n(&cb->freq, __ATOMIC_RELAXED) > 1){
+                queue_remove(sp, cb);
+                cb->freq = 0;
+                cb->queue = Q_MAIN;
+                queue_push(&sp->lru, cb);
+                continue;
+            }
+            ghost_push(&sp->ghost, cb->hash);
+            return cb;
+        }
+        cb = sp->lru.prev;
+        if(__atomic_load_n(&cb->freq, __ATOMIC_RELAXED) > 0){
+            __atomic_fetch_sub(&cb->freq, 1, __ATOMIC_RELAXED);
+            queue_unlink(cb);
+            queue_push(&sp->lru, cb);
+            continue;
+        }
+        return cb;
+    }
+}
+
+static const cache_policy policies[] = {
+    { "lru", 1, lru_init, lru_insert, lru_hit, lru_victim, queue_remove },
+    { "clock", 0, lru_init, clock_insert, clock_hit, clock_victim, queue_remove },
+    { "s3fifo", 0, s3fifo_init, s3fifo_insert, s3fifo_hit, s3fifo_victim, queue_remove },
+};
+
+/*
+ * policy_find 按名字查找淘汰策略
+ */
+const cache_policy* policy_find(const char* name)
+{
+    for(size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+        if(strcmp(policies[i].name, name) == 0)
+            return &policies[i];
+    return NULL;
+}
@@ -0,0 +1,61 @@
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include "csapp.h"
+
+/* 此处定义淘汰与接纳策略相关的常量 */
+#define SKETCH_DEPTH 4 /* 频率草图的行数 */
+#define SKETCH_MAX 15 /* 计数器的上限 */
+#define SKETCH_MIN_WIDTH 256
+#define S3FIFO_SMALL_PERCENT 10 /* S3-FIFO小队列占分片容量的比例 */
+#define S3FIFO_MAX_FREQ 3
+
+struct cache_shard;
+struct cache_block;
+
+/*
+ * 频率草图（count-min sketch），为TinyLFU接纳估计URL最近被访问的次数
+ * 计数器用原子操作更新，不需要加锁；累计一定次数后全部减半，使旧的访问逐渐失效
+ */
+typedef struct{
+    unsigned char *cnt; /* SKETCH_DEPTH行，每行width个计数器 */
+    unsigned int mask; /* width - 1 */
+    unsigned int adds; /* 上次减半以来的访问次数 */
+    unsigned int limit; /* adds达到limit时减半 */
+}freq_sketch;
+
+/*
+ * S3-FIFO的幽灵队列：只记录最近从小队列淘汰的URL哈希，不保存内容
+ * ring按先进先出记录哈希，cnt按哈希计数，用于O(1)地判断是否在队列中（允许误判）
+ */
+typedef struct{
+    unsigned int *ring;
+    unsigned char *cnt;
+    unsigned int len, head, mask;
+}ghost_fifo;
+
+/*
+ * 淘汰策略，各操作都在持有分片的锁时调用，hit除外：
+ * 查找不加锁，hit_locked为0时hit也不加锁调用，只能原子地修改block自己的字段；
+ * 非0时命中先记入分片的访问缓冲，之后在持有锁时补调hit，block可能已被摘除
+ */
+typedef struct{
+    const char *name;
+    int hit_locked;
+    void (*init)(struct cache_shard* sp);
+    void (*insert)(struct cache_shard* sp, struct cache_block* cb); /* 新block进入队列 */
+    void (*hit)(struct cache_shard* sp, struct cache_block* cb); /* block被命中 */
+    struct cache_block* (*victim)(struct cache_shard* sp); /* 选出下一个淘汰的block（仍在队列中），分片为空时返回NULL */
+    void (*remove)(struct cache_shard* sp, struct cache_block* cb); /* 从队列中摘除 */
+}cache_policy;
+
+/* 按名字（lru、clock、s3fifo）查找淘汰策略，不存在时返回NULL */
+const cache_policy* policy_find(const char* name);
+/* 为大约nobjs个对象建立频率草图 */
+void sketch_init(freq_sketch* s, size_t nobjs);
+/* 记录一次访问 */
+void sketch_add(freq_sketch* s, unsigned int hash);
+/* 估计访问次数 */
+int sketch_estimate(freq_sketch* s, unsigned int hash);
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * 多进程模式
+ * 主进程fork出若干工作进程，每个工作进程在同一端口上打开自己的SO_REUSEPORT监听套接字，
+ * 内核按连接的四元组在各套接字之间分配新连接，工作进程之间不争抢同一个accept队列；
+ * cache位于fork之前映射的共享内存中（见shm.c），所有工作进程共享命中；
+ * 主进程只等待工作进程退出：某个工作进程崩溃时只断开它自己的连接，主进程收回它的读者记录后重新启动一个，
+ * 其余工作进程照常服务；主进程退出时工作进程收到SIGTERM随之退出
+ */
+
+#include <sys/prctl.h>
+#include "prefork.h"
+#include "cache.h"
+#include "log.h"
+
+/*
+ * open_reuseport 在port上打开带SO_REUSEPORT的监听套接字，失败返回-1
+ */
+static int open_reuseport(char* port)
+{
+    struct addrinfo hints, *listp, *p;
+    int fd = -1, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if(getaddrinfo(NULL, port, &hints, &listp) != 0)
+        return -1;
+    for(p = listp; p; p = p->ai_next){
+        if((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int)) == 0
+            && bind(fd, p->ai_addr, p->ai_addrlen) == 0 && listen(fd, LISTENQ) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(listp);
+    return fd;
+}
+
+/*
+ * spawn 启动一个工作进程；在工作进程中返回它的监听套接字，在主进程中返回-1
+ */
+static int spawn(pid_t* pid, char* port)
+{
+    pid_t master = getpid();
+    sigset_t set;
+    int fd;
+
+    if((*pid = Fork()) != 0)
+        return -1;
+    /* 主进程已经退出时不再启动 */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if(getppid() != master)
+        exit(0);
+    /* 快照线程只在主进程中，工作进程按默认方式响应SIGTERM */
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+    if((fd = open_reuseport(port)) < 0){
+        LOG(LV_ERROR, "worker %d cannot listen on port %s: %s", (int)getpid(), port, strerror(errno));
+        exit(1);
+    }
+    LOG(LV_INFO, "Worker %d listening on port %s", (int)getpid(), port);
+    return fd;
+}
+
+int prefork_run(int nprocs, char* port)
+{
+    pid_t *pids = (pid_t*)Calloc(nprocs, sizeof(pid_t)), pid;
+    time_t *started = (time_t*)Calloc(nprocs, sizeof(time_t));
+    int fd, status, i;
+
+    /* 先在主进程中试着打开一次，端口不可用时直接报错而不是让工作进程反复失败 */
+    if((fd = open_reuseport(port)) < 0){
+        fprintf(stderr, "cannot listen on port %s\n", port);
+        exit(1);
+    }
+    close(fd);
+    /* 由下面的waitpid回收工作进程，不能让sigchld_handler抢先 */
+    Signal(SIGCHLD, SIG_DFL);
+    for(i = 0; i < nprocs; i++){
+        started[i] = time(NULL);
+        if((fd = spawn(&pids[i], port)) >= 0)
+            return fd;
+    }
+    while(1){
+        if((pid = waitpid(-1, &status, 0)) < 0){
+            if(errno == EINTR)
+                continue;
+            unix_error("waitpid error");
+        }
+        for(i = 0; i < nprocs && pids[i] != pid; i++)
+            ;
+        if(i == nprocs)
+            continue;
+        if(WIFSIGNALED(status))
+            LOG(LV_ERROR, "Worker %d killed by signal %d, restarting", (int)pid, WTERMSIG(status));
+        else
+            LOG(LV_ERROR, "Worker %d exited with status %d, restarting", (int)pid, WEXITSTATUS(status));
+        cache_reap(pid);
+        if(time(NULL) - started[i] < PREFORK_RESPAWN_DELAY)
+            sleep(PREFORK_RESPAWN_DELAY);
+        started[i] = time(NULL);
+        if((fd = spawn(&pids[i], port)) >= 0)
+            return fd;
+    }
+}
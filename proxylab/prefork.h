@@ -0,0 +1,16 @@
+#ifndef __PREFORK_H__
+#define __PREFORK_H__
+
+#include "csapp.h"
+
+/* 此处定义多进程模式相关的常量 */
+#define PREFORK_RESPAWN_DELAY 1 /* 工作进程启动后不足这么多秒就退出时，等待这么久再重启，避免反复崩溃时空转 */
+
+/*
+ * 启动nprocs个工作进程，各自在port上打开带SO_REUSEPORT的监听套接字，由内核分配新连接
+ * 在工作进程中返回它的监听套接字；主进程不返回，回收退出的工作进程并重新启动
+ * 须在init_cache之后、创建处理请求的线程之前调用
+ */
+int prefork_run(int nprocs, char* port);
+
+#endif
@@ -4,27 +4,100 @@
  * 能够解析GET请求，实现客户端和服务器之间的代理；
  * 通过为每个新的传入请求生成一个新的线程来处理并发请求；
  * 通过cache.c与cache.h定义的缓存，采用读者优先的策略，实现多线程下的缓存；
- * 对https请求特殊处理，实现功能；
+ * 对https请求特殊处理，实现功能，隧道中的数据用splice在内核中转发（见tunnel.c）；
+ * 与服务器之间使用HTTP/1.1保持连接，空闲连接放入连接池供之后的请求复用，每个服务器同时使用的连接数由 -c 限制（见upstream.c）；
+ * 客户端使用HTTP/1.1时同样保持连接，按顺序处理同一连接上（包括流水线中）的多个请求；
+ * 同一URL并发的未命中只回源一次，其余请求随响应到达逐步转发（见flight.c），带凭据的请求与不可缓存的响应不合并；
+ * cache按响应的Cache-Control、Expires等报头判断新鲜期，过期的对象用ETag或Last-Modified向服务器重新验证，
+ * 得到304时继续使用cache中的内容；
+ * 服务器地址取自进程内的DNS缓存，由后台线程解析与刷新（见dns.c）；
+ * cache的淘汰策略用 -P 选择，-A 启用TinyLFU接纳，-T 记录访问供cachesim比较各策略（见policy.c）；
+ * 用 -D 指定段文件时启用cache的磁盘层，内存淘汰的对象与大对象写入磁盘，重启后仍然有效（见disk.c）；
+ * 用 -W 指定快照文件时，定时与收到SIGTERM时把内存cache写入快照，重启时映射回来立即服务命中（见snapshot.c）；
+ * 日志由后台线程异步写出，-L 选择级别（见log.c）；
+ * 直接向代理请求 /__proxy_stats 时返回计数器与延迟直方图（见stats.c）；
+ * 用 -m pool 启动时改为固定数量的工作线程，从有界队列中取连接（见sbuf.c）；
+ * 用 -m epoll 启动时改为每个核心一个epoll事件循环的非阻塞模式（见event.c）；
+ * 用 -U 启动时thread与pool模式的接受连接、连接服务器与转发响应改用io_uring，内核不支持时照旧（见uring.c）；
+ * 用 -j 指定进程数时，多个工作进程以SO_REUSEPORT监听同一端口，共享同一个内存cache（见prefork.c、shm.c）；
+ * 读请求头、转发响应、连接服务器与空闲的长连接各有期限，用 -t 设置，由时间轮看守，超时的连接被关闭（见timer.c）；
+ * 单个字节范围的请求由代理从cache中切出206，大对象分块缓存，只向服务器请求缺失的块（见range.c）；
+ * 用 -z 启动时文本对象入cache后另存一份gzip压缩的变体，发给接受gzip的客户端（见gzip.c）；
  */
 
 #include <stdio.h>
 #include "csapp.h"
 #include "cache.h"
-
-static const char* user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
-static const char* https_hdr = "HTTP/1.1 200 Connection Established\r\nConnection: close\r\n\r\n";
-
-void doit(int fd);
-void parse_url(char* url, char* hostname, char* port, char* uri);
-void send_requestline(char* uri, int fd);
-void read_requestheader(rio_t* rp);
-void send_requestheader(rio_t* rp, int fd, char* hostname);
-void server_to_client_withcache(int clientfd, int serverfd, char* url);
+#include "http.h"
+#include "event.h"
+#include "sbuf.h"
+#include "tunnel.h"
+#include "upstream.h"
+#include "flight.h"
+#include "dns.h"
+#include "disk.h"
+#include "stats.h"
+#include "snapshot.h"
+#include "log.h"
+#include "shm.h"
+#include "prefork.h"
+#include "uring.h"
+#include "timer.h"
+#include "range.h"
+#include "gzip.h"
+#include "util.h"
+
+#define NWORKERS 16 /* pool模式默认的工作线程数 */
+#define SBUFSIZE 64 /* pool模式默认的连接队列长度 */
+#define LISTEN_RETRIES 20 /* 端口被占用时重试打开监听套接字的次数 */
+#define LISTEN_RETRY_MS 50
+
+enum { MODE_THREAD, MODE_POOL, MODE_EPOLL };
+enum { RELAY_REUSABLE, RELAY_CLOSE, RELAY_EMPTY, RELAY_DETACHED }; /* server_to_client_withcache与follow_flight的返回值 */
+
+/* 客户端连接的接收缓冲区，请求直接在其中解析，流水线中的后续请求留在其后 */
+typedef struct {
+    int fd;
+    char buf[MAXBUF];
+    size_t len;  /* 已收到的字节数 */
+    size_t used; /* 当前请求占用的字节数，处理完后从缓冲区移除 */
+    timer_watch watch; /* 各阶段的超时 */
+} client_in;
+
+static sbuf_t sbuf; /* pool模式的连接队列 */
+static __thread uint64_t req_start; /* 当前请求的开始时间 */
+static __thread timer_watch* watch; /* 本线程正在处理的连接的看门狗 */
+
+void serve_client(int fd);
+int doit(int fd, client_in* in);
+int read_request(client_in* in, http_req* rq);
+int forward_request(int clientfd, char* url, char* hostname, char* port, http_req* rq, flight* fp,
+    cache_block* stale, char* cond);
+int writev_all(int fd, const struct iovec* src, int cnt);
+int server_to_client_withcache(int clientfd, int serverfd, char* url, flight* fp, cache_block* stale, int storable);
+int revalidated(int clientfd, http_resp* resp, flight* fp, cache_block* stale);
+int follow_flight(int clientfd, flight* fp);
+int serve_range(int fd, range_ctx* rg, char* hostname, char* port, http_req* rq);
+int fetch_range(int clientfd, range_ctx* rg, char* hostname, char* port, http_req* rq);
 void* thread(void* vargp);
+void* worker(void* vargp);
 void server_to_client(int clientfd, int serverfd);
 void* client_to_server(void* vargp);
 void clienterror(int fd, char* cause, char* errnum, char* shortmsg, char* longmsg);
 
+/*
+ * listen_retry 打开监听套接字；刚退出的旧进程用过io_uring时，内核异步回收它的ring，
+ * 监听套接字在进程退出后还会存在片刻，稍等重试而不是立即失败
+ */
+static int listen_retry(char* port)
+{
+    int fd = -1;
+
+    for (int i = 0; i < LISTEN_RETRIES && (fd = open_listenfd(port)) < 0; i++)
+        usleep(LISTEN_RETRY_MS * 1000);
+    return fd >= 0 ? fd : Open_listenfd(port);
+}
+
 void sigchld_handler(int sig) {
     int bkp_errno = errno;
     while (waitpid(-1, NULL, WNOHANG) > 0);
@@ -36,28 +109,195 @@ int main(int argc, char** argv)
     Signal(SIGPIPE, SIG_IGN);/* 忽略所有的SIGPIPE信号 */
     Signal(SIGCHLD, sigchld_handler);/* 将SIGCHLD信号与handler联系起来，回收所有的子进程 */
 
-    int listenfd, * connfdp;
+    int listenfd, connfd, * connfdp;
     pthread_t tid;
     char hostname[MAXLINE], port[MAXLINE];
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
+    int mode = MODE_THREAD, nloops = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int nworkers = NWORKERS, queue_depth = SBUFSIZE, shed = 0;
+    size_t cache_size = 0;
+    int cache_shards = 0;
+    int max_idle = UPSTREAM_MAX_IDLE, idle_timeout = UPSTREAM_IDLE_TIMEOUT, max_active = UPSTREAM_MAX_ACTIVE;
+    int dns_ttl = DNS_TTL;
+    char* disk_path = NULL;
+    char* policy = "lru";
+    char* trace_path = NULL;
+    int admission = 0;
+    size_t disk_size = DISK_SIZE;
+    char* snap_path = NULL;
+    int snap_interval = SNAPSHOT_INTERVAL;
+    int log_level = LV_INFO;
+    int nprocs = 1;
+    int use_uring = 0;
+    uring* ur;
+    int opt;
 
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "m:n:w:q:s:C:S:P:AT:p:c:i:d:D:Z:W:I:L:j:Ut:z")) != -1) {
+        switch (opt) {
+        case 'm': /* 并发模式：thread（默认，每个连接一个线程）、pool 或 epoll */
+            if (!strcmp(optarg, "thread"))
+                mode = MODE_THREAD;
+            else if (!strcmp(optarg, "pool"))
+                mode = MODE_POOL;
+            else if (!strcmp(optarg, "epoll"))
+                mode = MODE_EPOLL;
+            else
+                goto usage;
+            break;
+        case 'n': /* epoll模式下事件循环的个数，默认为CPU核数 */
+            nloops = atoi(optarg);
+            break;
+        case 'w': /* pool模式下工作线程的个数 */
+            nworkers = atoi(optarg);
+            break;
+        case 'q': /* pool模式下连接队列的长度 */
+            queue_depth = atoi(optarg);
+            break;
+        case 's': /* pool模式下队列满时的行为：block（等待）或 shed（返回503） */
+            if (!strcmp(optarg, "shed"))
+                shed = 1;
+            else if (strcmp(optarg, "block"))
+                goto usage;
+            break;
+        case 'C': /* cache的总字节数，可带K/M/G后缀 */
+            cache_size = parse_size(optarg);
+            break;
+        case 'S': /* cache分片数的上限 */
+            cache_shards = atoi(optarg);
+            break;
+        case 'P': /* cache的淘汰策略：lru（默认）、clock 或 s3fifo */
+            policy = optarg;
+            break;
+        case 'A': /* 启用TinyLFU接纳，过滤只被访问一次的对象 */
+            admission = 1;
+            break;
+        case 'T': /* 记录cache的访问，供cachesim比较各策略 */
+            trace_path = optarg;
+            break;
+        case 'p': /* 每个服务器最多保留的空闲连接数，0表示不复用 */
+            max_idle = atoi(optarg);
+            break;
+        case 'c': /* 每个服务器同时使用中的连接数上限，0表示不限 */
+            max_active = atoi(optarg);
+            break;
+        case 'i': /* 空闲连接的存活秒数 */
+            idle_timeout = atoi(optarg);
+            break;
+        case 'd': /* DNS解析结果的存活秒数 */
+            dns_ttl = atoi(optarg);
+            break;
+        case 'D': /* 磁盘层的段文件，不指定时只用内存cache */
+            disk_path = optarg;
+            break;
+        case 'Z': /* 磁盘层的总字节数，可带K/M/G后缀 */
+            disk_size = parse_size(optarg);
+            break;
+        case 'W': /* 快照文件，启动时从中恢复cache */
+            snap_path = optarg;
+            break;
+        case 'I': /* 写快照的间隔秒数，0表示只在SIGTERM时写 */
+            snap_interval = atoi(optarg);
+            break;
+        case 'L': /* 日志级别：error、warn、info（默认）或 debug */
+            if ((log_level = log_level_parse(optarg)) < 0)
+                goto usage;
+            break;
+        case 'j': /* 工作进程数，大于1时启用多进程模式 */
+            nprocs = atoi(optarg);
+            break;
+        case 'U': /* thread与pool模式下用io_uring收发 */
+            use_uring = 1;
+            break;
+        case 't': /* 超时秒数：header=、body=、connect=或idle=，0表示不限，可以重复 */
+            if (timeout_parse(optarg) < 0)
+                goto usage;
+            break;
+        case 'z': /* 为可压缩的文本对象在cache中另存gzip变体 */
+            gzip_init();
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1 || nworkers <= 0 || queue_depth <= 0 || nprocs <= 0
+        || cache_set_policy(policy, admission) < 0) {
+usage:
+        fprintf(stderr, "usage: %s [-m thread|pool|epoll] [-n loops] "
+            "[-w workers] [-q depth] [-s block|shed] [-C cache_size] [-S shards] "
+            "[-P lru|clock|s3fifo] [-A] [-T trace_file] "
+            "[-p idle_per_host] [-c active_per_host] [-i idle_timeout] [-d dns_ttl] [-D disk_file] [-Z disk_size] "
+            "[-W snapshot_file] [-I snapshot_interval] [-L log_level] [-j nprocs] [-U] "
+            "[-t header|body|connect|idle=secs] [-z] <port>\n", argv[0]);
         exit(1);
     }
 
-    init_cache();
-
-    listenfd = Open_listenfd(argv[1]);
+    stats_init();
+    if (nprocs > 1) {
+        /* 磁盘层的索引与段文件只属于一个进程，多进程模式下不启用 */
+        if (disk_path)
+            fprintf(stderr, "disk cache disabled with -j\n");
+        disk_path = NULL;
+        shm_enable();
+    }
+    if (disk_path && disk_init(disk_path, disk_size) < 0)
+        fprintf(stderr, "disk cache disabled\n");
+    if (trace_path && cache_trace(trace_path) < 0)
+        perror(trace_path);
+    init_cache(cache_size, cache_shards);
+    if (snap_path) {
+        /* 在创建任何线程之前启动，SIGTERM只由快照线程接收 */
+        snapshot_load(snap_path);
+        snapshot_start(snap_path, snap_interval);
+    }
+    if (use_uring && mode == MODE_EPOLL)
+        fprintf(stderr, "-U only applies to thread and pool modes\n");
+    else if (use_uring && uring_init() < 0)
+        fprintf(stderr, "io_uring unavailable, using blocking I/O\n");
+    log_init(log_level);
+    /* 以下的连接池、回源合并、DNS缓存与压缩线程属于各个工作进程，在fork之后建立 */
+    listenfd = nprocs > 1 ? prefork_run(nprocs, argv[optind]) : listen_retry(argv[optind]);
+    upstream_init(max_idle, idle_timeout, max_active);
+    flight_init();
+    dns_init(dns_ttl);
+    gzip_start();
+
+    if (mode == MODE_EPOLL)
+        event_run(listenfd, nloops);
+    watch_start(); /* epoll模式下各事件循环自己计时 */
+    if (mode == MODE_POOL) {
+        sbuf_init(&sbuf, queue_depth);
+        for (int i = 0; i < nworkers; i++)
+            Pthread_create(&tid, NULL, worker, NULL);
+    }
+    ur = uring_get();
     while (1) {
         clientlen = sizeof(clientaddr);
+        if (ur == NULL)
+            connfd = Accept(listenfd, (SA*)&clientaddr, &clientlen);
+        else if ((connfd = uring_accept(ur, listenfd)) < 0)
+            continue;
+        if (LV_DEBUG <= log_threshold) { /* 不记录时也不必反查客户端的名字 */
+            if (ur != NULL) /* multishot accept不带回客户端的地址 */
+                getpeername(connfd, (SA*)&clientaddr, &clientlen);
+            Getnameinfo((SA*)&clientaddr, clientlen, hostname, MAXLINE,
+                port, MAXLINE, 0);
+            LOG(LV_DEBUG, "Accepted connection from (%s, %s)", hostname, port);
+        }
+        if (mode == MODE_POOL) {
+            if (!shed)
+                sbuf_insert(&sbuf, connfd);
+            else if (!sbuf_tryinsert(&sbuf, connfd)) {
+                /* 队列已满，直接拒绝，避免排队加剧尾延迟 */
+                clienterror(connfd, "", "503", "Service Unavailable",
+                    "Proxy is overloaded, try again later");
+                Close(connfd);
+            }
+            continue;
+        }
         connfdp = (int*)Malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA*)&clientaddr, &clientlen);
-        Getnameinfo((SA*)&clientaddr, clientlen, hostname, MAXLINE,
-            port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
+        *connfdp = connfd;
         Pthread_create(&tid, NULL, thread, connfdp);
     }
 }
@@ -68,56 +308,119 @@ void* thread(void* vargp)
     int connfd = *((int*)vargp);
     Pthread_detach(pthread_self());
     Free(vargp);
-    doit(connfd);
+    serve_client(connfd);
     Close(connfd);
     return NULL;
 }
 
 
+/*
+ * worker 预线程化模式的工作线程，不断从队列中取出连接并处理
+ */
+void* worker(void* vargp)
+{
+    Pthread_detach(pthread_self());
+    while (1) {
+        int connfd = sbuf_remove(&sbuf);
+        serve_client(connfd);
+        Close(connfd);
+    }
+    return NULL;
+}
+
+
+/*
+ * serve_client 在一条客户端连接上依次处理请求，直到客户端关闭、不再保持连接或空闲超时
+ * 流水线中的后续请求已在接收缓冲区中，逐个处理即保证响应的顺序与请求一致
+ */
+void serve_client(int fd)
+{
+    client_in* in = (client_in*)Malloc(sizeof(client_in));
+
+    in->fd = fd;
+    in->len = 0;
+    watch = &in->watch;
+    watch_begin(watch, fd);
+    while (doit(fd, in)) {
+        in->len -= in->used;
+        memmove(in->buf, in->buf + in->used, in->len);
+    }
+    watch_end(watch);
+    Free(in);
+}
+
+
 /*
  * doit - handle one HTTP request/response transaction
  * 处理http和https请求，在客户端和服务器之间转发信息
+ * 返回非0表示连接可以继续处理下一个请求
  */
-void doit(int fd)
+int doit(int fd, client_in* in)
 {
-    char buf[MAXLINE], method[MAXLINE], url[MAXLINE], version[MAXLINE];
-    char hostname[MAXLINE], port[MAXLINE], uri[MAXLINE];
-    rio_t rio;
-    int serverfd;
+    char url[MAXLINE], hostname[MAXLINE], port[MAXLINE];
+    http_req rq;
+    int serverfd, rc;
     int is_https = 0;
 
-    /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))
-        return;
-    printf("%s", buf);
-
-    sscanf(buf, "%s %s %s", method, url, version);
+    /* Read request line and headers；读取超时或出错说明客户端已空闲或离开 */
+    if ((rc = read_request(in, &rq)) < 0)
+        return 0;
+    watch_set(watch, TO_BODY); /* 之后发送响应的每次进展都推后期限 */
+    req_start = stats_now();
+    stats_add(STAT_REQUESTS, 1);
+    if (rc == REQ_BAD) {
+        clienterror(fd, "", "400", "Bad Request", "Proxy could not parse the request");
+        return 0;
+    }
+    LOG(LV_INFO, "%.*s %.*s %.*s", (int)rq.method.len, rq.method.p, (int)rq.url.len, rq.url.p,
+        (int)rq.version.len, rq.version.p);
+    if (rq.url.len >= sizeof(url)) {
+        clienterror(fd, "", "414", "URI Too Long", "Proxy could not handle the request");
+        return 0;
+    }
+    span_copy(url, sizeof(url), rq.url); /* URL是cache的键，需要以'\0'结尾 */
+    span_copy(hostname, sizeof(hostname), rq.host);
+    span_copy(port, sizeof(port), rq.port);
 
-    if (!strcasecmp(method, "CONNECT"))
+    if (span_is(rq.method, "CONNECT"))
         is_https = 1;
-    else if (strcasecmp(method, "GET")) {
+    else if (!span_is(rq.method, "GET")) {
+        char method[MAXLINE];
+        span_copy(method, sizeof(method), rq.method);
         clienterror(fd, method, "501", "Not Implemented",
             "Tiny does not implement this method");
-        return;
+        return 0;
     }
 
-    if (is_https || !search_cache(url, fd)) {
-        /* 解析输入参数 URL-> hostname + (port) + uri */
-        parse_url(url, hostname, port, uri);
+    if (is_https) {
+        pthread_t tid;
+        fd_pair* fds;
+        size_t up_bytes, down_bytes;
 
         /* 与服务器建立连接 */
-        serverfd = Open_clientfd(hostname, port);
+        if ((serverfd = dns_connect(hostname, port)) < 0) {
+            clienterror(fd, hostname, "502", "Bad Gateway", "Proxy could not connect to the server");
+            return 0;
+        }
 
-        if (is_https) {
-            pthread_t tid;
-            fd_pair* fds;
-            /* 向客户端发回连接成功信息 */
-            Rio_writen(fd, (void*)https_hdr, strlen(https_hdr));
+        /* 向客户端发回连接成功信息；客户端已断开时只关闭这条连接 */
+        if (rio_writen(fd, (void*)https_hdr, strlen(https_hdr)) != (ssize_t)strlen(https_hdr)) {
+            Close(serverfd);
+            return 0;
+        }
 
-            /* 读取请求报头并忽略 */
-            read_requestheader(&rio);
+        /* 报头之后客户端已发来的数据先转发给服务器；隧道没有空闲超时 */
+        watch_clear(watch);
+        if (in->len > rq.len && rio_writen(serverfd, in->buf + rq.len, in->len - rq.len) != (ssize_t)(in->len - rq.len)) {
+            Close(serverfd);
+            return 0;
+        }
 
+        /* 在本线程中用splice双向转发；无法创建管道时退回两个线程的用户空间拷贝 */
+        if (tunnel_run(fd, serverfd, &up_bytes, &down_bytes) == 0)
+            LOG(LV_INFO, "Tunnel to %s:%s closed, %zu bytes up, %zu bytes down",
+                hostname, port, up_bytes, down_bytes);
+        else {
             /* 创建新线程转发从客户端发送到服务器的信息 */
             fds = (fd_pair*)Malloc(sizeof(fd_pair));
             fds->clientfd = fd;
@@ -127,150 +430,472 @@ void doit(int fd)
             server_to_client(fd, serverfd);
             Pthread_join(tid, NULL);
         }
-        else {
-            /* 编制并发送请求行 */
-            send_requestline(uri, serverfd);
+        Close(serverfd);
+        return 0;
+    }
+    else {
+        size_t len;
+        int keepalive = rq.keepalive, leader;
+        cache_block *cb, *stale = NULL;
+        disk_hit dh;
+        flight* fp;
+        range_ctx* rg;
+        char cond[RESP_COND_MAX]; /* 重新验证用的条件报头 */
+
+        in->used = rq.len;
+
+        /* 统计页由代理自己回答 */
+        if (stats_request(url)) {
+            char* page;
+            len = stats_response(&page);
+            if (rio_writen(fd, page, len) != (ssize_t)len)
+                keepalive = 0;
+            Free(page);
+            return keepalive;
+        }
 
-            /* 编制并发送请求报头 */
-            send_requestheader(&rio, serverfd, hostname);
+        /* 单个字节范围由代理自己拼出206，不与同一URL的普通回源合并 */
+        if (req_header(&rq, "Range") != NULL) {
+            rg = (range_ctx*)Malloc(sizeof(range_ctx));
+            if (range_begin(rg, url, &rq) == 0) {
+                rc = serve_range(fd, rg, hostname, port, &rq);
+                range_end(rg);
+                Free(rg);
+                if (rc < 0) {
+                    clienterror(fd, hostname, "502", "Bad Gateway", "Proxy could not connect to the server");
+                    return 0;
+                }
+                stats_record(HIST_LATENCY, stats_now() - req_start);
+                return keepalive && rc;
+            }
+            Free(rg);
+        }
 
-            /* 读取服务器发来的内容，再发给客户 */
-            server_to_client_withcache(fd, serverfd, url);
+        /* 客户端接受gzip时优先用新鲜的压缩变体；过期的对象有验证器时带上条件报头回源，否则与未命中相同 */
+        if ((cb = gzip_lookup(&rq, url)) == NULL && (cb = lookup_cache(url)) != NULL && !cache_fresh(cb)) {
+            if (build_conditional(cond, sizeof(cond), cb->block, cb->size) > 0)
+                stale = cb;
+            else
+                release_cache(cb);
+            cb = NULL;
         }
-        Close(serverfd);
+        /* 命中时直接从cache内存发送；cache中的响应没有分帧时发送后必须关闭连接 */
+        if (cb != NULL) {
+            stats_add(STAT_HITS, 1);
+            stats_add(STAT_SYSCALLS, 1);
+            if (rio_writen(fd, cb->block, cb->size) != (ssize_t)cb->size)
+                keepalive = 0;
+            else {
+                stats_add(STAT_BYTES_OUT, cb->size);
+                if (keepalive)
+                    keepalive = resp_persistent(cb->block, cb->size);
+            }
+            release_cache(cb);
+            stats_record(HIST_LATENCY, stats_now() - req_start);
+            return keepalive;
+        }
+        /* 内存未命中时查找磁盘层，内容用sendfile从页缓存发送 */
+        if (stale == NULL && lookup_disk(url, &dh)) {
+            stats_add(STAT_DISK_HITS, 1);
+            stats_add(STAT_SYSCALLS, 1);
+            if (disk_send(fd, &dh) < 0)
+                keepalive = 0;
+            else {
+                stats_add(STAT_BYTES_OUT, dh.size);
+                if (keepalive)
+                    keepalive = resp_persistent(disk_data(&dh), dh.size);
+            }
+            disk_release(&dh);
+            stats_record(HIST_LATENCY, stats_now() - req_start);
+            return keepalive;
+        }
+
+        /* 同一URL已有进行中的回源时加入它；否则由本请求回源，读取服务器发来的内容，再发给客户
+         * 带凭据的请求的响应可能因人而异，不与其他请求合并；回源者脱离时跟随者改为自行回源 */
+        stats_add(stale ? STAT_STALE : STAT_MISSES, 1);
+        leader = 1;
+        fp = req_credentials(&rq) ? NULL : flight_join(url, &leader);
+        if (!leader) {
+            stats_add(STAT_COALESCED, 1);
+            if ((rc = follow_flight(fd, fp)) == RELAY_DETACHED) {
+                flight_release(fp);
+                fp = NULL;
+                leader = 1;
+            }
+        }
+        if (leader)
+            rc = forward_request(fd, url, hostname, port, &rq, fp, stale, stale ? cond : NULL);
+        flight_release(fp);
+        if (stale)
+            release_cache(stale);
+        if (rc < 0) {
+            clienterror(fd, hostname, "502", "Bad Gateway", "Proxy could not connect to the server");
+            return 0;
+        }
+        stats_record(HIST_LATENCY, stats_now() - req_start);
+        return keepalive && rc == RELAY_REUSABLE;
     }
 }
 
 
 /*
- * parse_url 解析URL，得到 hostname, (port), (uri) 参数
+ * forward_request 从连接池取得到服务器的连接，发送请求并把响应转发给客户端
+ * 请求的各段直接指向接收缓冲区，用一次writev发出（见build_request_iov）
+ * 复用的连接可能已被服务器关闭，此时换一条新连接重发；连接无法建立或新连接上没有任何响应时返回-1
+ * 否则返回server_to_client_withcache的结果，RELAY_REUSABLE说明响应完整且分帧，客户端连接也可以保持
+ * stale非空时是在重新验证这个过期的block，cond为据此编制的条件报头
+ * 启用io_uring时请求不单独发送，与第一次接收一起提交
  */
-void parse_url(char* url, char* hostname, char* port, char* uri)
+int forward_request(int clientfd, char* url, char* hostname, char* port, http_req* rq, flight* fp,
+    cache_block* stale, char* cond)
 {
-    char turl[MAXLINE];
-    strcpy(turl, url);
-
-    char* hostname_begin = strstr(turl, "//") ? (char*)strstr(turl, "//") + 2 : turl;
+    struct iovec iov[REQ_IOV_MAX];
+    int serverfd, reused, rc, niov = build_request_iov(iov, rq, cond), storable = req_storable(rq, cond);
+    uint64_t t;
+    uring* ur = uring_get();
 
-    char* uri_begin = strstr(hostname_begin, "/"); /* 解析得到uri */
-    if (uri_begin == NULL) /* 若省略uri，自动补成"/" */
-        sprintf(uri, "/");
-    else {
-        strcpy(uri, uri_begin);
-        *uri_begin = '\0';
+    while (1) {
+        t = stats_now();
+        if ((serverfd = upstream_get(hostname, port, &reused)) < 0) {
+            flight_finish(fp, 0, 0);
+            return -1;
+        }
+        if (!reused) /* 只统计新建立的连接 */
+            stats_record(HIST_CONNECT, stats_now() - t);
+        watch_server(watch, serverfd); /* 响应超时时服务器连接也一并shutdown */
+        if (ur != NULL) {
+            uring_relay_begin(ur, clientfd, serverfd);
+            uring_send(ur, serverfd, iov, niov);
+            rc = server_to_client_withcache(clientfd, serverfd, url, fp, stale, storable);
+            uring_relay_end(ur);
+        }
+        else if (writev_all(serverfd, iov, niov) < 0)
+            rc = RELAY_EMPTY;
+        else
+            rc = server_to_client_withcache(clientfd, serverfd, url, fp, stale, storable);
+        watch_server(watch, -1);
+        if (rc == RELAY_EMPTY && reused && !watch_fired(watch)) { /* 服务器已关闭了这条空闲连接，重试 */
+            upstream_done(hostname, port, serverfd, 0);
+            continue;
+        }
+        upstream_done(hostname, port, serverfd, rc == RELAY_REUSABLE);
+        if (rc == RELAY_EMPTY) { /* 新建的连接也没有任何响应，与无法连接一样回复502 */
+            flight_finish(fp, 0, 0);
+            return -1;
+        }
+        return rc;
     }
+}
 
-    char* port_begin = strstr(hostname_begin, ":"); /* 解析得到port */
-    if (port_begin == NULL) /* 端口号缺省则默认为80 */
-        sprintf(port, "80");
-    else {
-        *port_begin = '\0';
-        port_begin += 1;
-        strcpy(port, port_begin);
-    }
 
-    strcpy(hostname, hostname_begin); /* 解析得到port */
+/*
+ * writev_all 写出iov中的全部内容，通常只需一次writev；遇到不足值时跳过已写出的部分继续，出错返回-1
+ */
+int writev_all(int fd, const struct iovec* src, int cnt)
+{
+    struct iovec iov[REQ_IOV_MAX], *v = iov;
+    ssize_t n;
+
+    memcpy(iov, src, cnt * sizeof(struct iovec));
+    while (cnt > 0) {
+        stats_add(STAT_SYSCALLS, 1);
+        if ((n = writev(fd, v, cnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (; cnt > 0 && (size_t)n >= v->iov_len; v++, cnt--)
+            n -= v->iov_len;
+        if (cnt > 0) {
+            v->iov_base = (char*)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return 0;
 }
 
 
 /*
- * send_requestline 编制并发送请求行
+ * read_request 读取客户端请求直到报头完整，每次只解析新到达的字节
+ * 收到第一个字节之前是空闲期，之后整个报头须在TO_HEADER的期限内读完，逐字节慢慢发送也不会推后期限
+ * 返回REQ_DONE或REQ_BAD；客户端关闭、出错或超时时返回-1
  */
-void send_requestline(char* uri, int fd)
+int read_request(client_in* in, http_req* rq)
 {
-    char requestline[MAXLINE];
-    sprintf(requestline, "GET %s HTTP/1.0\r\n", uri);
-    Rio_writen(fd, requestline, strlen(requestline));
+    ssize_t n;
+    int rc;
+
+    req_init(rq);
+    if ((rc = req_parse(rq, in->buf, in->len)) != REQ_INCOMPLETE)
+        return rc; /* 流水线中的下一个请求已经完整 */
+    watch_set(&in->watch, in->len ? TO_HEADER : TO_IDLE);
+    while ((rc = req_parse(rq, in->buf, in->len)) == REQ_INCOMPLETE) {
+        if (in->len == sizeof(in->buf))
+            return REQ_BAD; /* 报头过长 */
+        stats_add(STAT_SYSCALLS, 1);
+        if ((n = read(in->fd, in->buf + in->len, sizeof(in->buf) - in->len)) < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        if (in->len == 0)
+            watch_set(&in->watch, TO_HEADER);
+        in->len += n;
+    }
+    return rc;
 }
 
 
 /*
- * read_requestheaders 读取客户端发来的所有请求报头并忽略
+ * server_to_client_withcache 将服务器响应发送给客户端并缓存
+ * 响应边转发边直接写入cache的block，完整后才发布；按http_resp分帧，响应完整后即停止读取，连接可以放回连接池
+ * 返回RELAY_REUSABLE（连接可复用）、RELAY_CLOSE（连接需关闭）或RELAY_EMPTY（没有收到任何响应）
+ * 客户端中途离开时停止转发，服务器连接上还有未读完的响应，返回RELAY_CLOSE
+ * 收到的字节同时追加到fp供合并的请求读取，收到响应后由本函数结束这次回源
+ * 重新验证stale时先攒下响应报头：304时改为发送stale的内容（见revalidated），否则照常转发
+ * 启用io_uring时每块的发送只是排队，与下一块的接收一起提交，发送失败在下一次接收时得知
+ * storable为0时（见req_storable）响应只转发，不进入cache
  */
-void read_requestheader(rio_t* rp)
+int server_to_client_withcache(int clientfd, int serverfd, char* url, flight* fp, cache_block* stale, int storable)
 {
+    ssize_t size;
+    size_t used, held = 0;
+    int complete;
     char buf[MAXLINE];
+    http_resp resp;
+    cache_fill fill; /* 正在填充的对象 */
+    int filling = 0, can_cache = storable;
+    uring* ur = uring_get();
+    struct iovec iov;
+
+    resp_init(&resp);
+    while (resp.state != RESP_DONE) {
+        watch_set(watch, TO_BODY);
+        if (ur == NULL) {
+            stats_add(STAT_SYSCALLS, 1);
+            if ((size = read(serverfd, buf + held, sizeof(buf) - held)) < 0 && errno == EINTR)
+                continue;
+        }
+        else if ((size = uring_recv(ur, serverfd, buf + held, sizeof(buf) - held)) == URING_ESEND
+            && resp.total > 0) /* 上一块没能发给客户端；还没有响应时失败的是请求，下面按没有响应处理 */
+            goto client_gone;
+        if (size <= 0)
+            break;
+        if (resp.total == 0)
+            stats_record(HIST_TTFB, stats_now() - req_start);
+        used = resp_feed(&resp, buf + held, size);
+        stats_add(STAT_BYTES_IN, used);
+        if (stale) {
+            /* 报头完整之前不知道是不是304；报头超出缓冲区时放弃重新验证 */
+            held += used;
+            if (resp.state == RESP_HEAD && held < sizeof(buf))
+                continue;
+            if (resp.status == 304)
+                return revalidated(clientfd, &resp, fp, stale);
+            stale = NULL;
+            used = held;
+            held = 0;
+        }
+        /* 不可缓存的响应可能是私有的，不交给合并的请求；已知过大的响应也不为它们缓冲 */
+        if (resp.state != RESP_HEAD && (!resp_cacheable(&resp) || resp.expected > FLIGHT_MAX))
+            flight_detach(fp);
+        flight_append(fp, buf, used);
+        if (ur != NULL) {
+            /* 下一次接收连在这次发送之后，发送完成前不会写入buf */
+            iov.iov_base = buf;
+            iov.iov_len = used;
+            uring_send(ur, clientfd, &iov, 1);
+        }
+        else {
+            stats_add(STAT_SYSCALLS, 1);
+            if (rio_writen(clientfd, buf, used) != (ssize_t)used)
+                goto client_gone;
+        }
+        stats_add(STAT_BYTES_OUT, used);
+        if (can_cache && resp.state != RESP_HEAD && !resp_cacheable(&resp)) { /* no-store等不缓存 */
+            if (filling)
+                fill_cache_abort(&fill);
+            filling = can_cache = 0;
+        }
+        if (can_cache) { /* 直接写入cache，放不下时放弃 */
+            if (!filling)
+                filling = (fill_cache_begin(&fill, url, resp.expected) == 0);
+            if (filling)
+                filling = (fill_cache_append(&fill, buf, used, resp.expected) == 0);
+            can_cache = filling;
+        }
+    }
+    if (ur != NULL && uring_flush(ur) < 0) /* 最后一块在buf中，返回之前须发送完毕 */
+        goto client_gone;
+    if (resp.total == 0)
+        return RELAY_EMPTY;
+    complete = (resp.state == RESP_DONE || resp.state == RESP_UNTIL_EOF);
+    if (filling && complete)
+        fill_cache_commit(&fill);
+    else if (filling)
+        fill_cache_abort(&fill);
+    flight_finish(fp, complete, resp_reusable(&resp)); /* 先发布到cache，之后的请求不会再未命中 */
+    if (filling && complete)
+        gzip_store(url); /* 在结束回源之后交给后台线程压缩，不耽误合并的请求 */
+    return resp_reusable(&resp) ? RELAY_REUSABLE : RELAY_CLOSE;
+
+client_gone: /* 客户端中途离开 */
+    if (filling)
+        fill_cache_abort(&fill);
+    flight_finish(fp, 0, 0);
+    return RELAY_CLOSE;
+}
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    while (strcmp(buf, "\r\n"))
-        Rio_readlineb(rp, buf, MAXLINE);
-    return;
+
+/*
+ * revalidated 重新验证得到304：延长stale的新鲜期，把它的内容发给客户端与合并的请求
+ * 304没有响应体，服务器连接可以照常复用
+ */
+int revalidated(int clientfd, http_resp* resp, flight* fp, cache_block* stale)
+{
+    int persistent = resp_persistent(stale->block, stale->size);
+
+    cache_refresh(stale, resp_refresh(resp, stale->block, stale->size, time(NULL)));
+    gzip_refresh(stale);
+    stats_add(STAT_REVALIDATED, 1);
+    flight_append(fp, stale->block, stale->size);
+    flight_finish(fp, 1, persistent);
+    stats_add(STAT_SYSCALLS, 1);
+    if (rio_writen(clientfd, stale->block, stale->size) != (ssize_t)stale->size)
+        return RELAY_CLOSE;
+    stats_add(STAT_BYTES_OUT, stale->size);
+    return resp_reusable(resp) && persistent ? RELAY_REUSABLE : RELAY_CLOSE;
 }
 
 
 /*
- * send_requestheaders 读取客户端发来的所有请求报头，按照规范转发到服务器
+ * follow_flight 加入同一URL上进行中的回源，随数据到达转发给客户端
+ * 返回值与server_to_client_withcache相同；回源失败且尚未发出任何字节时返回-1，
+ * 回源者脱离且尚未发出任何字节时返回RELAY_DETACHED，由调用者自行回源
  */
-void send_requestheader(rio_t* rp, int fd, char* hostname)
+int follow_flight(int clientfd, flight* fp)
 {
     char buf[MAXLINE];
-    int have_Host = 0;
-
-    while (Rio_readlineb(rp, buf, MAXLINE)) {
-        if (strcmp(buf, "\r\n") == 0) break;
-        else if (strstr(buf, "Host")) /* 如果客户发来的报头里有Host，直接转发，无需再自动发送 */
-            have_Host = 1;
-        else if (strstr(buf, "User-Agent") || strstr(buf, "Connection") || strstr(buf, "Proxy-Connection"))
-            continue;
-        printf("%s", buf);
-        Rio_writen(fd, buf, strlen(buf));
+    size_t off = 0, n;
+    int state;
+
+    while ((n = flight_read(fp, off, buf, sizeof(buf), 1, &state)) > 0) {
+        watch_set(watch, TO_BODY);
+        stats_add(STAT_SYSCALLS, 1);
+        if (rio_writen(clientfd, buf, n) != (ssize_t)n)
+            return RELAY_CLOSE;
+        stats_add(STAT_BYTES_OUT, n);
+        off += n;
     }
+    if (state == FLIGHT_ABORTED)
+        return off ? RELAY_CLOSE : -1;
+    if (state == FLIGHT_DETACHED)
+        return off ? RELAY_CLOSE : RELAY_DETACHED;
+    return fp->persistent ? RELAY_REUSABLE : RELAY_CLOSE;
+}
+
 
-    if (!have_Host) {
-        sprintf(buf, "Host: %s\r\n", hostname);
-        Rio_writen(fd, buf, strlen(buf));
+/*
+ * serve_range 依次发送range_next给出的各段：生成的报头、cache中的内容（磁盘层的用sendfile），
+ * 缺失的块由fetch_range回源
+ * 返回1表示客户端连接可以保持，0表示需要关闭；还没有向客户端发出任何内容就失败时返回-1
+ */
+int serve_range(int fd, range_ctx* rg, char* hostname, char* port, http_req* rq)
+{
+    range_src s;
+    int rc;
+
+    while ((rc = range_next(rg, &s)) != RANGE_DONE) {
+        watch_set(watch, TO_BODY);
+        if (rc == RANGE_FAIL)
+            return rg->head_sent ? 0 : -1;
+        if (rc == RANGE_FETCH) {
+            if ((rc = fetch_range(fd, rg, hostname, port, rq)) <= 0)
+                return rc;
+            continue;
+        }
+        stats_add(STAT_SYSCALLS, 1);
+        if (s.on_disk)
+            rc = disk_send(fd, &s.disk);
+        else
+            rc = rio_writen(fd, s.data, s.len) == (ssize_t)s.len ? 0 : -1;
+        range_put(&s);
+        if (rc < 0)
+            return 0;
+        stats_add(STAT_BYTES_OUT, s.len);
     }
-    sprintf(buf, "%s", user_agent_hdr);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Connection: close\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Proxy-Connection: close\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    return;
+    stats_add(rg->fetched ? STAT_MISSES : STAT_HITS, 1);
+    return rg->persistent;
 }
 
 
 /*
- * server_to_client_withcache 将服务器响应发送给客户端并缓存
- * 可能有二进制文件，故使用readnb()与memcpy()
+ * fetch_range 向服务器请求range_next安排的一段，响应由range_feed切块填入cache，需要的部分转发给客户端
+ * 与forward_request一样，复用的连接已被服务器关闭时换一条新连接重发
+ * 成功返回1；客户端离开或响应无法继续时返回0；还没有向客户端发出任何内容就失败时返回-1
  */
-void server_to_client_withcache(int clientfd, int serverfd, char* url)
+int fetch_range(int clientfd, range_ctx* rg, char* hostname, char* port, http_req* rq)
 {
-    size_t size, total_size = 0;
-    int can_cache = 1;
-    char buf[MAXLINE], block[MAX_OBJECT_SIZE];
-    rio_t rio;
-
-    memset(block, 0, sizeof(block));
-    Rio_readinitb(&rio, serverfd);
-    while ((size = Rio_readnb(&rio, buf, MAXLINE)) != 0) {
-        Rio_writen(clientfd, buf, size);
-        if (can_cache) {
-            total_size += size;
-            if (total_size > MAX_OBJECT_SIZE)
-                can_cache = 0;
-            else memcpy(block + total_size - size, buf, size);
+    struct iovec iov[REQ_IOV_MAX];
+    int serverfd, reused, rc, niov = build_request_iov(iov, rq, rg->cond);
+    char buf[MAXLINE], *out;
+    size_t used, outlen;
+    ssize_t n;
+    http_resp resp;
+
+    while (1) {
+        if ((serverfd = upstream_get(hostname, port, &reused)) < 0)
+            return rg->head_sent ? 0 : -1;
+        watch_server(watch, serverfd);
+        resp_init(&resp);
+        rc = writev_all(serverfd, iov, niov);
+        while (rc == 0) {
+            watch_set(watch, TO_BODY);
+            stats_add(STAT_SYSCALLS, 1);
+            if ((n = read(serverfd, buf, sizeof(buf))) < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            if (resp.total == 0)
+                stats_record(HIST_TTFB, stats_now() - req_start);
+            used = resp_feed(&resp, buf, n);
+            stats_add(STAT_BYTES_IN, used);
+            rc = range_feed(rg, &resp, buf, used, &out, &outlen);
+            if (outlen > 0) {
+                stats_add(STAT_SYSCALLS, 1);
+                if (rio_writen(clientfd, out, outlen) != (ssize_t)outlen) {
+                    rc = -2; /* 客户端中途离开 */
+                    break;
+                }
+                stats_add(STAT_BYTES_OUT, outlen);
+            }
         }
+        watch_server(watch, -1);
+        if (resp.total == 0 && reused && !watch_fired(watch)) { /* 服务器已关闭了这条空闲连接，重试 */
+            upstream_done(hostname, port, serverfd, 0);
+            continue;
+        }
+        upstream_done(hostname, port, serverfd, resp_reusable(&resp));
+        if (range_fetch_end(rg, &resp) < 0 || rc < 0)
+            return rg->head_sent || rc == -2 ? 0 : -1;
+        return 1;
     }
-    if (can_cache)
-        insert_cache(url, block, total_size);
 }
 
 
 /*
  * server_to_client 将服务器响应发送给客户端且不缓存
- * 为避免遇到不足值反复读取导致timeout，使用Unix IO函数
+ * 为避免遇到不足值反复读取导致timeout，使用Unix IO函数；
+ * 任一端出错时只结束本方向，并向客户端传递半关闭
  */
 void server_to_client(int clientfd, int serverfd)
 {
-    size_t size;
+    ssize_t size;
     char buf[MAXLINE];
 
-    while ((size = Read(serverfd, buf, MAXLINE)) > 0)
-        Write(clientfd, buf, size);
-
+    while ((size = read(serverfd, buf, MAXLINE)) > 0)
+        if (rio_writen(clientfd, buf, size) != size)
+            break;
+    shutdown(clientfd, SHUT_WR);
 }
 
 
@@ -279,16 +904,16 @@ void server_to_client(int clientfd, int serverfd)
  */
 void* client_to_server(void* vargp)
 {
-    Pthread_detach(pthread_self());
-
     fd_pair fds = *((fd_pair*)vargp);
     int clientfd = fds.clientfd;
     int serverfd = fds.serverfd;
-    size_t size;
+    ssize_t size;
     char buf[MAXLINE];
 
-    while ((size = Read(clientfd, buf, MAXLINE)) > 0)
-        Write(serverfd, buf, size);
+    while ((size = read(clientfd, buf, MAXLINE)) > 0)
+        if (rio_writen(serverfd, buf, size) != size)
+            break;
+    shutdown(serverfd, SHUT_WR);
 
     Free(vargp);
     return NULL;
@@ -301,25 +926,11 @@ void* client_to_server(void* vargp)
 void clienterror(int fd, char* cause, char* errnum,
     char* shortmsg, char* longmsg)
 {
-    char buf[MAXLINE], * body = (char*)Malloc(MAXBUF);
-    size_t extra_len = strlen(body);
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wformat-overflow"
-    /* Build the HTTP response body */
-    extra_len += sprintf(body + extra_len, "<html><title>Tiny Error</title>");
-    extra_len += sprintf(body + extra_len, "<body bgcolor=""ffffff"">\r\n");
-    extra_len += sprintf(body + extra_len, "%s: %s\r\n", errnum, shortmsg);
-    extra_len += sprintf(body + extra_len, "<p>%s: %s\r\n", longmsg, cause);
-    extra_len += sprintf(body + extra_len, "<hr><em>The Tiny Web server</em>\r\n");
-#pragma GCC diagnostic pop
+    char buf[MAXBUF];
+    size_t len = build_clienterror(buf, MAXBUF, cause, errnum, shortmsg, longmsg);
+
+    stats_add(STAT_ERRORS, 1);
 
     /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    rio_writen(fd, buf, strlen(buf));
-    rio_writen(fd, body, strlen(body));
-    Free(body);
+    rio_writen(fd, buf, len);
 }
@@ -0,0 +1,370 @@
+/*
+ * Range请求与部分对象的缓存
+ * 客户端请求单个字节范围时，代理自己回答206：整个对象已在cache中时直接从中切出；
+ * 否则大对象按RANGE_CHUNK_SIZE分块，块以(URL, 块号)为键，各自作为一个完整的206响应缓存，
+ * 新鲜期、重新验证与淘汰都与普通对象相同；缺失的块合并成连续的一段向服务器请求，
+ * 已缓存的块不再回源，收到的内容边转发边切成块填入cache
+ * 发往服务器的请求总是由代理决定范围，客户端的Range不直接转发（见build_request_iov）
+ * 多个范围与带If-Range的请求按普通请求处理，回答整个对象
+ */
+
+#include "range.h"
+
+/*
+ * chunk_key 块的键：URL之后加上块号
+ * 请求行中的URL不含空格，以空格分隔的键不会与客户端请求的任何URL相同
+ */
+static void chunk_key(char* key, char* url, size_t i)
+{
+    snprintf(key, MAXLINE, "%s chunk=%zu", url, i);
+}
+
+/*
+ * validator 响应的版本标识，优先取ETag
+ */
+static const char* validator(http_resp* rp)
+{
+    return rp->etag[0] ? rp->etag : rp->last_modified;
+}
+
+void range_put(range_src* s)
+{
+    if(s->cb)
+        release_cache(s->cb);
+    else if(s->on_disk)
+        disk_release(&s->disk);
+    s->cb = NULL;
+    s->on_disk = 0;
+}
+
+/*
+ * src_lookup 在内存与磁盘层中查找新鲜的对象，命中时*s持有它的引用
+ */
+static int src_lookup(char* key, range_src* s, http_resp* hr)
+{
+    s->on_disk = 0;
+    if((s->cb = lookup_cache(key)) != NULL){
+        if(cache_fresh(s->cb)){
+            s->data = s->cb->block;
+            s->len = s->cb->size;
+        }
+        else
+            range_put(s);
+    }
+    if(s->cb == NULL){
+        if(!lookup_disk(key, &s->disk))
+            return 0;
+        s->on_disk = 1;
+        s->data = disk_data(&s->disk);
+        s->len = s->disk.size;
+    }
+    resp_head(hr, s->data, s->len);
+    s->body = hr->head_len;
+    return 1;
+}
+
+/*
+ * chunk_get 取得第i块，它须与已发出的部分属于同一版本
+ */
+static int chunk_get(range_ctx* rg, size_t i, range_src* s)
+{
+    char key[MAXLINE];
+    http_resp hr;
+
+    chunk_key(key, rg->url, i);
+    if(!src_lookup(key, s, &hr))
+        return 0;
+    if(hr.status == 206 && hr.range_first == (long)(i * RANGE_CHUNK_SIZE) && hr.range_total > 0
+        && hr.content_length > 0 && s->len == hr.head_len + hr.content_length
+        && (rg->total == 0 || (size_t)hr.range_total == rg->total)
+        && (!rg->head_sent || strcmp(validator(&hr), rg->validator) == 0)){
+        s->start = hr.range_first;
+        s->end = s->start + hr.content_length;
+        s->total = hr.range_total;
+        return 1;
+    }
+    range_put(s);
+    return 0;
+}
+
+int range_begin(range_ctx* rg, char* url, http_req* rq)
+{
+    http_resp hr;
+    range_src *s = &rg->cur;
+
+    if(strlen(url) + RANGE_KEY_EXTRA >= MAXLINE || !req_range(rq, &rg->first, &rg->last, &rg->suffix))
+        return -1;
+    rg->url = url;
+    rg->total = rg->next = 0;
+    rg->head_sent = rg->done = rg->persistent = rg->fetched = 0;
+    rg->validator[0] = '\0';
+    rg->have_cur = rg->filling = 0;
+
+    /* 整个对象在cache中且长度已知时从中切出 */
+    if(src_lookup(url, s, &hr)){
+        if(hr.status == 200 && !hr.chunked && hr.content_length >= 0
+            && s->len == hr.head_len + hr.content_length){
+            s->start = 0;
+            s->end = s->total = hr.content_length;
+            rg->have_cur = 1;
+        }
+        else
+            range_put(s);
+    }
+    return 0;
+}
+
+/*
+ * emit_head 得知资源的总长度后确定实际的范围，以tmpl（tlen字节的报头）为模板生成206报头；
+ * 范围无法满足时生成416，回答到此结束
+ */
+static size_t emit_head(range_ctx* rg, const char* tmpl, size_t tlen)
+{
+    http_resp hr;
+    size_t total = rg->total;
+
+    if(rg->suffix){
+        rg->first = rg->first < total ? total - rg->first : 0;
+        rg->last = total - 1;
+        rg->suffix = 0;
+    }
+    else if(rg->last >= total)
+        rg->last = total - 1;
+    rg->head_sent = rg->persistent = 1;
+    if(total == 0 || rg->first >= total){
+        rg->done = 1;
+        return snprintf(rg->out, sizeof(rg->out), "HTTP/1.1 416 Range Not Satisfiable\r\n"
+            "Content-Range: bytes */%zu\r\nContent-Length: 0\r\n\r\n", total);
+    }
+    resp_head(&hr, tmpl, tlen);
+    strcpy(rg->validator, validator(&hr));
+    rg->next = rg->first;
+    return build_partial(rg->out, RANGE_HEAD_MAX, tmpl, tlen, rg->first, rg->last, total);
+}
+
+/*
+ * plan_fetch 从缺失的第i块起，连同其后连续缺失的块（至多RANGE_RUN_MAX块，不超出请求的范围）一起请求
+ * 后缀范围在得知总长度之前无法换算成块，直接请求客户端要的后缀
+ */
+static int plan_fetch(range_ctx* rg, size_t i)
+{
+    range_src s;
+    size_t j, end;
+
+    rg->started = rg->passthru = rg->filling = 0;
+    rg->headlen = 0;
+    rg->fetched = 1;
+    rg->mark = rg->head_sent ? rg->next : RANGE_OPEN;
+    if(rg->suffix){
+        snprintf(rg->cond, sizeof(rg->cond), "Range: bytes=-%zu\r\n", rg->first);
+        rg->stop = RANGE_OPEN;
+        return RANGE_FETCH;
+    }
+    for(j = i + 1; j - i < RANGE_RUN_MAX; j++){
+        if((rg->last != RANGE_OPEN && j > rg->last / RANGE_CHUNK_SIZE)
+            || (rg->total && j * RANGE_CHUNK_SIZE >= rg->total))
+            break;
+        if(chunk_get(rg, j, &s)){
+            range_put(&s);
+            break;
+        }
+    }
+    end = j * RANGE_CHUNK_SIZE - 1;
+    if(rg->total && end >= rg->total)
+        end = rg->total - 1;
+    snprintf(rg->cond, sizeof(rg->cond), "Range: bytes=%zu-%zu\r\n", i * RANGE_CHUNK_SIZE, end);
+    rg->stop = end + 1;
+    return RANGE_FETCH;
+}
+
+/*
+ * range_next 先由第一个来源（整个对象、第一个需要的块或回源的响应）生成报头，
+ * 之后每次给出next所在来源中需要的部分；当前的块用完后查找下一块，缺失时回源
+ */
+int range_next(range_ctx* rg, range_src* s)
+{
+    size_t i, n;
+
+    s->cb = NULL;
+    s->on_disk = 0;
+    while(!rg->done && !(rg->head_sent && rg->next > rg->last)){
+        if(!rg->have_cur){
+            i = (rg->head_sent ? rg->next : rg->suffix ? 0 : rg->first) / RANGE_CHUNK_SIZE;
+            if(!chunk_get(rg, i, &rg->cur))
+                return plan_fetch(rg, i);
+            rg->have_cur = 1;
+        }
+        if(!rg->head_sent){
+            rg->total = rg->cur.total;
+            s->data = rg->out;
+            if((s->len = emit_head(rg, rg->cur.data, rg->cur.body)) == 0)
+                return RANGE_FAIL;
+            return RANGE_SEND;
+        }
+        if(rg->cur.start <= rg->next && rg->next < rg->cur.end){
+            *s = rg->cur;
+            rg->have_cur = 0;
+            n = (rg->cur.end < rg->last + 1 ? rg->cur.end : rg->last + 1) - rg->next;
+            s->data += s->body + (rg->next - s->start);
+            if(s->on_disk){
+                s->disk.off += s->body + (rg->next - s->start);
+                s->disk.size = n;
+            }
+            s->len = n;
+            rg->next += n;
+            return RANGE_SEND;
+        }
+        range_put(&rg->cur);
+        rg->have_cur = 0;
+    }
+    if(rg->have_cur){
+        range_put(&rg->cur);
+        rg->have_cur = 0;
+    }
+    rg->done = 1;
+    return RANGE_DONE;
+}
+
+/*
+ * range_start 回源的响应报头已完整：206或完整的200给出资源的总长度与响应体的起点，
+ * 还没有发出报头时据此生成206；其他响应在发出报头之前原样转发，之后则无法继续
+ */
+static int range_start(range_ctx* rg, http_resp* rp, size_t* olen)
+{
+    size_t start, total;
+
+    if(rp->status == 206 && rp->range_first >= 0 && rp->range_total > 0){
+        start = rp->range_first;
+        total = rp->range_total;
+    }
+    else if(rp->status == 200 && !rp->chunked && rp->content_length >= 0){
+        start = 0;
+        total = rp->content_length;
+    }
+    else if(!rg->head_sent){
+        memcpy(rg->out, rg->head, rg->headlen);
+        *olen = rg->headlen;
+        rg->passthru = rg->head_sent = 1;
+        return 0;
+    }
+    else
+        return -1;
+    /* 资源在两次回源之间改变了，已发出的部分不能与新的内容拼在一起 */
+    if(rg->head_sent && (total != rg->total || strcmp(validator(rp), rg->validator)))
+        return -1;
+    rg->total = total;
+    rg->pos = start;
+    rg->cacheable = !rp->no_store;
+    if(!rg->head_sent && (*olen = emit_head(rg, rg->head, rg->headlen)) == 0)
+        return -1;
+    if(!rg->done && start > rg->next) /* 响应不含需要的字节 */
+        return -1;
+    return 0;
+}
+
+/*
+ * chunk_begin 第c块的第一个字节到达，以响应报头为模板生成块的206报头，开始填充
+ */
+static void chunk_begin(range_ctx* rg, size_t c, size_t cend)
+{
+    char key[MAXLINE], head[RANGE_HEAD_MAX];
+    size_t start = c * RANGE_CHUNK_SIZE;
+    size_t hl = build_partial(head, sizeof(head), rg->head, rg->headlen, start, cend - 1, rg->total);
+
+    if(hl == 0)
+        return;
+    chunk_key(key, rg->url, c);
+    rg->fill_size = hl + cend - start;
+    if(fill_cache_begin(&rg->fill, key, rg->fill_size) < 0
+        || fill_cache_append(&rg->fill, head, hl, rg->fill_size) < 0)
+        return;
+    rg->filling = 1;
+}
+
+/*
+ * range_body 一段响应体：按块的边界切开填入cache，与客户端需要的部分重叠的字节追加到out
+ */
+static size_t range_body(range_ctx* rg, const char* b, size_t n, size_t olen)
+{
+    size_t c, cend, k, hi;
+
+    while(n > 0 && rg->pos < rg->stop && rg->pos < rg->total){
+        c = rg->pos / RANGE_CHUNK_SIZE;
+        cend = (c + 1) * RANGE_CHUNK_SIZE < rg->total ? (c + 1) * RANGE_CHUNK_SIZE : rg->total;
+        k = n < cend - rg->pos ? n : cend - rg->pos;
+        if(rg->pos == c * RANGE_CHUNK_SIZE && rg->cacheable)
+            chunk_begin(rg, c, cend);
+        if(rg->filling){
+            if(fill_cache_append(&rg->fill, b, k, rg->fill_size) < 0)
+                rg->filling = 0;
+            else if(rg->pos + k == cend){
+                fill_cache_commit(&rg->fill);
+                rg->filling = 0;
+            }
+        }
+        hi = rg->pos + k < rg->last + 1 ? rg->pos + k : rg->last + 1;
+        if(rg->next >= rg->pos && rg->next < hi){
+            memcpy(rg->out + olen, b + (rg->next - rg->pos), hi - rg->next);
+            olen += hi - rg->next;
+            rg->next = hi;
+        }
+        b += k;
+        n -= k;
+        rg->pos += k;
+    }
+    return olen;
+}
+
+int range_feed(range_ctx* rg, http_resp* rp, const char* buf, size_t n, char** out, size_t* outlen)
+{
+    size_t hb = 0, olen = 0;
+
+    *out = rg->out;
+    *outlen = 0;
+    if(!rg->started){
+        hb = rp->head_len - rg->headlen;
+        if(rg->headlen + hb > sizeof(rg->head))
+            return -1;
+        memcpy(rg->head + rg->headlen, buf, hb);
+        rg->headlen += hb;
+        if(rp->state == RESP_HEAD)
+            return 0;
+        rg->started = 1;
+        if(range_start(rg, rp, &olen) < 0)
+            return -1;
+    }
+    if(rg->passthru){
+        memcpy(rg->out + olen, buf + hb, n - hb);
+        olen += n - hb;
+    }
+    else if(!rg->done)
+        olen = range_body(rg, buf + hb, n - hb, olen);
+    *outlen = olen;
+    return rp->state == RESP_DONE || (!rg->passthru && (rg->done || rg->pos >= rg->stop));
+}
+
+int range_fetch_end(range_ctx* rg, http_resp* rp)
+{
+    if(rg->filling){
+        fill_cache_abort(&rg->fill);
+        rg->filling = 0;
+    }
+    if(rg->passthru){
+        rg->done = 1;
+        rg->persistent = resp_reusable(rp);
+        return 0;
+    }
+    if(!rg->head_sent || (!rg->done && rg->mark != RANGE_OPEN && rg->next == rg->mark))
+        return -1;
+    return 0;
+}
+
+void range_end(range_ctx* rg)
+{
+    if(rg->have_cur)
+        range_put(&rg->cur);
+    rg->have_cur = 0;
+    if(rg->filling)
+        fill_cache_abort(&rg->fill);
+    rg->filling = 0;
+}
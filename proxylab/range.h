@@ -0,0 +1,89 @@
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "http.h"
+
+/* 此处定义Range请求相关的常量 */
+#define RANGE_CHUNK_SIZE (64 * 1024) /* 大对象按此大小分块缓存，一块连同报头须放得进内存cache */
+#define RANGE_RUN_MAX 16 /* 一次回源最多请求的连续缺失块数 */
+#define RANGE_HEAD_MAX MAXBUF /* 作为模板保存的响应报头的最大长度 */
+#define RANGE_KEY_EXTRA 32 /* 块的键在URL之后追加的最大长度 */
+
+/* range_next的返回值 */
+enum {
+    RANGE_SEND,  /* 把取得的一段内容发给客户端 */
+    RANGE_FETCH, /* 向服务器请求缺失的块，请求报头为cond */
+    RANGE_DONE,  /* 回答已完整 */
+    RANGE_FAIL   /* 无法继续，已发出报头时只能关闭连接 */
+};
+
+/*
+ * 一段要发送的内容
+ * 来自cache时持有内存block或磁盘层所在段的引用，发送后由range_put释放；
+ * 否则指向range_ctx自己的缓冲区（生成的报头）
+ */
+typedef struct{
+    cache_block *cb; /* 内存中的对象，否则为NULL */
+    disk_hit disk; /* on_disk时有效，off与size已调整为要发送的部分 */
+    int on_disk;
+    char *data;
+    size_t len;
+    size_t body; /* 以下为range.c内部使用：响应体在对象中的偏移 */
+    size_t start, end; /* 响应体在整个资源中的位置[start, end) */
+    size_t total; /* 资源的总长度 */
+}range_src;
+
+/*
+ * 一个Range请求的状态
+ * 依次从整个对象、已缓存的块与回源中取得[first, last]的各段，按顺序发给客户端；
+ * 回源得到的响应体按块的边界切开，每个完整的块作为一个独立的206对象缓存
+ */
+typedef struct{
+    char *url; /* 由调用者保存 */
+    size_t first, last; /* 请求的范围（含两端）；suffix时first为后缀长度，尚未得知总长度 */
+    int suffix;
+    size_t total; /* 资源的总长度，0表示尚未得知 */
+    size_t next; /* 下一个要发给客户端的字节 */
+    int head_sent; /* 已向客户端发出报头（206、416或原样转发的响应） */
+    int done;
+    int persistent; /* 回答自身分帧，之后客户端连接可以保持 */
+    int fetched; /* 有部分内容来自服务器 */
+    char validator[RESP_VALIDATOR_MAX]; /* 已发出部分所属的版本（ETag或Last-Modified），各块须一致 */
+    range_src cur; /* 正在使用的来源 */
+    int have_cur;
+
+    /* 正在进行的回源 */
+    char cond[64]; /* 代替客户端Range的请求报头 */
+    int started; /* 响应报头已完整并处理过 */
+    int passthru; /* 服务器的响应不能按范围处理，原样转给客户端 */
+    int cacheable;
+    size_t pos; /* 下一个到达的响应体字节在资源中的位置 */
+    size_t stop; /* 收到此位置为止即可结束这次回源 */
+    size_t mark; /* 回源开始时的next，用于判断有无进展 */
+    char head[RANGE_HEAD_MAX]; /* 服务器的响应报头，作为块与206报头的模板 */
+    size_t headlen;
+    cache_fill fill; /* 正在填充的块 */
+    int filling;
+    size_t fill_size;
+    char out[RANGE_HEAD_MAX + MAXLINE]; /* 生成的报头与要转发的响应体 */
+}range_ctx;
+
+/* 客户端的请求带有单个字节范围时开始处理，返回0；否则返回-1，按普通请求处理 */
+int range_begin(range_ctx* rg, char* url, http_req* rq);
+/* 下一步：RANGE_SEND时*s为要发送的内容，RANGE_FETCH时向服务器发出带cond的请求 */
+int range_next(range_ctx* rg, range_src* s);
+/* 释放RANGE_SEND取得的来源 */
+void range_put(range_src* s);
+/*
+ * 回源时输入收到的响应中属于本响应的n字节（已由rp分帧），*out与*outlen为要转发给客户端的内容
+ * 返回0继续读取，1表示这次回源可以结束，-1表示出错
+ */
+int range_feed(range_ctx* rg, http_resp* rp, const char* buf, size_t n, char** out, size_t* outlen);
+/* 一次回源结束，没有取得任何进展时返回-1 */
+int range_fetch_end(range_ctx* rg, http_resp* rp);
+/* 释放请求持有的来源与未完成的块 */
+void range_end(range_ctx* rg);
+
+#endif
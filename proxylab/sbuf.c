@@ -0,0 +1,71 @@
+/*
+ * 预线程化模式使用的有界缓冲区
+ * 主线程作为生产者插入已接受的描述符，工作线程作为消费者取出并处理
+ */
+
+#include "sbuf.h"
+
+/*
+ * sbuf_init 创建一个有n个槽位的空队列
+ */
+void sbuf_init(sbuf_t* sp, int n)
+{
+    sp->buf = (int*)Calloc(n, sizeof(int));
+    sp->n = n;
+    sp->front = sp->rear = 0;
+    Sem_init(&sp->mutex, 0, 1);
+    Sem_init(&sp->slots, 0, n);
+    Sem_init(&sp->items, 0, 0);
+}
+
+/*
+ * sbuf_deinit 释放队列占用的内存
+ */
+void sbuf_deinit(sbuf_t* sp)
+{
+    Free(sp->buf);
+}
+
+/*
+ * sbuf_insert 插入队尾，队列满时等待空闲槽位
+ */
+void sbuf_insert(sbuf_t* sp, int item)
+{
+    P(&sp->slots);
+    P(&sp->mutex);
+    sp->buf[(++sp->rear) % (sp->n)] = item;
+    V(&sp->mutex);
+    V(&sp->items);
+}
+
+/*
+ * sbuf_tryinsert 插入队尾，队列满时不等待，返回0
+ */
+int sbuf_tryinsert(sbuf_t* sp, int item)
+{
+    while (sem_trywait(&sp->slots) < 0) {
+        if (errno == EAGAIN)
+            return 0;
+        if (errno != EINTR)
+            unix_error("sem_trywait error");
+    }
+    P(&sp->mutex);
+    sp->buf[(++sp->rear) % (sp->n)] = item;
+    V(&sp->mutex);
+    V(&sp->items);
+    return 1;
+}
+
+/*
+ * sbuf_remove 取出队首，队列空时等待
+ */
+int sbuf_remove(sbuf_t* sp)
+{
+    int item;
+    P(&sp->items);
+    P(&sp->mutex);
+    item = sp->buf[(++sp->front) % (sp->n)];
+    V(&sp->mutex);
+    V(&sp->slots);
+    return item;
+}
@@ -0,0 +1,26 @@
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+/* 有界的生产者-消费者队列，存放已接受的连接描述符 */
+typedef struct {
+    int* buf;    /* Buffer array */
+    int n;       /* Maximum number of slots */
+    int front;   /* buf[(front+1)%n] is first item */
+    int rear;    /* buf[rear%n] is last item */
+    sem_t mutex; /* Protects accesses to buf */
+    sem_t slots; /* Counts available slots */
+    sem_t items; /* Counts available items */
+} sbuf_t;
+
+void sbuf_init(sbuf_t* sp, int n);
+void sbuf_deinit(sbuf_t* sp);
+/* 插入队尾，队列满时阻塞 */
+void sbuf_insert(sbuf_t* sp, int item);
+/* 插入队尾，队列满时立即返回0 */
+int sbuf_tryinsert(sbuf_t* sp, int item);
+/* 取出队首，队列空时阻塞 */
+int sbuf_remove(sbuf_t* sp);
+
+#endif
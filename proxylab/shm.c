@@ -0,0 +1,61 @@
+/*
+ * 进程间共享的内存与锁
+ * 单进程时退化为普通的堆内存与锁，cache的代码不必区分两种模式；
+ * 多进程时互斥锁是robust的：持有锁的工作进程崩溃后，下一个加锁者得到EOWNERDEAD，
+ * 把锁标记为一致后继续使用，不会让其他进程永远阻塞
+ */
+
+#include <sys/mman.h>
+#include "shm.h"
+
+static int shared;
+
+void shm_enable(void)
+{
+    shared = 1;
+}
+
+int shm_enabled(void)
+{
+    return shared;
+}
+
+/*
+ * shm_calloc 多进程模式下每次映射一块共享的匿名内存，映射的内容本来就是零
+ * 只在初始化时调用，次数很少，不需要在其上再做分配器
+ */
+void* shm_calloc(size_t n, size_t size)
+{
+    if(!shared)
+        return Calloc(n, size);
+    return Mmap(NULL, n * size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+}
+
+void* shm_map(size_t size)
+{
+    return Mmap(NULL, size, PROT_READ | PROT_WRITE,
+        (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+}
+
+void shm_mutex_init(pthread_mutex_t* m)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    if(shared){
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    }
+    pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/*
+ * shm_lock 加锁，上一个持有者死亡时锁仍归本线程所有
+ * 死亡的进程可能停在临界区中间，cache的临界区都很短，接手后照常使用
+ */
+void shm_lock(pthread_mutex_t* m)
+{
+    if(pthread_mutex_lock(m) == EOWNERDEAD)
+        pthread_mutex_consistent(m);
+}
@@ -0,0 +1,25 @@
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include "csapp.h"
+
+/*
+ * 多进程模式下cache所用的共享内存
+ * 所有共享的结构都在fork之前映射，各工作进程继承的映射地址相同，结构中的指针在各进程中都有效；
+ * fork之后新建的映射不再共享，所以运行期间需要的共享内存（如读者记录）也须预先分配
+ */
+
+/* 启用多进程模式，须在init_cache之前调用；此后cache的结构都分配在共享内存中 */
+void shm_enable(void);
+/* 是否为多进程模式 */
+int shm_enabled(void);
+/* 分配n个size字节的清零内存：多进程模式下来自共享映射，不再释放；否则为Calloc */
+void* shm_calloc(size_t n, size_t size);
+/* 映射size字节按需缺页的匿名内存，多进程模式下为各进程共享 */
+void* shm_map(size_t size);
+/* 初始化互斥锁，多进程模式下为进程间共享且robust的锁 */
+void shm_mutex_init(pthread_mutex_t* m);
+/* 加锁；持有锁的进程已死亡时接手这把锁 */
+void shm_lock(pthread_mutex_t* m);
+
+#endif
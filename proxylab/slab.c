@@ -0,0 +1,236 @@
+/*
+ * cache使用的slab分配器
+ * 整个cache占用一块预先映射的内存，按页切分：
+ * 小对象按大小类（每类比上一类大约1.25倍）从专属页中切出chunk，同类对象紧密排列；
+ * 超过SLAB_MAX_CHUNK的对象直接占用连续的整页。
+ * 页中的chunk全部释放后，页回到公共的空闲页池，可以被任何大小类或大对象重新使用。
+ * 多进程模式下内存区域、页描述符与大小类都位于共享内存中（见shm.c），各进程从同一个分配器分配。
+ */
+
+#include "slab.h"
+#include "shm.h"
+
+#define SLAB_FREE (-1) /* 空闲页 */
+#define SLAB_RUN (-2) /* 大对象占用的连续页 */
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+static char *arena; /* 整块内存 */
+static size_t npages;
+static slab_page *pages; /* 页描述符 */
+static unsigned long *freemap; /* 空闲页位图，1表示空闲 */
+static size_t rover; /* 下一次查找空闲页的起点，只是提示，各进程各有一份 */
+static pthread_mutex_t *page_mutex; /* 保护空闲页位图 */
+static slab_class *classes;
+static int nclasses;
+
+/* 
+ * size_class 找到能容纳size字节的最小大小类
+ */
+static int size_class(size_t size)
+{
+    int lo = 0, hi = nclasses - 1;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(classes[mid].size >= size)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+static int page_isfree(size_t i)
+{
+    return (freemap[i / BITS_PER_WORD] >> (i % BITS_PER_WORD)) & 1;
+}
+
+static void page_mark(size_t first, size_t n, int isfree)
+{
+    for(size_t i = first; i < first + n; i++){
+        if(isfree)
+            freemap[i / BITS_PER_WORD] |= 1UL << (i % BITS_PER_WORD);
+        else
+            freemap[i / BITS_PER_WORD] &= ~(1UL << (i % BITS_PER_WORD));
+    }
+}
+
+/* 
+ * pages_get 从空闲页池中取出n个连续的页（next fit），没有时返回-1
+ */
+static long pages_get(size_t n)
+{
+    size_t run = 0, start = 0;
+    long found = -1;
+
+    shm_lock(page_mutex);
+    for(size_t k = 0; k < npages; k++){
+        size_t i = (rover + k) % npages;
+        if(i == 0)
+            run = 0; /* 连续页不能跨越区域末尾 */
+        if(run == 0 && i % BITS_PER_WORD == 0 && freemap[i / BITS_PER_WORD] == 0
+            && i + BITS_PER_WORD <= npages){
+            k += BITS_PER_WORD - 1; /* 整个字都已占用 */
+            continue;
+        }
+        if(!page_isfree(i)){
+            run = 0;
+            continue;
+        }
+        if(run++ == 0)
+            start = i;
+        if(run == n){
+            found = start;
+            break;
+        }
+    }
+    if(found >= 0){
+        page_mark(found, n, 0);
+        rover = (found + n) % npages;
+    }
+    pthread_mutex_unlock(page_mutex);
+    return found;
+}
+
+static void pages_put(size_t first, size_t n)
+{
+    shm_lock(page_mutex);
+    for(size_t i = first; i < first + n; i++)
+        pages[i].cls = SLAB_FREE;
+    page_mark(first, n, 1);
+    pthread_mutex_unlock(page_mutex);
+}
+
+static void partial_unlink(slab_page* pg)
+{
+    pg->prev->next = pg->next;
+    pg->next->prev = pg->prev;
+}
+
+static void partial_push(slab_class* sc, slab_page* pg)
+{
+    pg->next = sc->partial.next;
+    pg->prev = &sc->partial;
+    sc->partial.next->prev = pg;
+    sc->partial.next = pg;
+}
+
+/* 
+ * slab_init 映射size字节（向上取整到页）的内存并初始化大小类
+ * 内存按需缺页，未使用的部分不占物理内存
+ */
+void slab_init(size_t size)
+{
+    size_t sz = SLAB_MIN_CHUNK;
+
+    npages = (size + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE;
+    arena = (char*)shm_map(npages * SLAB_PAGE_SIZE);
+    pages = (slab_page*)shm_calloc(npages, sizeof(slab_page));
+    freemap = (unsigned long*)shm_calloc((npages + BITS_PER_WORD - 1) / BITS_PER_WORD, sizeof(unsigned long));
+    page_mutex = (pthread_mutex_t*)shm_calloc(1, sizeof(pthread_mutex_t));
+    classes = (slab_class*)shm_calloc(SLAB_MAX_CLASSES, sizeof(slab_class));
+    shm_mutex_init(page_mutex);
+    pages_put(0, npages);
+    rover = 0;
+
+    for(nclasses = 0; nclasses < SLAB_MAX_CLASSES; nclasses++){
+        slab_class *sc = &classes[nclasses];
+        if(sz > SLAB_MAX_CHUNK || nclasses == SLAB_MAX_CLASSES - 1)
+            sz = SLAB_MAX_CHUNK;
+        sc->size = sz;
+        sc->perpage = SLAB_PAGE_SIZE / sz;
+        shm_mutex_init(&sc->mutex);
+        sc->partial.next = sc->partial.prev = &sc->partial;
+        if(sz == SLAB_MAX_CHUNK){
+            nclasses++;
+            break;
+        }
+        sz = (sz * 5 / 4 + 7) & ~(size_t)7; /* 增长1.25倍并8字节对齐 */
+    }
+}
+
+/* 
+ * slab_alloc 分配size字节，空间不足时返回NULL，由调用者淘汰旧对象后重试
+ */
+void* slab_alloc(size_t size)
+{
+    slab_class *sc;
+    slab_page *pg;
+    char *p;
+    long first;
+
+    if(size > SLAB_MAX_CHUNK){
+        size_t n = (size + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE;
+        if((first = pages_get(n)) < 0)
+            return NULL;
+        pages[first].cls = SLAB_RUN;
+        pages[first].npages = n;
+        return arena + ((size_t)first << SLAB_PAGE_SHIFT);
+    }
+
+    sc = &classes[size_class(size)];
+    shm_lock(&sc->mutex);
+    pg = sc->partial.next;
+    if(pg == &sc->partial){ /* 没有未满页，从页池取一页 */
+        if((first = pages_get(1)) < 0){
+            pthread_mutex_unlock(&sc->mutex);
+            return NULL;
+        }
+        pg = &pages[first];
+        pg->cls = sc - classes;
+        pg->free = NULL;
+        pg->used = pg->carved = 0;
+        partial_push(sc, pg);
+    }
+    if(pg->free){
+        p = pg->free;
+        pg->free = *(char**)p;
+    }
+    else /* 页中的chunk按需切出，新页不必预先串成链表 */
+        p = arena + ((size_t)(pg - pages) << SLAB_PAGE_SHIFT) + pg->carved++ * sc->size;
+    if(++pg->used == sc->perpage)
+        partial_unlink(pg);
+    pthread_mutex_unlock(&sc->mutex);
+    return p;
+}
+
+/* 
+ * slab_free 释放内存，页中的chunk全部空闲时归还页池
+ */
+void slab_free(void* p)
+{
+    size_t i = ((char*)p - arena) >> SLAB_PAGE_SHIFT;
+    slab_page *pg = &pages[i];
+    slab_class *sc;
+    int was_full;
+
+    if(pg->cls == SLAB_RUN){
+        pages_put(i, pg->npages);
+        return;
+    }
+
+    sc = &classes[pg->cls];
+    shm_lock(&sc->mutex);
+    was_full = (pg->used == sc->perpage);
+    *(char**)p = pg->free;
+    pg->free = (char*)p;
+    if(--pg->used == 0){
+        if(!was_full)
+            partial_unlink(pg);
+        pthread_mutex_unlock(&sc->mutex);
+        pages_put(i, 1);
+        return;
+    }
+    if(was_full)
+        partial_push(sc, pg);
+    pthread_mutex_unlock(&sc->mutex);
+}
+
+/* 
+ * slab_round 分配size字节实际占用的字节数，用于cache按字节计算容量
+ */
+size_t slab_round(size_t size)
+{
+    if(size > SLAB_MAX_CHUNK)
+        return (size + SLAB_PAGE_SIZE - 1) & ~(size_t)(SLAB_PAGE_SIZE - 1);
+    return classes[size_class(size)].size;
+}
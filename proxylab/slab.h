@@ -0,0 +1,40 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "csapp.h"
+
+/* 此处定义slab分配器相关的常量 */
+#define SLAB_PAGE_SHIFT 14
+#define SLAB_PAGE_SIZE (1 << SLAB_PAGE_SHIFT) /* 16KB一页 */
+#define SLAB_MIN_CHUNK 64 /* 最小的chunk */
+#define SLAB_MAX_CHUNK (SLAB_PAGE_SIZE / 2) /* 更大的对象直接分配连续的整页 */
+#define SLAB_MAX_CLASSES 32
+
+/* 页描述符 */
+typedef struct slab_page{
+    struct slab_page *prev, *next; /* 所属大小类的未满页链表 */
+    char *free; /* 页内空闲chunk链表 */
+    unsigned int used; /* 已分配的chunk数 */
+    unsigned int carved; /* 已从页中切出的chunk数 */
+    int cls; /* 大小类编号，或SLAB_RUN/SLAB_FREE */
+    unsigned int npages; /* SLAB_RUN的首页记录连续的页数 */
+}slab_page;
+
+/* 大小类 */
+typedef struct{
+    size_t size; /* chunk大小 */
+    unsigned int perpage; /* 每页的chunk数 */
+    pthread_mutex_t mutex; /* 保护本类的未满页链表及其中各页 */
+    slab_page partial; /* 未满页链表的哨兵 */
+}slab_class;
+
+/* 在一块size字节的内存区域上建立分配器 */
+void slab_init(size_t size);
+/* 分配size字节，空间不足时返回NULL */
+void* slab_alloc(size_t size);
+/* 释放slab_alloc得到的内存 */
+void slab_free(void* p);
+/* 分配size字节实际占用的字节数 */
+size_t slab_round(size_t size);
+
+#endif
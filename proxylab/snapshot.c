@@ -0,0 +1,185 @@
+/*
+ * cache的快照与热重启
+ * 定时或收到SIGTERM时把内存cache中的对象写入快照文件：内容依次写入，索引与文件头最后写入，
+ * 写完临时文件并fsync之后rename替换旧快照，任何时刻磁盘上的快照都是完整的；
+ * 启动时把快照整体映射到内存，只读取末尾的索引，对象的内容直接指向映射（见cache_adopt），
+ * 页面在第一次被访问时才由内核读入，不必等整个文件读完即可开始服务；
+ * 映射一直保留到进程退出，之后的快照rename替换文件不影响已映射的旧文件
+ */
+
+#include <sys/mman.h>
+#include "snapshot.h"
+#include "cache.h"
+#include "log.h"
+
+#define ENT_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+static char *snap_path;
+static int snap_interval;
+
+/* 写快照时的状态 */
+typedef struct{
+    FILE *fp;
+    uint64_t off; /* 下一个内容的偏移 */
+    uint64_t count;
+    char *index; /* 在内存中积累的索引 */
+    size_t len, cap;
+    int err;
+}dump_ctx;
+
+/*
+ * dump_one 写入一个block的内容，并把它的位置追加到索引中
+ */
+static void dump_one(cache_block* cb, void* arg)
+{
+    dump_ctx *d = (dump_ctx*)arg;
+    uint32_t urllen = strlen(cb->url) + 1;
+    size_t need = ENT_ALIGN(sizeof(snapshot_ent) + urllen);
+    snapshot_ent *e;
+
+    if(d->err)
+        return;
+    if(fwrite(cb->block, 1, cb->size, d->fp) != cb->size){
+        d->err = 1;
+        return;
+    }
+    while(d->len + need > d->cap){
+        d->cap = d->cap ? d->cap * 2 : MAXBUF;
+        d->index = (char*)Realloc(d->index, d->cap);
+    }
+    e = (snapshot_ent*)(d->index + d->len);
+    memset(e, 0, need);
+    e->off = d->off;
+    e->size = cb->size;
+    e->urllen = urllen;
+    memcpy(e + 1, cb->url, urllen);
+    d->len += need;
+    d->off += cb->size;
+    d->count++;
+}
+
+/*
+ * snapshot_dump 把内存cache写入path.tmp，完整写入并落盘后rename为path
+ */
+int snapshot_dump(char* path)
+{
+    char tmp[MAXLINE];
+    dump_ctx d = { NULL, sizeof(snapshot_hdr), 0, NULL, 0, 0, 0 };
+    snapshot_hdr hdr;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if((d.fp = fopen(tmp, "w")) == NULL)
+        return -1;
+    if(fseek(d.fp, sizeof(snapshot_hdr), SEEK_SET) < 0)
+        d.err = 1;
+    cache_walk(dump_one, &d);
+    /* 索引紧跟在内容之后，按8字节对齐 */
+    for(; !d.err && d.off % 8; d.off++)
+        if(fputc(0, d.fp) == EOF)
+            d.err = 1;
+    if(!d.err && d.len && fwrite(d.index, 1, d.len, d.fp) != d.len)
+        d.err = 1;
+    hdr.magic = SNAPSHOT_MAGIC;
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.count = d.count;
+    hdr.index = d.off;
+    hdr.end = d.off + d.len;
+    if(!d.err && (fseek(d.fp, 0, SEEK_SET) < 0 || fwrite(&hdr, sizeof(hdr), 1, d.fp) != 1))
+        d.err = 1;
+    if(!d.err && (fflush(d.fp) == EOF || fsync(fileno(d.fp)) < 0))
+        d.err = 1;
+    if(fclose(d.fp) == EOF)
+        d.err = 1;
+    Free(d.index);
+    if(d.err || rename(tmp, path) < 0){
+        unlink(tmp);
+        return -1;
+    }
+    LOG(LV_INFO, "Snapshot of %lu objects written to %s", (unsigned long)d.count, path);
+    return 0;
+}
+
+/*
+ * snapshot_load 映射快照并按索引把对象挂入cache，内容不读取
+ * 先逐项检查边界，损坏的索引项及其之后的对象不再恢复
+ */
+int snapshot_load(char* path)
+{
+    int fd, n = 0;
+    struct stat st;
+    char *map, *p, *url;
+    snapshot_hdr *hdr;
+    snapshot_ent *e;
+
+    if((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(snapshot_hdr)){
+        close(fd);
+        return -1;
+    }
+    map = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return -1;
+    hdr = (snapshot_hdr*)map;
+    if(hdr->magic != SNAPSHOT_MAGIC || hdr->version != SNAPSHOT_VERSION || hdr->end != (uint64_t)st.st_size
+        || hdr->index < sizeof(snapshot_hdr) || hdr->index > hdr->end){
+        munmap(map, st.st_size);
+        return -1;
+    }
+    madvise(map, hdr->index, MADV_RANDOM); /* 内容按命中的顺序读入，不预读 */
+
+    for(p = map + hdr->index; (uint64_t)n < hdr->count; n++){
+        e = (snapshot_ent*)p;
+        url = (char*)(e + 1);
+        if(p + sizeof(snapshot_ent) > map + hdr->end || e->urllen == 0
+            || url + e->urllen > map + hdr->end || url[e->urllen - 1] != '\0'
+            || e->off < sizeof(snapshot_hdr) || e->off + e->size > hdr->index)
+            break;
+        cache_adopt(url, map + e->off, e->size);
+        p += ENT_ALIGN(sizeof(snapshot_ent) + e->urllen);
+    }
+    LOG(LV_INFO, "Restored %d objects from snapshot %s", n, path);
+    return n;
+}
+
+/*
+ * snapshot_thread 等待SIGTERM或定时器到期，写快照；SIGTERM时随后退出
+ */
+static void* snapshot_thread(void* vargp)
+{
+    sigset_t set;
+    struct timespec ts = { snap_interval, 0 };
+    int sig;
+
+    Pthread_detach(pthread_self());
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    while(1){
+        sig = snap_interval > 0 ? sigtimedwait(&set, NULL, &ts) : sigwaitinfo(&set, NULL);
+        if(sig < 0 && errno != EAGAIN) /* 被其他信号打断 */
+            continue;
+        if(snapshot_dump(snap_path) < 0)
+            LOG(LV_ERROR, "snapshot to %s failed: %s", snap_path, strerror(errno));
+        if(sig == SIGTERM)
+            exit(0);
+    }
+    return NULL;
+}
+
+/*
+ * snapshot_start 在本线程中屏蔽SIGTERM后启动快照线程
+ * 须在创建其他线程之前调用，之后创建的线程继承屏蔽，SIGTERM只由快照线程同步地接收
+ */
+void snapshot_start(char* path, int interval)
+{
+    sigset_t set;
+    pthread_t tid;
+
+    snap_path = path;
+    snap_interval = interval;
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    Pthread_create(&tid, NULL, snapshot_thread, NULL);
+}
@@ -0,0 +1,39 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+/* 此处定义快照相关的常量 */
+#define SNAPSHOT_MAGIC 0x50414e53U /* "SNAP" */
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_INTERVAL 300 /* 默认每隔多少秒写一次快照 */
+
+/*
+ * 快照文件的布局：文件头、各对象的内容依次排列、索引
+ * 文件头最后写入，rename之前文件不完整也不会被读到
+ */
+typedef struct{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count; /* 对象个数 */
+    uint64_t index; /* 索引在文件中的偏移 */
+    uint64_t end; /* 文件的总长度 */
+}snapshot_hdr;
+
+/* 索引中的一项，其后是URL（含结尾的'\0'），整项按8字节对齐；按淘汰的先后排列 */
+typedef struct{
+    uint64_t off; /* 内容在文件中的偏移 */
+    uint64_t size;
+    uint32_t urllen;
+    uint32_t pad;
+}snapshot_ent;
+
+/* 把内存cache写入path处的快照，失败返回-1 */
+int snapshot_dump(char* path);
+/* 映射path处的快照并把其中的对象挂入cache，返回恢复的对象数，没有可用的快照时返回-1 */
+int snapshot_load(char* path);
+/* 启动快照线程：每interval秒（0表示不定时）与收到SIGTERM时写快照，SIGTERM之后退出进程 */
+void snapshot_start(char* path, int interval);
+
+#endif
@@ -0,0 +1,207 @@
+/*
+ * 运行时统计
+ * 每个线程在自己的记录中累加计数器与延迟直方图，只有所属线程写入，不需要原子的读-改-写，
+ * 热路径上没有共享的缓存行；请求统计页时把所有线程的记录合并，同样不加锁
+ * 直方图采用HDR风格的对数-线性分格：每个2的幂区间再等分为HIST_SUB格，
+ * 从1微秒到数小时的值都能以不超过1/HIST_SUB的相对误差记录，分格数固定
+ */
+
+#include "stats.h"
+
+static stats_rec *recs; /* 所有线程的记录，只增不减 */
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static __thread stats_rec *self;
+static uint64_t started;
+
+/*
+ * rec_release 线程退出时交还记录，计数保留
+ */
+static void rec_release(void* p)
+{
+    __atomic_store_n(&((stats_rec*)p)->used, 0, __ATOMIC_RELEASE);
+}
+
+static void key_create(void)
+{
+    pthread_key_create(&key, rec_release);
+}
+
+/*
+ * rec_get 取得本线程的记录，优先接手已退出线程的记录
+ */
+static stats_rec* rec_get(void)
+{
+    stats_rec *r;
+    int zero;
+
+    if(self)
+        return self;
+    pthread_once(&once, key_create);
+    for(r = __atomic_load_n(&recs, __ATOMIC_ACQUIRE); r; r = r->next){
+        zero = 0;
+        if(!__atomic_load_n(&r->used, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(&r->used, &zero, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if(r == NULL){
+        r = (stats_rec*)Calloc(1, sizeof(stats_rec));
+        r->used = 1;
+        r->next = __atomic_load_n(&recs, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&recs, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(key, r);
+    return self = r;
+}
+
+/*
+ * bump 单写者的累加：普通的读与写，只保证读者不会读到撕裂的值
+ */
+static void bump(uint64_t* p, uint64_t n)
+{
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static uint64_t get(uint64_t* p)
+{
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+void stats_init(void)
+{
+    started = stats_now();
+}
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void stats_add(stat_counter c, uint64_t n)
+{
+    bump(&rec_get()->counters[c], n);
+}
+
+/*
+ * hist_index 值所在的格：小于HIST_SUB的值各占一格，更大的值按最高位所在的2的幂区间再细分
+ */
+static int hist_index(uint64_t v)
+{
+    int e;
+
+    if(v < HIST_SUB)
+        return (int)v;
+    e = 63 - __builtin_clzll(v);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * hist_upper 格中的最大值
+ */
+static uint64_t hist_upper(int i)
+{
+    int e;
+
+    if(i < HIST_SUB)
+        return i;
+    e = i / HIST_SUB + HIST_SUB_BITS - 1;
+    return ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+void stats_record(stat_hist h, uint64_t usec)
+{
+    stats_histogram *hp = &rec_get()->hists[h];
+
+    bump(&hp->buckets[hist_index(usec)], 1);
+    bump(&hp->sum, usec);
+    if(usec > get(&hp->max))
+        __atomic_store_n(&hp->max, usec, __ATOMIC_RELAXED);
+}
+
+int stats_request(char* url)
+{
+    return strcmp(url, STATS_URL) == 0;
+}
+
+/*
+ * hist_json 合并各线程的直方图并输出计数、均值与分位数
+ */
+static size_t hist_json(char* buf, size_t maxlen, const char* name, stat_hist h)
+{
+    static const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+    static const char* qnames[] = { "p50", "p90", "p99", "p999" };
+    uint64_t *merged = (uint64_t*)Calloc(HIST_BUCKETS, sizeof(uint64_t));
+    uint64_t count = 0, sum = 0, max = 0, seen, target, v;
+    size_t len;
+    int i, q;
+
+    for(stats_rec *r = __atomic_load_n(&recs, __ATOMIC_ACQUIRE); r; r = r->next){
+        stats_histogram *hp = &r->hists[h];
+        for(i = 0; i < HIST_BUCKETS; i++)
+            merged[i] += get(&hp->buckets[i]);
+        sum += get(&hp->sum);
+        if(get(&hp->max) > max)
+            max = get(&hp->max);
+    }
+    for(i = 0; i < HIST_BUCKETS; i++)
+        count += merged[i];
+    len = snprintf(buf, maxlen, "\"%s\":{\"count\":%lu,\"mean\":%lu", name,
+        (unsigned long)count, (unsigned long)(count ? sum / count : 0));
+    for(q = 0, i = 0, seen = 0; q < 4; q++){
+        target = (uint64_t)(qs[q] * count);
+        if(target < count)
+            target++; /* 第target个值所在的格 */
+        while(i < HIST_BUCKETS && seen + merged[i] < target)
+            seen += merged[i++];
+        v = i < HIST_BUCKETS && count ? hist_upper(i) : 0;
+        len += snprintf(buf + len, maxlen - len, ",\"%s\":%lu", qnames[q], (unsigned long)(v < max ? v : max));
+    }
+    len += snprintf(buf + len, maxlen - len, ",\"max\":%lu}", (unsigned long)max);
+    Free(merged);
+    return len;
+}
+
+/*
+ * stats_response 编制统计页：合并所有线程的计数器，再加上三个延迟直方图
+ */
+size_t stats_response(char** out)
+{
+    static const char* names[STAT_NCOUNTERS] = { "requests", "hits", "disk_hits", "misses",
+        "stale", "revalidated", "coalesced", "errors", "bytes_in", "bytes_out", "syscalls",
+        "timeout_header", "timeout_body", "timeout_connect", "timeout_idle",
+        "gzip_hits", "gzip_stored" };
+    uint64_t sum[STAT_NCOUNTERS] = { 0 };
+    char body[MAXBUF];
+    size_t len, lookups;
+
+    for(stats_rec *r = __atomic_load_n(&recs, __ATOMIC_ACQUIRE); r; r = r->next)
+        for(int i = 0; i < STAT_NCOUNTERS; i++)
+            sum[i] += get(&r->counters[i]);
+    len = snprintf(body, sizeof(body), "{\"uptime\":%lu", (unsigned long)((stats_now() - started) / 1000000));
+    for(int i = 0; i < STAT_NCOUNTERS; i++)
+        len += snprintf(body + len, sizeof(body) - len, ",\"%s\":%lu", names[i], (unsigned long)sum[i]);
+    /* 得到304的重新验证没有传输内容，算作命中 */
+    lookups = sum[STAT_HITS] + sum[STAT_DISK_HITS] + sum[STAT_MISSES] + sum[STAT_STALE];
+    len += snprintf(body + len, sizeof(body) - len, ",\"hit_ratio\":%.4f",
+        lookups ? (double)(sum[STAT_HITS] + sum[STAT_DISK_HITS] + sum[STAT_REVALIDATED]) / lookups : 0.0);
+    len += snprintf(body + len, sizeof(body) - len, ",\"syscalls_per_request\":%.2f",
+        sum[STAT_REQUESTS] ? (double)sum[STAT_SYSCALLS] / sum[STAT_REQUESTS] : 0.0);
+    body[len++] = ',';
+    len += hist_json(body + len, sizeof(body) - len, "connect_us", HIST_CONNECT);
+    body[len++] = ',';
+    len += hist_json(body + len, sizeof(body) - len, "ttfb_us", HIST_TTFB);
+    body[len++] = ',';
+    len += hist_json(body + len, sizeof(body) - len, "latency_us", HIST_LATENCY);
+    len += snprintf(body + len, sizeof(body) - len, "}\n");
+
+    *out = (char*)Malloc(len + MAXLINE);
+    return snprintf(*out, len + MAXLINE,
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/json\r\n"
+        "Cache-Control: no-store\r\n"
+        "Content-Length: %zu\r\n\r\n%s", len, body);
+}
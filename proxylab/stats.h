@@ -0,0 +1,70 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+/* 此处定义统计相关的常量 */
+#define STATS_URL "/__proxy_stats" /* 直接发给代理的这个URL返回统计信息 */
+#define HIST_SUB_BITS 4 /* 每个2的幂区间再分为16格，相对误差不超过1/16 */
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* 计数器 */
+typedef enum{
+    STAT_REQUESTS,   /* 收到的请求 */
+    STAT_HITS,       /* 内存cache命中 */
+    STAT_DISK_HITS,  /* 磁盘层命中 */
+    STAT_MISSES,     /* 未命中（包括合并到进行中回源的请求） */
+    STAT_STALE,      /* 内存cache命中但已过期，向服务器重新验证 */
+    STAT_REVALIDATED, /* 重新验证得到304，继续使用cache中的内容 */
+    STAT_COALESCED,  /* 合并到进行中回源的请求 */
+    STAT_ERRORS,     /* 返回给客户端的错误 */
+    STAT_BYTES_IN,   /* 从服务器收到的字节 */
+    STAT_BYTES_OUT,  /* 发给客户端的响应字节 */
+    STAT_SYSCALLS,   /* HTTP请求路径上读写socket的系统调用 */
+    STAT_TIMEOUT_HEADER,  /* 以下依次是各类超时关闭的连接，顺序与timeout_kind一致 */
+    STAT_TIMEOUT_BODY,
+    STAT_TIMEOUT_CONNECT,
+    STAT_TIMEOUT_IDLE,
+    STAT_GZIP_HITS,  /* 发给客户端的压缩变体（同时计入内存cache命中） */
+    STAT_GZIP_STORED, /* 生成并存入cache的压缩变体 */
+    STAT_NCOUNTERS
+}stat_counter;
+
+/* 延迟直方图，单位为微秒 */
+typedef enum{
+    HIST_CONNECT,    /* 与服务器建立新连接的耗时 */
+    HIST_TTFB,       /* 从收到请求到收到服务器响应第一个字节 */
+    HIST_LATENCY,    /* 从收到请求到响应发送完毕 */
+    STAT_NHISTS
+}stat_hist;
+
+/* HDR风格的对数-线性直方图 */
+typedef struct{
+    uint64_t sum, max;
+    uint64_t buckets[HIST_BUCKETS];
+}stats_histogram;
+
+/* 每个线程的统计，只由所属的线程写入，读取时把所有线程的合并，不需要加锁 */
+typedef struct stats_rec{
+    struct stats_rec *next;
+    int used; /* 已被某个线程占用；线程退出后计数保留，由之后的线程接着累加 */
+    uint64_t counters[STAT_NCOUNTERS];
+    stats_histogram hists[STAT_NHISTS];
+}stats_rec;
+
+/* 记录进程启动时间 */
+void stats_init(void);
+/* 单调时钟的当前微秒数 */
+uint64_t stats_now(void);
+/* 累加本线程的计数器 */
+void stats_add(stat_counter c, uint64_t n);
+/* 向本线程的直方图记录一个值 */
+void stats_record(stat_hist h, uint64_t usec);
+/* 请求的URL是否为统计页 */
+int stats_request(char* url);
+/* 编制统计页的完整HTTP响应（JSON），返回长度，*out需要Free */
+size_t stats_response(char** out);
+
+#endif
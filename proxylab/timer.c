@@ -0,0 +1,262 @@
+/*
+ * 超时与分层时间轮
+ * 定时器嵌在连接等对象中，按到期的tick挂入时间轮的格，插入、删除与每个tick的推进都是O(1)，
+ * 连接数再多也不需要排序或堆；远期的定时器先放在高层的粗格中，低层转完一圈时再逐层下放（见cascade）
+ * epoll模式下每个事件循环有自己的时间轮，不需要加锁（见event.c）；
+ * 阻塞I/O模式下的线程阻塞在读写上，无法自己检查期限，由一个全局时间轮与后台线程代为看守：
+ * 期限到时shutdown连接，使阻塞的读写返回（见timer_watch）
+ */
+
+#include <limits.h>
+#include "timer.h"
+#include "stats.h"
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_RANGE ((uint64_t)1 << (TIMER_BITS * TIMER_LEVELS)) /* 能表示的最远tick数 */
+
+int timeouts[TO_NKINDS] = { 10, 60, 10, 15 };
+
+static const char* names[TO_NKINDS] = { "header", "body", "connect", "idle" };
+static timer_wheel watch_wheel; /* 阻塞I/O模式下所有连接的看门狗 */
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int timeout_parse(char* arg)
+{
+    char *eq = strchr(arg, '='), *end;
+    long secs;
+
+    if(eq == NULL)
+        return -1;
+    secs = strtol(eq + 1, &end, 10);
+    if(end == eq + 1 || *end != '\0' || secs < 0 || secs > INT_MAX / 1000)
+        return -1;
+    for(int i = 0; i < TO_NKINDS; i++)
+        if(strncmp(names[i], arg, eq - arg) == 0 && names[i][eq - arg] == '\0'){
+            timeouts[i] = (int)secs;
+            return 0;
+        }
+    return -1;
+}
+
+uint64_t timer_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_init(timer_wheel* w)
+{
+    w->tick = timer_now() / TIMER_TICK_MS;
+    w->count = 0;
+    for(int l = 0; l < TIMER_LEVELS; l++)
+        for(int i = 0; i < TIMER_SLOTS; i++)
+            w->slots[l][i].next = w->slots[l][i].prev = &w->slots[l][i];
+}
+
+/*
+ * place 按距到期的tick数选层：第l层容纳TIMER_SLOTS^(l+1)个tick以内的定时器，
+ * 格由到期tick的第l组TIMER_BITS位决定；已经过期的放到下一个要处理的格
+ */
+static void place(timer_wheel* w, timer_node* t)
+{
+    uint64_t delta;
+    timer_node *head;
+    int l;
+
+    if(t->expires < w->tick)
+        t->expires = w->tick;
+    delta = t->expires - w->tick;
+    if(delta >= TIMER_RANGE){
+        t->expires = w->tick + TIMER_RANGE - 1;
+        delta = TIMER_RANGE - 1;
+    }
+    for(l = 0; l < TIMER_LEVELS - 1 && delta >= (uint64_t)1 << (TIMER_BITS * (l + 1)); l++)
+        ;
+    head = &w->slots[l][(t->expires >> (TIMER_BITS * l)) & TIMER_MASK];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void unlink_node(timer_node* t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+void timer_add(timer_wheel* w, timer_node* t, uint64_t when)
+{
+    uint64_t tick;
+
+    if(t->prev)
+        unlink_node(t);
+    else if(w->count++ == 0 && (tick = timer_now() / TIMER_TICK_MS) > w->tick)
+        w->tick = tick; /* 轮空闲时不推进，直接跳到现在 */
+    t->expires = (when + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    place(w, t);
+}
+
+void timer_del(timer_wheel* w, timer_node* t)
+{
+    if(t->prev == NULL)
+        return;
+    unlink_node(t);
+    w->count--;
+}
+
+/*
+ * cascade 把第l层第i格的定时器按现在的tick重新放置，它们都会落到更低的层
+ */
+static void cascade(timer_wheel* w, int l, int i)
+{
+    timer_node *head = &w->slots[l][i], *t;
+
+    while((t = head->next) != head){
+        unlink_node(t);
+        place(w, t);
+    }
+}
+
+void timer_advance(timer_wheel* w, uint64_t now, void* arg)
+{
+    uint64_t target = now / TIMER_TICK_MS;
+    timer_node *head, *t;
+    int i;
+
+    while(w->count > 0 && w->tick <= target){
+        i = w->tick & TIMER_MASK;
+        /* 第0层转完一圈，从上一层取下一格；上一层也转完一圈时继续向上 */
+        for(int l = 1; i == 0 && l < TIMER_LEVELS; l++){
+            int j = (w->tick >> (TIMER_BITS * l)) & TIMER_MASK;
+            cascade(w, l, j);
+            if(j != 0)
+                break;
+        }
+        head = &w->slots[0][i];
+        w->tick++; /* 回调中重新加入的定时器不会落回正在处理的格 */
+        while((t = head->next) != head){
+            unlink_node(t);
+            w->count--;
+            t->fn(t, arg);
+        }
+    }
+    if(w->count == 0)
+        w->tick = target + 1;
+}
+
+int timer_wait_ms(timer_wheel* w, uint64_t now)
+{
+    uint64_t next = w->tick * TIMER_TICK_MS;
+
+    if(w->count == 0)
+        return -1;
+    return next > now ? (int)(next - now) : 0;
+}
+
+/*
+ * watch_fire 看门狗到期（持有watch_lock）：所属线程推后了期限时按新的期限重新挂上，
+ * 否则计数并shutdown连接，阻塞的读写随即返回，由所属线程照常关闭
+ */
+static void watch_fire(timer_node* t, void* arg)
+{
+    timer_watch *w = (timer_watch*)t;
+    uint64_t d = __atomic_load_n(&w->deadline, __ATOMIC_RELAXED);
+
+    if(d == TIMER_NEVER)
+        return;
+    if((d >> 2) > *(uint64_t*)arg){
+        timer_add(&watch_wheel, t, d >> 2);
+        return;
+    }
+    stats_add(STAT_TIMEOUT_HEADER + (d & 3), 1);
+    __atomic_store_n(&w->fired, 1, __ATOMIC_RELAXED);
+    shutdown(w->clientfd, SHUT_RDWR);
+    if(w->serverfd >= 0)
+        shutdown(w->serverfd, SHUT_RDWR);
+}
+
+/*
+ * watcher 后台线程，每个tick推进一次全局时间轮
+ */
+static void* watcher(void* vargp)
+{
+    struct timespec ts = { 0, TIMER_TICK_MS * 1000000L };
+    uint64_t now;
+
+    Pthread_detach(pthread_self());
+    while(1){
+        nanosleep(&ts, NULL);
+        now = timer_now();
+        pthread_mutex_lock(&watch_lock);
+        timer_advance(&watch_wheel, now, &now);
+        pthread_mutex_unlock(&watch_lock);
+    }
+    return NULL;
+}
+
+void watch_start(void)
+{
+    pthread_t tid;
+
+    timer_init(&watch_wheel);
+    Pthread_create(&tid, NULL, watcher, NULL);
+}
+
+void watch_begin(timer_watch* w, int clientfd)
+{
+    w->node.next = w->node.prev = NULL;
+    w->node.fn = watch_fire;
+    w->deadline = TIMER_NEVER;
+    w->clientfd = clientfd;
+    w->serverfd = -1;
+    w->fired = 0;
+}
+
+/*
+ * watch_set 期限只由所属线程修改：推后时只写deadline，到期时watch_fire会发现并重新挂上；
+ * 提前时（如从不限时进入某个阶段）才加锁重新挂到时间轮上
+ */
+void watch_set(timer_watch* w, timeout_kind kind)
+{
+    uint64_t when, old = w->deadline;
+
+    if(timeouts[kind] == 0){
+        watch_clear(w);
+        return;
+    }
+    when = timer_now() + (uint64_t)timeouts[kind] * 1000;
+    __atomic_store_n(&w->deadline, when << 2 | kind, __ATOMIC_RELAXED);
+    if(old != TIMER_NEVER && (old >> 2) <= when)
+        return;
+    pthread_mutex_lock(&watch_lock);
+    timer_add(&watch_wheel, &w->node, when);
+    pthread_mutex_unlock(&watch_lock);
+}
+
+void watch_clear(timer_watch* w)
+{
+    __atomic_store_n(&w->deadline, TIMER_NEVER, __ATOMIC_RELAXED);
+}
+
+void watch_server(timer_watch* w, int fd)
+{
+    pthread_mutex_lock(&watch_lock);
+    w->serverfd = fd;
+    pthread_mutex_unlock(&watch_lock);
+}
+
+int watch_fired(timer_watch* w)
+{
+    return __atomic_load_n(&w->fired, __ATOMIC_RELAXED);
+}
+
+void watch_end(timer_watch* w)
+{
+    pthread_mutex_lock(&watch_lock);
+    timer_del(&watch_wheel, &w->node);
+    pthread_mutex_unlock(&watch_lock);
+}
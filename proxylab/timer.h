@@ -0,0 +1,90 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+/* 此处定义时间轮相关的常量 */
+#define TIMER_TICK_MS 100 /* 一格的毫秒数，即超时的精度 */
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS) /* 每层的格数 */
+#define TIMER_LEVELS 4 /* 层数，最远可以定到TIMER_SLOTS^TIMER_LEVELS格之后（约19天） */
+#define TIMER_NEVER UINT64_MAX /* 不限时 */
+
+/* 各类超时，下标与STAT_TIMEOUT_*计数器一一对应 */
+typedef enum{
+    TO_HEADER,  /* 收到请求的第一个字节后，读完整个请求头的期限 */
+    TO_BODY,    /* 转发响应或向客户端写数据时，两次进展之间的最长间隔 */
+    TO_CONNECT, /* 解析与连接服务器的期限 */
+    TO_IDLE,    /* 长连接上等待下一个请求的期限 */
+    TO_NKINDS
+}timeout_kind;
+
+/* 各类超时的秒数，0表示不限；可由-t修改 */
+extern int timeouts[TO_NKINDS];
+
+/*
+ * 挂在时间轮上的定时器，嵌在所属的对象中
+ * 同一格中的定时器组成带哨兵的双向循环链表，插入与删除都是O(1)
+ */
+typedef struct timer_node{
+    struct timer_node *next, *prev; /* 不在时间轮上时为NULL */
+    uint64_t expires; /* 到期的格 */
+    void (*fn)(struct timer_node* t, void* arg); /* 到期时调用，此时已从时间轮上摘下 */
+}timer_node;
+
+/*
+ * 分层时间轮：第0层每格一个tick，第k层每格TIMER_SLOTS^k个tick
+ * 定时器按距到期的远近放入对应的层，低层转完一圈时把上一层的一格重新分散到低层，
+ * 每个定时器最多被搬动TIMER_LEVELS-1次；时间轮本身不加锁
+ */
+typedef struct{
+    uint64_t tick; /* 下一个要处理的格 */
+    size_t count; /* 轮上的定时器数 */
+    timer_node slots[TIMER_LEVELS][TIMER_SLOTS]; /* 各格链表的哨兵 */
+}timer_wheel;
+
+/* 解析-t的参数name=secs，name为header、body、connect或idle，成功返回0 */
+int timeout_parse(char* arg);
+/* 单调时钟的毫秒数 */
+uint64_t timer_now(void);
+void timer_init(timer_wheel* w);
+/* 把t挂到时间轮上，在when（timer_now的时间轴）之后的第一个tick到期；t已在轮上时先摘下 */
+void timer_add(timer_wheel* w, timer_node* t, uint64_t when);
+/* 摘下t，t不在轮上时什么也不做 */
+void timer_del(timer_wheel* w, timer_node* t);
+/* 处理到now为止的所有tick，依次调用到期定时器的fn(t, arg) */
+void timer_advance(timer_wheel* w, uint64_t now, void* arg);
+/* 下一个tick距now的毫秒数，轮上没有定时器时返回-1，可用作epoll_wait的超时 */
+int timer_wait_ms(timer_wheel* w, uint64_t now);
+
+/*
+ * 阻塞I/O模式下一个连接的看门狗
+ * 所属线程在阶段变化或取得进展时设置新的期限，期限推后时只做一次原子写；
+ * 全局时间轮由后台线程推进，到期时若期限没有被推后，就shutdown连接的描述符，
+ * 使阻塞在读写上的线程立即返回
+ */
+typedef struct{
+    timer_node node;
+    uint64_t deadline; /* (毫秒 << 2) | 超时类别；TIMER_NEVER表示不限 */
+    int clientfd;
+    int serverfd; /* 没有服务器连接时为-1 */
+    int fired; /* 已超时，连接已被shutdown */
+}timer_watch;
+
+/* 启动推进全局时间轮的后台线程 */
+void watch_start(void);
+/* 开始看守clientfd，初始不限时 */
+void watch_begin(timer_watch* w, int clientfd);
+/* 进入kind类的阶段或取得进展：期限改为现在起timeouts[kind]秒 */
+void watch_set(timer_watch* w, timeout_kind kind);
+/* 不再限时（如隧道） */
+void watch_clear(timer_watch* w);
+/* 设置（fd >= 0）或撤销（fd = -1）同时被看守的服务器连接，撤销之后fd可以安全地关闭或交还连接池 */
+void watch_server(timer_watch* w, int fd);
+/* 是否已经超时 */
+int watch_fired(timer_watch* w);
+/* 停止看守，之后clientfd可以安全地关闭 */
+void watch_end(timer_watch* w);
+
+#endif
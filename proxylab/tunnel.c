@@ -0,0 +1,137 @@
+/*
+ * 基于splice()的CONNECT隧道
+ * 每个方向使用一个管道，数据在内核中从一个套接字搬到另一个套接字；
+ * 多线程路径由tunnel_run在一个线程中用poll同时驱动两个方向，
+ * 事件驱动路径直接在事件循环中调用splice_pump
+ * splice需要_GNU_SOURCE，而csapp.h与GNU扩展的netdb.h声明冲突，故本文件不包含csapp.h
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "tunnel.h"
+
+#define SPLICE_ROUNDS 16 /* 每次调用最多搬运的轮数，避免一个隧道饿死事件循环中的其他连接 */
+
+/*
+ * splice_open 创建管道
+ */
+int splice_open(splice_pipe* sp)
+{
+    sp->inpipe = sp->bytes = 0;
+    sp->eof = sp->shut = 0;
+    if (pipe2(sp->pipefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        sp->pipefd[0] = sp->pipefd[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * splice_close 关闭管道
+ */
+void splice_close(splice_pipe* sp)
+{
+    if (sp->pipefd[0] >= 0) {
+        close(sp->pipefd[0]);
+        close(sp->pipefd[1]);
+        sp->pipefd[0] = sp->pipefd[1] = -1;
+    }
+}
+
+/*
+ * splice_pump 先把管道中的数据写到dst，再从src读入管道，直到阻塞
+ * 源端关闭且管道已空时，向dst传递半关闭
+ */
+int splice_pump(splice_pipe* sp, int src, int dst)
+{
+    ssize_t n;
+
+    for (int round = 0; round < SPLICE_ROUNDS; round++) {
+        while (sp->inpipe > 0) {
+            n = splice(sp->pipefd[0], NULL, dst, NULL, sp->inpipe,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return (errno == EAGAIN) ? 0 : -1;
+            }
+            sp->inpipe -= n;
+            sp->bytes += n;
+        }
+        if (sp->eof) {
+            if (!sp->shut) {
+                shutdown(dst, SHUT_WR);
+                sp->shut = 1;
+            }
+            return 0;
+        }
+        n = splice(src, NULL, sp->pipefd[1], NULL, SPLICE_CHUNK,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN) ? 0 : -1;
+        }
+        if (n == 0)
+            sp->eof = 1;
+        sp->inpipe += n;
+    }
+    return 0;
+}
+
+int splice_want_src(splice_pipe* sp)
+{
+    return sp->inpipe == 0 && !sp->eof;
+}
+
+int splice_want_dst(splice_pipe* sp)
+{
+    return sp->inpipe > 0;
+}
+
+int splice_done(splice_pipe* sp)
+{
+    return sp->eof && sp->inpipe == 0;
+}
+
+/*
+ * tunnel_run 在当前线程中双向转发，两个方向都结束或出错时返回
+ * 管道创建失败时返回-1，此时还没有转发任何数据
+ */
+int tunnel_run(int clientfd, int serverfd, size_t* up_bytes, size_t* down_bytes)
+{
+    splice_pipe up, down; /* up: 客户端 -> 服务器, down: 服务器 -> 客户端 */
+    struct pollfd pfd[2];
+
+    if (splice_open(&up) < 0)
+        return -1;
+    if (splice_open(&down) < 0) {
+        splice_close(&up);
+        return -1;
+    }
+    fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL) | O_NONBLOCK);
+    fcntl(serverfd, F_SETFL, fcntl(serverfd, F_GETFL) | O_NONBLOCK);
+
+    pfd[0].fd = clientfd;
+    pfd[1].fd = serverfd;
+    while (1) {
+        if (splice_pump(&up, clientfd, serverfd) < 0 || splice_pump(&down, serverfd, clientfd) < 0)
+            break;
+        if (splice_done(&up) && splice_done(&down))
+            break;
+        pfd[0].events = (splice_want_src(&up) ? POLLIN : 0) | (splice_want_dst(&down) ? POLLOUT : 0);
+        pfd[1].events = (splice_want_src(&down) ? POLLIN : 0) | (splice_want_dst(&up) ? POLLOUT : 0);
+        if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+            break;
+    }
+
+    *up_bytes = up.bytes;
+    *down_bytes = down.bytes;
+    splice_close(&up);
+    splice_close(&down);
+    return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#include <stddef.h>
+
+#define SPLICE_CHUNK 65536 /* 每次splice最多搬运的字节数，与管道默认容量相同 */
+
+/* 
+ * 隧道中单个方向的splice管道
+ * 数据由内核从源套接字移入管道，再从管道移入目标套接字，不经过用户空间
+ */
+typedef struct {
+    int pipefd[2];
+    size_t inpipe; /* 管道中尚未写出的字节数 */
+    size_t bytes; /* 已转发的字节数 */
+    int eof; /* 源端已关闭 */
+    int shut; /* 已向目标端传递半关闭 */
+} splice_pipe;
+
+/* 创建管道，失败返回-1（描述符耗尽等），调用者应退回用户空间拷贝 */
+int splice_open(splice_pipe* sp);
+void splice_close(splice_pipe* sp);
+/* 在非阻塞的src与dst之间尽可能多地转发，出错返回-1 */
+int splice_pump(splice_pipe* sp, int src, int dst);
+/* 本方向当前需要等待源端可读/目标端可写 */
+int splice_want_src(splice_pipe* sp);
+int splice_want_dst(splice_pipe* sp);
+/* 本方向是否已经结束 */
+int splice_done(splice_pipe* sp);
+/* 在当前线程中双向转发clientfd与serverfd之间的数据，直到两端都关闭 */
+int tunnel_run(int clientfd, int serverfd, size_t* up_bytes, size_t* down_bytes);
+
+#endif
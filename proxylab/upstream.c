@@ -0,0 +1,210 @@
+/*
+ * 到上游服务器的连接池
+ * 按(host, port)保存与服务器之间保持着的空闲连接，cache未命中时优先复用，
+ * 省去DNS解析、TCP握手与慢启动；空闲过久的连接与已被服务器关闭的连接在取出时丢弃
+ * 每个(host, port)同时使用中的连接数有上限：阻塞模式下名额用完时等待别的请求归还，
+ * 事件驱动模式下不能阻塞，直接失败
+ */
+
+#include "upstream.h"
+#include "dns.h"
+
+static upstream_host *buckets[UPSTREAM_BUCKETS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; /* 保护整个连接池，临界区只有链表操作与计数 */
+static pthread_cond_t freed = PTHREAD_COND_INITIALIZER; /* 有名额被归还 */
+static int max_idle = UPSTREAM_MAX_IDLE;
+static int idle_timeout = UPSTREAM_IDLE_TIMEOUT;
+static int max_active = UPSTREAM_MAX_ACTIVE;
+
+/*
+ * find_host 找到(host, port)对应的项，create非0时不存在则新建
+ */
+static upstream_host* find_host(char* key, int create)
+{
+    unsigned int h = 5381;
+    upstream_host *hp;
+
+    for(char *p = key; *p; p++)
+        h = h * 33 + (unsigned char)*p;
+    for(hp = buckets[h % UPSTREAM_BUCKETS]; hp; hp = hp->next)
+        if(strcmp(hp->key, key) == 0)
+            return hp;
+    if(!create)
+        return NULL;
+    hp = (upstream_host*)Calloc(1, sizeof(upstream_host));
+    hp->key = (char*)Malloc(strlen(key) + 1);
+    strcpy(hp->key, key);
+    hp->next = buckets[h % UPSTREAM_BUCKETS];
+    buckets[h % UPSTREAM_BUCKETS] = hp;
+    return hp;
+}
+
+/*
+ * conn_alive 连接是否仍然可用：服务器关闭连接或多发了数据时都不能再用
+ */
+static int conn_alive(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * upstream_init 设置连接池的参数
+ */
+void upstream_init(int max, int timeout, int active)
+{
+    max_idle = max;
+    idle_timeout = timeout;
+    max_active = active;
+}
+
+/*
+ * upstream_acquire 名额的计数与空闲连接保存在同一项中
+ */
+int upstream_acquire(char* host, char* port, int wait)
+{
+    char key[MAXLINE];
+    upstream_host *hp;
+    struct timespec deadline;
+    int rc = 0;
+
+    snprintf(key, sizeof(key), "%s:%s", host, port);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += UPSTREAM_WAIT;
+    pthread_mutex_lock(&lock);
+    hp = find_host(key, 1);
+    while(max_active > 0 && hp->nactive >= max_active && rc == 0)
+        rc = wait ? pthread_cond_timedwait(&freed, &lock, &deadline) : -1;
+    if(rc == 0)
+        hp->nactive++;
+    pthread_mutex_unlock(&lock);
+    return rc == 0 ? 0 : -1;
+}
+
+void upstream_release(char* host, char* port)
+{
+    char key[MAXLINE];
+    upstream_host *hp;
+
+    snprintf(key, sizeof(key), "%s:%s", host, port);
+    pthread_mutex_lock(&lock);
+    if((hp = find_host(key, 0)) != NULL && hp->nactive > 0)
+        hp->nactive--;
+    pthread_mutex_unlock(&lock);
+    pthread_cond_broadcast(&freed); /* 等待者可能属于不同的服务器 */
+}
+
+/*
+ * upstream_take 取出一条可用的空闲连接，没有时返回-1
+ */
+int upstream_take(char* host, char* port)
+{
+    char key[MAXLINE];
+    upstream_host *hp;
+    upstream_conn *uc;
+    time_t now = time(NULL);
+    int fd;
+
+    snprintf(key, sizeof(key), "%s:%s", host, port);
+    while(1){
+        pthread_mutex_lock(&lock);
+        if((hp = find_host(key, 0)) == NULL || (uc = hp->idle) == NULL){
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
+        hp->idle = uc->next;
+        hp->nidle--;
+        pthread_mutex_unlock(&lock);
+
+        fd = uc->fd;
+        if(now - uc->since <= idle_timeout && conn_alive(fd)){
+            Free(uc);
+            return fd;
+        }
+        Free(uc);
+        close(fd);
+    }
+}
+
+/*
+ * upstream_get 取得到(host, port)的阻塞连接，没有空闲连接时新建
+ */
+int upstream_get(char* host, char* port, int* reused)
+{
+    int fd;
+
+    if(upstream_acquire(host, port, 1) < 0)
+        return -1;
+    if((fd = upstream_take(host, port)) >= 0){
+        *reused = 1;
+        return fd;
+    }
+    *reused = 0;
+    if((fd = dns_connect(host, port)) < 0) /* 地址取自DNS缓存 */
+        upstream_release(host, port);
+    return fd;
+}
+
+void upstream_done(char* host, char* port, int fd, int reusable)
+{
+    if(reusable)
+        upstream_put(host, port, fd);
+    else
+        close(fd);
+    upstream_release(host, port);
+}
+
+/*
+ * upstream_put 把完成了事务的连接放回连接池，顺便清理已经超时的空闲连接
+ */
+void upstream_put(char* host, char* port, int fd)
+{
+    char key[MAXLINE];
+    upstream_host *hp;
+    upstream_conn *uc, **pp, *expired = NULL;
+    time_t now = time(NULL);
+
+    if(max_idle <= 0){
+        close(fd);
+        return;
+    }
+    /* 连接池中的连接统一为阻塞模式，事件驱动路径取出后自行设置 */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    snprintf(key, sizeof(key), "%s:%s", host, port);
+    uc = (upstream_conn*)Malloc(sizeof(upstream_conn));
+    uc->fd = fd;
+    uc->since = now;
+
+    pthread_mutex_lock(&lock);
+    hp = find_host(key, 1);
+    for(pp = &hp->idle; *pp; ){
+        if(now - (*pp)->since > idle_timeout){
+            upstream_conn *old = *pp;
+            *pp = old->next;
+            old->next = expired;
+            expired = old;
+            hp->nidle--;
+        }
+        else
+            pp = &(*pp)->next;
+    }
+    if(hp->nidle < max_idle){
+        uc->next = hp->idle;
+        hp->idle = uc;
+        hp->nidle++;
+        uc = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+
+    if(uc){ /* 超过上限，直接关闭 */
+        close(uc->fd);
+        Free(uc);
+    }
+    while(expired){
+        uc = expired;
+        expired = uc->next;
+        close(uc->fd);
+        Free(uc);
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include "csapp.h"
+
+/* 此处定义连接池相关的常量 */
+#define UPSTREAM_BUCKETS 256
+#define UPSTREAM_MAX_IDLE 8 /* 默认每个(host, port)最多保留的空闲连接数 */
+#define UPSTREAM_IDLE_TIMEOUT 30 /* 默认空闲连接的存活秒数 */
+#define UPSTREAM_MAX_ACTIVE 256 /* 默认每个(host, port)同时使用中的连接数上限 */
+#define UPSTREAM_WAIT 10 /* 阻塞模式下等待名额的最长秒数 */
+
+/* 一条空闲的上游连接 */
+typedef struct upstream_conn{
+    struct upstream_conn *next;
+    int fd;
+    time_t since; /* 放回连接池的时间 */
+}upstream_conn;
+
+/* 一个(host, port)的空闲连接栈，后放回的先取出，保证取到的连接最"热" */
+typedef struct upstream_host{
+    struct upstream_host *next; /* 哈希桶链 */
+    char *key; /* "host:port" */
+    upstream_conn *idle;
+    int nidle;
+    int nactive; /* 已取得名额的连接（使用中或正在建立），不含空闲的 */
+}upstream_host;
+
+/* 
+ * 设置每个(host, port)的空闲连接上限、空闲超时与使用中的连接数上限，
+ * max_idle为0时不复用连接，max_active为0时不限
+ */
+void upstream_init(int max_idle, int idle_timeout, int max_active);
+/* 占用一个到(host, port)的连接名额；名额已满时wait非0则等待至多UPSTREAM_WAIT秒，仍没有时返回-1 */
+int upstream_acquire(char* host, char* port, int wait);
+/* 归还upstream_acquire占用的名额 */
+void upstream_release(char* host, char* port);
+/* 取出一条可用的空闲连接，没有时返回-1；调用者须已占用名额 */
+int upstream_take(char* host, char* port);
+/* 
+ * 占用名额（必要时等待）并取得到(host, port)的阻塞连接，优先复用空闲连接；
+ * *reused表示是否为复用的连接，失败返回-1；用完后调用upstream_done
+ */
+int upstream_get(char* host, char* port, int* reused);
+/* 把连接放回连接池，超过上限时关闭；不归还名额 */
+void upstream_put(char* host, char* port, int fd);
+/* upstream_get取得的连接用完：reusable时放回连接池，否则关闭，并归还名额 */
+void upstream_done(char* host, char* port, int fd, int reusable);
+
+#endif
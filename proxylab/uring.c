@@ -0,0 +1,510 @@
+/*
+ * io_uring收发
+ * thread与pool模式的阻塞路径上，每转发一块响应原本要一次read与一次write；
+ * 改用io_uring后，一块的发送以IOSQE_IO_LINK连在下一块的接收之前，两者由一次io_uring_enter提交，
+ * 内核保证发送完成后才开始接收，接收可以直接写入刚发送完的同一个缓冲区；
+ * 转发期间两条连接注册为固定文件，每个请求不必再查找与引用文件，注册与注销本身也作为SQE随其他请求提交；
+ * 监听套接字上的multishot accept一次提交持续产生新连接，同时到达的多个连接不经系统调用直接取出
+ * 直接使用io_uring_setup等系统调用，不依赖liburing；内核不支持时由调用者退回普通的系统调用
+ * 每个线程有自己的ring，线程退出后留给之后的线程复用
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "uring.h"
+#include "stats.h"
+
+/* SQE的user_data，标识完成的是哪个请求 */
+enum { TAG_FILES = 1, TAG_SEND, TAG_RECV, TAG_CONNECT, TAG_ACCEPT, TAG_TIMEOUT };
+
+static int enabled;
+static uring *rings; /* 所有线程的ring，只增不减 */
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static __thread uring *self;
+static __thread int failed; /* 本线程创建ring失败，不再尝试 */
+static int empty_slots[URING_NSLOTS] = { -1, -1 };
+
+static int sys_setup(unsigned entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, void* arg, unsigned nr)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+/*
+ * ring_destroy 释放ring_create建立的ring；只用于探测与创建失败，正常的ring不释放
+ */
+static void ring_destroy(uring* ur)
+{
+    if(ur->sqes)
+        munmap(ur->sqes, ur->sq_entries * sizeof(struct io_uring_sqe));
+    if(ur->cq_map && ur->cq_map != ur->sq_map)
+        munmap(ur->cq_map, ur->cq_maplen);
+    if(ur->sq_map)
+        munmap(ur->sq_map, ur->sq_maplen);
+    if(ur->fd >= 0)
+        close(ur->fd);
+    Free(ur);
+}
+
+/*
+ * ring_create 建立一个ring并映射SQ、CQ与SQE数组，注册空的固定文件表；失败返回NULL
+ */
+static uring* ring_create(void)
+{
+    struct io_uring_params p;
+    uring *ur = (uring*)Calloc(1, sizeof(uring));
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    if((ur->fd = sys_setup(URING_ENTRIES, &p)) < 0){
+        ring_destroy(ur);
+        return NULL;
+    }
+    ur->sq_maplen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ur->cq_maplen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP){ /* SQ与CQ在同一个映射中 */
+        if(ur->cq_maplen > ur->sq_maplen)
+            ur->sq_maplen = ur->cq_maplen;
+        ur->cq_maplen = ur->sq_maplen;
+    }
+    ur->sq_map = mmap(NULL, ur->sq_maplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ur->fd, IORING_OFF_SQ_RING);
+    if(ur->sq_map == MAP_FAILED){
+        ur->sq_map = NULL;
+        ring_destroy(ur);
+        return NULL;
+    }
+    ur->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP) ? ur->sq_map : mmap(NULL, ur->cq_maplen,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+    if(ur->cq_map == MAP_FAILED){
+        ur->cq_map = NULL;
+        ring_destroy(ur);
+        return NULL;
+    }
+    ur->sq_entries = p.sq_entries;
+    ur->sqes = (struct io_uring_sqe*)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+    if(ur->sqes == MAP_FAILED){
+        ur->sqes = NULL;
+        ring_destroy(ur);
+        return NULL;
+    }
+    sq = (char*)ur->sq_map;
+    cq = (char*)ur->cq_map;
+    ur->sq_head = (unsigned*)(sq + p.sq_off.head);
+    ur->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ur->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    ur->sq_array = (unsigned*)(sq + p.sq_off.array);
+    ur->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ur->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ur->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    /* 固定文件表的槽起初为空，转发时用IORING_OP_FILES_UPDATE填入；注册失败时直接使用fd */
+    ur->fixed = (sys_register(ur->fd, IORING_REGISTER_FILES, empty_slots, URING_NSLOTS) == 0);
+    ur->slots[URING_SLOT_CLIENT] = ur->slots[URING_SLOT_SERVER] = -1;
+    ur->acc_multishot = 1;
+    return ur;
+}
+
+int uring_init(void)
+{
+    static const int ops[] = { IORING_OP_ACCEPT, IORING_OP_CONNECT, IORING_OP_SENDMSG,
+        IORING_OP_RECV, IORING_OP_FILES_UPDATE, IORING_OP_LINK_TIMEOUT };
+    struct io_uring_probe *pr;
+    uring *ur;
+    int ok;
+
+    if((ur = ring_create()) == NULL)
+        return -1;
+    pr = (struct io_uring_probe*)Calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+    ok = (sys_register(ur->fd, IORING_REGISTER_PROBE, pr, 256) == 0);
+    for(int i = 0; ok && i < (int)(sizeof(ops) / sizeof(ops[0])); i++)
+        ok = ops[i] <= pr->last_op && (pr->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    Free(pr);
+    /* 探测用的ring不留用：多进程模式下在fork之前调用，继承的ring会被各进程同时使用 */
+    ring_destroy(ur);
+    if(!ok)
+        return -1;
+    enabled = 1;
+    return 0;
+}
+
+/*
+ * ring_release 线程退出时交还ring，此时它上面没有在途的请求
+ */
+static void ring_release(void* p)
+{
+    __atomic_store_n(&((uring*)p)->used, 0, __ATOMIC_RELEASE);
+}
+
+static void key_create(void)
+{
+    pthread_key_create(&key, ring_release);
+}
+
+uring* uring_get(void)
+{
+    uring *r;
+    int zero;
+
+    if(self || !enabled || failed)
+        return self;
+    pthread_once(&once, key_create);
+    for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next){
+        zero = 0;
+        if(!__atomic_load_n(&r->used, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(&r->used, &zero, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if(r == NULL){
+        if((r = ring_create()) == NULL){ /* 如超出RLIMIT_MEMLOCK，本线程继续用普通的系统调用 */
+            failed = 1;
+            return NULL;
+        }
+        r->used = 1;
+        r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&rings, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(key, r);
+    return self = r;
+}
+
+/*
+ * sqe_get 取得下一个SQE并立即计入SQ；调用者随后填写，内核在下一次io_uring_enter时才读取
+ */
+static struct io_uring_sqe* sqe_get(uring* ur, int op, int tag)
+{
+    unsigned tail = *ur->sq_tail;
+    struct io_uring_sqe *sqe = &ur->sqes[tail & ur->sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->user_data = tag;
+    ur->sq_array[tail & ur->sq_mask] = tail & ur->sq_mask;
+    __atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/*
+ * sqe_fd 已注册为固定文件的fd改用槽号
+ */
+static void sqe_fd(uring* ur, struct io_uring_sqe* sqe, int fd)
+{
+    sqe->fd = fd;
+    for(int i = 0; i < URING_NSLOTS; i++)
+        if(ur->slots[i] == fd){
+            sqe->fd = i;
+            sqe->flags |= IOSQE_FIXED_FILE;
+            break;
+        }
+}
+
+/*
+ * ring_enter 提交所有排队的SQE，wait非0时等到至少一个完成
+ */
+static int ring_enter(uring* ur, unsigned wait)
+{
+    unsigned submit;
+    int rc;
+
+    do{
+        submit = *ur->sq_tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+        if(submit == 0 && wait == 0)
+            return 0;
+        rc = sys_enter(ur->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+    }while(rc < 0 && errno == EINTR);
+    if(*ur->sq_tail == __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE))
+        ur->send_sqe = NULL;
+    return rc < 0 ? -1 : 0;
+}
+
+/*
+ * reap 取出所有已完成的CQE，按user_data记下结果
+ */
+static void reap(uring* ur)
+{
+    unsigned head = *ur->cq_head, tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+    struct io_uring_cqe *cqe;
+
+    for(; head != tail; head++){
+        cqe = &ur->cqes[head & ur->cq_mask];
+        switch(cqe->user_data){
+        case TAG_SEND:
+            ur->send_res = cqe->res;
+            ur->send_done = 1;
+            break;
+        case TAG_RECV:
+            ur->recv_res = cqe->res;
+            ur->recv_done = 1;
+            break;
+        case TAG_CONNECT:
+            ur->conn_res = cqe->res;
+            ur->conn_done = 1;
+            break;
+        }
+    }
+    __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * wait_for 提交排队的SQE并等待，直到*done被reap置位；每次io_uring_enter计为一次系统调用
+ */
+static int wait_for(uring* ur, int* done)
+{
+    while(1){
+        reap(ur);
+        if(*done)
+            return 0;
+        stats_add(STAT_SYSCALLS, 1);
+        if(ring_enter(ur, 1) < 0)
+            return -1;
+    }
+}
+
+/*
+ * send_finish 检查已完成的发送；不完整时（如被信号打断）用writev补发剩余的部分
+ */
+static int send_finish(uring* ur)
+{
+    struct iovec *v = ur->iov;
+    int cnt = ur->msg.msg_iovlen;
+    ssize_t n = ur->send_res;
+    size_t done;
+
+    ur->send_pending = 0;
+    if(n < 0)
+        return -1;
+    for(done = n; cnt > 0 && done >= v->iov_len; v++, cnt--)
+        done -= v->iov_len;
+    if(cnt > 0){
+        v->iov_base = (char*)v->iov_base + done;
+        v->iov_len -= done;
+    }
+    while(cnt > 0){
+        stats_add(STAT_SYSCALLS, 1);
+        if((n = writev(ur->send_fd, v, cnt)) < 0){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        for(; cnt > 0 && (size_t)n >= v->iov_len; v++, cnt--)
+            n -= v->iov_len;
+        if(cnt > 0){
+            v->iov_base = (char*)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * send_flush 单独完成排队或在途的发送，不再连接后面的接收
+ */
+static int send_flush(uring* ur)
+{
+    if(!ur->send_pending)
+        return 0;
+    if(ur->send_sqe)
+        ur->send_sqe->flags &= ~IOSQE_IO_LINK;
+    if(wait_for(ur, &ur->send_done) < 0){
+        ur->send_pending = 0;
+        return -1;
+    }
+    return send_finish(ur);
+}
+
+int uring_accept(uring* ur, int listenfd)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    int res, more, tag;
+
+    while(1){
+        head = *ur->cq_head;
+        if(head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)){
+            cqe = &ur->cqes[head & ur->cq_mask];
+            res = cqe->res;
+            tag = (int)cqe->user_data;
+            more = cqe->flags & IORING_CQE_F_MORE;
+            __atomic_store_n(ur->cq_head, head + 1, __ATOMIC_RELEASE);
+            if(tag != TAG_ACCEPT)
+                continue;
+            if(!more) /* multishot已终止，下次重新提交 */
+                ur->acc_armed = 0;
+            if(res >= 0)
+                return res;
+            if(res == -EINVAL && ur->acc_multishot){
+                ur->acc_multishot = 0;
+                continue;
+            }
+            errno = -res;
+            return -1;
+        }
+        if(!ur->acc_armed){
+            sqe = sqe_get(ur, IORING_OP_ACCEPT, TAG_ACCEPT);
+            sqe->fd = listenfd;
+            if(ur->acc_multishot)
+                sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            ur->acc_armed = 1;
+        }
+        if(ring_enter(ur, 1) < 0)
+            return -1;
+    }
+}
+
+/*
+ * uring_connect 限时的连接：ring上用IORING_OP_LINK_TIMEOUT连在connect之后，到期时取消connect；
+ * 没有ring时用SO_SNDTIMEO限制阻塞的connect，连接建立后恢复为不限时
+ */
+int uring_connect(uring* ur, int fd, const struct sockaddr* addr, socklen_t len, int ms)
+{
+    struct io_uring_sqe *sqe;
+    struct __kernel_timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+    int rc;
+
+    if(ur == NULL){
+        if(ms == 0)
+            return connect(fd, addr, len);
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if((rc = connect(fd, addr, len)) < 0 && errno == EINPROGRESS)
+            errno = ETIMEDOUT; /* SO_SNDTIMEO到期 */
+        tv.tv_sec = tv.tv_usec = 0;
+        if(rc == 0)
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        return rc;
+    }
+    sqe = sqe_get(ur, IORING_OP_CONNECT, TAG_CONNECT);
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)addr;
+    sqe->off = len;
+    if(ms > 0){
+        /* 提交时内核即复制ts，之后栈上的ts不再需要；超时的CQE由reap丢弃 */
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = sqe_get(ur, IORING_OP_LINK_TIMEOUT, TAG_TIMEOUT);
+        sqe->fd = -1;
+        sqe->addr = (unsigned long)&ts;
+        sqe->len = 1;
+    }
+    ur->conn_done = 0;
+    if(wait_for(ur, &ur->conn_done) < 0)
+        return -1;
+    if(ur->conn_res < 0){
+        errno = ur->conn_res == -ECANCELED ? ETIMEDOUT : -ur->conn_res;
+        return -1;
+    }
+    return 0;
+}
+
+void uring_relay_begin(uring* ur, int clientfd, int serverfd)
+{
+    struct io_uring_sqe *sqe;
+
+    if(!ur->fixed)
+        return;
+    ur->update[URING_SLOT_CLIENT] = clientfd;
+    ur->update[URING_SLOT_SERVER] = serverfd;
+    /* 在提交时同步完成，之后的SQE已能使用这两个槽 */
+    sqe = sqe_get(ur, IORING_OP_FILES_UPDATE, TAG_FILES);
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)ur->update;
+    sqe->len = URING_NSLOTS;
+    sqe->off = 0;
+    ur->slots[URING_SLOT_CLIENT] = clientfd;
+    ur->slots[URING_SLOT_SERVER] = serverfd;
+}
+
+void uring_send(uring* ur, int fd, const struct iovec* iov, int cnt)
+{
+    struct io_uring_sqe *sqe;
+
+    if(ur->send_pending && send_flush(ur) < 0)
+        ur->send_err = 1;
+    memcpy(ur->iov, iov, cnt * sizeof(struct iovec));
+    memset(&ur->msg, 0, sizeof(ur->msg));
+    ur->msg.msg_iov = ur->iov;
+    ur->msg.msg_iovlen = cnt;
+    ur->send_len = 0;
+    for(int i = 0; i < cnt; i++)
+        ur->send_len += iov[i].iov_len;
+    sqe = sqe_get(ur, IORING_OP_SENDMSG, TAG_SEND);
+    sqe_fd(ur, sqe, fd);
+    sqe->addr = (unsigned long)&ur->msg;
+    sqe->msg_flags = MSG_WAITALL; /* 发送不完整时内核继续发送，而不是带着不足值执行后面的接收 */
+    sqe->flags |= IOSQE_IO_LINK;
+    ur->send_sqe = sqe;
+    ur->send_fd = fd;
+    ur->send_pending = 1;
+    ur->send_done = 0;
+}
+
+/*
+ * uring_recv 发送失败时连在后面的接收被内核取消；发送不完整而补发成功时重新接收
+ */
+ssize_t uring_recv(uring* ur, int fd, char* buf, size_t n)
+{
+    struct io_uring_sqe *sqe;
+    int sent = ur->send_pending;
+
+    while(1){
+        sqe = sqe_get(ur, IORING_OP_RECV, TAG_RECV);
+        sqe_fd(ur, sqe, fd);
+        sqe->addr = (unsigned long)buf;
+        sqe->len = n;
+        ur->recv_done = 0;
+        if(wait_for(ur, &ur->recv_done) < 0)
+            return -1;
+        if(!sent)
+            break;
+        sent = 0;
+        if(wait_for(ur, &ur->send_done) < 0 || send_finish(ur) < 0 || ur->send_err){
+            ur->send_err = 0;
+            return URING_ESEND;
+        }
+        if(ur->recv_res != -ECANCELED)
+            break;
+    }
+    if(ur->recv_res < 0){
+        errno = -ur->recv_res;
+        return -1;
+    }
+    return ur->recv_res;
+}
+
+int uring_flush(uring* ur)
+{
+    int rc = send_flush(ur) < 0 || ur->send_err ? -1 : 0;
+
+    ur->send_err = 0;
+    return rc;
+}
+
+void uring_relay_end(uring* ur)
+{
+    struct io_uring_sqe *sqe;
+
+    if(!ur->fixed)
+        return;
+    sqe = sqe_get(ur, IORING_OP_FILES_UPDATE, TAG_FILES);
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)empty_slots;
+    sqe->len = URING_NSLOTS;
+    sqe->off = 0;
+    ur->slots[URING_SLOT_CLIENT] = ur->slots[URING_SLOT_SERVER] = -1;
+    /* 注销在提交时同步完成，调用者随后关闭的连接不再被固定文件表引用 */
+    stats_add(STAT_SYSCALLS, 1);
+    ring_enter(ur, 0);
+}
@@ -0,0 +1,66 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+#include "csapp.h"
+
+/* 此处定义io_uring相关的常量 */
+#define URING_ENTRIES 32 /* 每个ring的SQ长度，阻塞路径上同时在途的请求不超过几个 */
+#define URING_IOV_MAX 256 /* 一次发送的iovec个数上限，不少于REQ_IOV_MAX */
+#define URING_ESEND (-2) /* uring_recv的返回值：排在接收之前的发送失败 */
+
+/* 固定文件槽：转发期间客户端与服务器的连接注册在这两个槽中 */
+enum { URING_SLOT_CLIENT, URING_SLOT_SERVER, URING_NSLOTS };
+
+/*
+ * 每个线程的io_uring实例，线程退出后留给之后的线程复用
+ * 同一时刻最多有一个排队的发送：它以IOSQE_IO_LINK连在下一次接收之前，与接收一起提交，
+ * 一个块的发送与下一个块的接收只需一次io_uring_enter
+ */
+typedef struct uring{
+    struct uring *next;
+    int used; /* 已被某个线程占用 */
+    int fd;
+    void *sq_map, *cq_map;
+    size_t sq_maplen, cq_maplen;
+    unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+    int fixed; /* 固定文件表注册成功 */
+    int slots[URING_NSLOTS]; /* 固定文件槽中的fd，-1为空 */
+    int update[URING_NSLOTS]; /* IORING_OP_FILES_UPDATE读取的新内容，提交前须保持不变 */
+    /* 排队或在途的发送 */
+    struct io_uring_sqe *send_sqe; /* 尚未提交时指向它的SQE，否则为NULL */
+    struct msghdr msg;
+    struct iovec iov[URING_IOV_MAX];
+    int send_fd, send_pending, send_done;
+    int send_err; /* 被下一次发送挤出的发送失败了，由之后的uring_recv或uring_relay_end报告 */
+    size_t send_len;
+    int send_res;
+    int recv_done, recv_res;
+    int conn_done, conn_res;
+    int acc_armed, acc_multishot; /* multishot accept已提交；内核不支持multishot时退回每次一个 */
+}uring;
+
+/* 检查内核是否支持所需的操作，可用时启用io_uring并返回0，否则返回-1，调用者继续使用阻塞的系统调用 */
+int uring_init(void);
+/* 本线程的ring；未启用或创建失败时返回NULL */
+uring* uring_get(void);
+/* 用multishot accept接受连接：一次提交持续产生新连接，已完成的连接不经系统调用直接取出；出错返回-1 */
+int uring_accept(uring* ur, int listenfd);
+/* 在阻塞的socket上建立连接，ur为NULL时直接调用connect；ms毫秒（0表示不限）内没有建立时失败，
+ * errno为ETIMEDOUT；失败返回-1并设置errno */
+int uring_connect(uring* ur, int fd, const struct sockaddr* addr, socklen_t len, int ms);
+/* 开始在clientfd与serverfd之间转发：两者注册为固定文件，随下一次提交生效 */
+void uring_relay_begin(uring* ur, int clientfd, int serverfd);
+/* 把iov排队发往fd，与下一次uring_recv一起提交；iov中的内容须保持不变直到那时 */
+void uring_send(uring* ur, int fd, const struct iovec* iov, int cnt);
+/* 提交排队的发送与这次接收，等待接收完成；返回收到的字节数，出错返回-1，排队的发送失败时返回URING_ESEND */
+ssize_t uring_recv(uring* ur, int fd, char* buf, size_t n);
+/* 完成排队的发送，失败时返回-1；发送的内容之后不再需要保持 */
+int uring_flush(uring* ur);
+/* 结束转发：注销固定文件，此后调用者可以关闭这两条连接 */
+void uring_relay_end(uring* ur);
+
+#endif
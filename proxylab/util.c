@@ -0,0 +1,35 @@
+/*
+ * 代理与cachesim共用的小工具函数
+ */
+
+#include "util.h"
+
+/*
+ * hash_url 计算URL的FNV-1a哈希值
+ */
+unsigned int hash_url(const char* url)
+{
+    unsigned int h = 2166136261u;
+
+    for(; *url; url++){
+        h ^= (unsigned char)*url;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * parse_size 解析带K/M/G后缀的字节数
+ */
+size_t parse_size(const char* s)
+{
+    char *end;
+    size_t n = strtoul(s, &end, 10);
+
+    switch(*end){
+    case 'g': case 'G': n <<= 10; /* fall through */
+    case 'm': case 'M': n <<= 10; /* fall through */
+    case 'k': case 'K': n <<= 10;
+    }
+    return n;
+}
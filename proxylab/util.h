@@ -0,0 +1,11 @@
+#ifndef __UTIL_H__
+#define __UTIL_H__
+
+#include "csapp.h"
+
+/* URL的FNV-1a哈希值，cache、磁盘层与回源表都用它选择桶 */
+unsigned int hash_url(const char* url);
+/* 解析带K/M/G后缀的字节数，如"64M" */
+size_t parse_size(const char* s);
+
+#endif